@@ -0,0 +1,174 @@
+/***************************************************************************
+                       bench_emulator.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Runs read, flash and erase workloads against emulated devices, one
+ thread per unit, and reports cycles and words per second.  A flash
+ cycle is what the tool does for every unit: read the eeprom, write
+ the words that differ, read them back and reset the device.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ftdi_dev.h"
+#include "ftdi_emu.h"
+
+enum workload { WORK_READ, WORK_FLASH, WORK_ERASE };
+
+struct bench_job {
+	struct fdev_info info;
+	int workload;
+	int cycles;
+	long words;     /**< words transferred */
+	int failed;
+	pthread_t thread;
+};
+
+/**
+ * @brief Run one flash cycle with an image derived from the current contents
+ **/
+static int flash_cycle(struct fdev *dev, int cycle, long *words)
+{
+	unsigned char old[FTDI_MAX_EEPROM_SIZE], image[FTDI_MAX_EEPROM_SIZE];
+	unsigned short val;
+	int i, size;
+
+	if (fdev_read_eeprom(dev, old, &size) < 0)
+		return -1;
+	*words += FTDI_MAX_EEPROM_SIZE / 2;
+	if (size <= 0)
+		size = 0x80;
+
+	/* After the first cycle only two words change, like a new serial and its checksum */
+	memcpy(image, old, size);
+	for (i = 0; i < size; i++)
+		if (image[i] == 0xff) image[i] = 0;
+	image[0x20] = cycle & 0xff;
+	image[size - 2] = ~cycle & 0xff;
+
+	if (fdev_write_begin(dev) < 0)
+		return -1;
+	for (i = 0; i < size / 2; i++) {
+		if (old[i*2] == image[i*2] && old[i*2+1] == image[i*2+1])
+			continue;
+		val = image[i*2] | (image[i*2+1] << 8);
+		if (fdev_write_word(dev, i, val) < 0 || fdev_read_word(dev, i, &val) < 0)
+			return -1;
+		if (val != (image[i*2] | (image[i*2+1] << 8)))
+			return -1;
+		*words += 2;
+	}
+
+	return fdev_reset(dev);
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_job *job = arg;
+	unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+	struct ftdi_context *ftdi;
+	struct fdev dev;
+	int i, r, chip;
+
+	if ((ftdi = ftdi_new()) == NULL || fdev_open_info(&dev, ftdi, &job->info) < 0) {
+		job->failed = job->cycles;
+		if (ftdi)
+			ftdi_free(ftdi);
+		return NULL;
+	}
+	for (i = 0; i < job->cycles; i++) {
+		switch (job->workload) {
+		case WORK_READ:
+			r = fdev_read_eeprom(&dev, buf, &chip);
+			job->words += FTDI_MAX_EEPROM_SIZE / 2;
+			break;
+		case WORK_FLASH:
+			r = flash_cycle(&dev, i, &job->words);
+			break;
+		default:
+			r = fdev_erase(&dev, &chip);
+			job->words += FTDI_MAX_EEPROM_SIZE / 2;
+			break;
+		}
+		if (r < 0)
+			job->failed++;
+	}
+	fdev_close(&dev);
+	ftdi_free(ftdi);
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	const char *spec = "chip=56,count=4";
+	const char *names[] = { "read", "flash", "erase" };
+	int cycles = 200, units, n, w, i, failed, total_failed = 0;
+	struct ftdi_context *ftdi;
+	struct fdev_info *list;
+	struct bench_job *jobs;
+	struct timespec start, end;
+	double secs;
+	long words;
+
+	if (argc > 1) spec = argv[1];
+	if (argc > 2) cycles = atoi(argv[2]);
+	if (cycles < 1 || (units = emu_setup(spec)) < 0) {
+		printf("%s [emulator options] [cycles per unit]\n", argv[0]);
+		return 1;
+	}
+	fdev_set_backend(&fdev_emu_ops);
+
+	if ((ftdi = ftdi_new()) == NULL)
+		return 1;
+	if ((n = fdev_scan(ftdi, 0, 0, &list)) <= 0 || (jobs = calloc(n, sizeof(*jobs))) == NULL)
+		return 1;
+
+	printf("emulator: %s, units: %d, cycles per unit: %d\n", spec, units, cycles);
+	printf("%-8s %10s %10s %12s %12s %8s\n", "workload", "cycles", "time (s)", "cycles/s", "words/s", "failed");
+	for (w = WORK_READ; w <= WORK_ERASE; w++) {
+		memset(jobs, 0, n * sizeof(*jobs));
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < n; i++) {
+			jobs[i].info = list[i];
+			jobs[i].workload = w;
+			jobs[i].cycles = cycles;
+			pthread_create(&jobs[i].thread, NULL, bench_worker, &jobs[i]);
+		}
+		words = 0;
+		failed = 0;
+		for (i = 0; i < n; i++) {
+			pthread_join(jobs[i].thread, NULL);
+			words += jobs[i].words;
+			failed += jobs[i].failed;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%-8s %10d %10.3f %12.0f %12.0f %8d\n", names[w], n * cycles, secs,
+			n * cycles / secs, words / secs, failed);
+		total_failed += failed;
+	}
+
+	free(jobs);
+	fdev_scan_free(list, n);
+	ftdi_free(ftdi);
+	emu_cleanup();
+	return total_failed ? 1 : 0;
+}
@@ -0,0 +1,152 @@
+/***************************************************************************
+                       bench_pipeline.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Reads and writes a whole eeprom on one emulated unit with 1 to 16
+ transfers in flight and reports the time per pass.  The emulator's
+ rtt_us option sets the USB round trip of every transfer and read_us
+ and write_us the time the unit itself takes per word.
+
+ The emulated unit runs the same submit and completion engine as the
+ libftdi backend, so the depth, error and ordering paths are those of
+ real hardware; only the device is simulated.  After the writes every
+ word of a pass is written once more to one address, and the last
+ value must be the one that stays.  Given "usb", or "usb:<path>" for
+ one port, the bench reads the eeprom of an attached FTDI device
+ instead, checking that every depth reads the same contents.  It
+ never writes a real device.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ftdi_dev.h"
+#include "ftdi_emu.h"
+
+#define WORDS (FTDI_MAX_EEPROM_SIZE / 2)
+
+/* FT232R, FT2232, FT4232, FT232H and FT230X at their factory ids */
+static const int ftdi_pids[] = { 0x6001, 0x6010, 0x6011, 0x6014, 0x6015 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	const char *spec = "chip=56,rtt_us=125,read_us=10,write_us=50";
+	static const int depths[] = { 1, 2, 4, 8, 16 };
+	unsigned char buf[FTDI_MAX_EEPROM_SIZE], first[FTDI_MAX_EEPROM_SIZE];
+	unsigned short addrs[WORDS], vals[WORDS], same[WORDS];
+	double start, read_s, write_s = 0, base_read = 0, base_write = 0;
+	struct ftdi_context *ftdi;
+	struct fdev_match m;
+	struct fdev dev;
+	int passes = 20, failed = 0, usb, d, i, k, size;
+
+	if (argc > 1) spec = argv[1];
+	if (argc > 2) passes = atoi(argv[2]);
+	usb = !strncmp(spec, "usb", 3) && (spec[3] == '\0' || spec[3] == ':');
+	if (passes < 1 || (!usb && emu_setup(spec) < 0)) {
+		printf("%s [emulator options | usb[:<path>]] [passes]\n", argv[0]);
+		return 1;
+	}
+	fdev_set_backend(usb ? &fdev_libftdi_ops : &fdev_emu_ops);
+
+	if ((ftdi = ftdi_new()) == NULL)
+		return 1;
+	memset(&m, 0, sizeof(m));
+	if (usb) {
+		for (i = 0; i < (int)(sizeof(ftdi_pids) / sizeof(ftdi_pids[0])); i++)
+			fdev_match_add(&m, 0x0403, ftdi_pids[i]);
+		if (spec[3] == ':')
+			m.path = spec + 4;
+	}
+	if (fdev_select(&dev, ftdi, &m) < 0) {
+		printf("%s: %s\n", spec, ftdi_get_error_string(ftdi));
+		ftdi_free(ftdi);
+		return 1;
+	}
+	for (i = 0; i < WORDS; i++)
+		addrs[i] = i;
+
+	if (usb)
+		printf("device: %s, passes: %d, words per pass: %d, read only\n", dev.path, passes, WORDS);
+	else
+		printf("emulator: %s, passes: %d, words per pass: %d\n", spec, passes, WORDS);
+	printf("%-8s %12s %12s %10s %10s %8s\n", "depth", "read (ms)", "write (ms)", "read x", "write x", "failed");
+	for (d = 0; d < (int)(sizeof(depths) / sizeof(depths[0])); d++) {
+		fdev_set_pipeline(depths[d]);
+
+		start = now();
+		for (k = 0; k < passes; k++)
+			if (fdev_read_eeprom(&dev, buf, &size) < 0)
+				failed++;
+		read_s = (now() - start) / passes;
+
+		if (usb) {
+			/* Every depth must read what one word at a time reads */
+			if (d == 0)
+				memcpy(first, buf, sizeof(first));
+			else if (memcmp(first, buf, sizeof(first)))
+				failed++;
+			if (d == 0)
+				base_read = read_s;
+			printf("%-8d %12.2f %12s %10.1f %10s %8d\n", depths[d], read_s * 1e3, "-",
+				base_read / read_s, "-", failed);
+			continue;
+		}
+
+		start = now();
+		for (k = 0; k < passes; k++) {
+			for (i = 0; i < WORDS; i++)
+				vals[i] = (k << 8) | i;
+			if (fdev_write_begin(&dev) < 0 || fdev_write_words(&dev, addrs, vals, WORDS) < 0)
+				failed++;
+		}
+		write_s = (now() - start) / passes;
+
+		/* The last pass must be readable in full */
+		if (fdev_read_words(&dev, addrs, vals, WORDS) < 0 || vals[WORDS - 1] != (((passes - 1) << 8) | (WORDS - 1)))
+			failed++;
+
+		/* Words in flight together must still land in order */
+		for (i = 0; i < WORDS; i++) {
+			same[i] = 0;
+			vals[i] = 0x5a00 | i;
+		}
+		if (fdev_write_words(&dev, same, vals, WORDS) < 0 || fdev_read_words(&dev, same, vals, 1) < 0 ||
+			vals[0] != (0x5a00 | (WORDS - 1)))
+			failed++;
+
+		if (d == 0) {
+			base_read = read_s;
+			base_write = write_s;
+		}
+		printf("%-8d %12.2f %12.2f %10.1f %10.1f %8d\n", depths[d], read_s * 1e3, write_s * 1e3,
+			base_read / read_s, base_write / write_s, failed);
+	}
+
+	fdev_close(&dev);
+	ftdi_free(ftdi);
+	emu_cleanup();
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,95 @@
+/***************************************************************************
+                      bench_serial_alloc.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Measures serial number allocations per second with many processes
+ sharing one counter file, and checks that no value is handed out twice.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "serial_alloc.h"
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+	const char *counter_file = "bench-serial.counter";
+	int procs = 16, count = 1000, sync = 0;
+	struct timespec start, end;
+	long *values;
+	double secs;
+	int i, j, status, dups = 0, failed = 0;
+	pid_t pid;
+
+	if (argc > 1) procs = atoi(argv[1]);
+	if (argc > 2) count = atoi(argv[2]);
+	if (argc > 3) sync = atoi(argv[3]);
+	if (argc > 4) counter_file = argv[4];
+	if (procs < 1 || count < 1) {
+		printf("%s [processes] [allocations per process] [sync] [counter file]\n", argv[0]);
+		return 1;
+	}
+
+	values = mmap(NULL, sizeof(long) * procs * count, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (values == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	unlink(counter_file);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < procs; i++) {
+		if ((pid = fork()) < 0) {
+			perror("fork");
+			return 1;
+		}
+		if (pid == 0) {
+			for (j = 0; j < count; j++)
+				if (serial_alloc_next(counter_file, sync, &values[i * count + j]) < 0)
+					_exit(1);
+			_exit(0);
+		}
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	qsort(values, (size_t)procs * count, sizeof(long), cmp_long);
+	for (i = 1; i < procs * count; i++)
+		if (values[i] == values[i - 1])
+			dups++;
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("processes: %d, allocations: %d, sync: %s\n", procs, procs * count, sync ? "yes" : "no");
+	printf("elapsed: %.3f s, %.0f allocations/s\n", secs, procs * count / secs);
+	printf("failed processes: %d, duplicates: %d\n", failed, dups);
+
+	unlink(counter_file);
+	return (failed || dups) ? 1 : 0;
+}
@@ -0,0 +1,168 @@
+/***************************************************************************
+                            backup.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ A backup archive is a text file holding eeprom images addressed by
+ their hash, and the devices they were read from:
+
+   image <hash> <size> <hex bytes>
+   device <hash> <vid>:<pid> <path> <time> <serial>
+
+ An image is stored once however many devices carry it.  Like the
+ chip cache the archive is only ever appended to, with one write per
+ backup run, so runs from several hosts can share a file; the last
+ device line for a path and serial wins.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "backup.h"
+
+/**
+ * @brief Hash an eeprom image
+ *
+ * \param buf image contents
+ * \param len bytes in buf
+ *
+ * Function returns the 64 bit FNV-1a hash of buf.
+ **/
+unsigned long long backup_hash(const unsigned char *buf, int len)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= buf[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/**
+ * @brief Load the image hashes already stored in an archive
+ *
+ * \param archive path of the archive
+ * \param n receives the number of hashes
+ *
+ * Function returns an array to free(), NULL if there are none.
+ **/
+static unsigned long long *load_hashes(const char *archive, int *n)
+{
+	unsigned long long *hashes = NULL, *tmp;
+	char line[1024];
+	FILE *f;
+	int c;
+
+	*n = 0;
+	if ((f = fopen(archive, "r")) == NULL)
+		return NULL;
+
+	while (fgets(line, sizeof(line), f)) {
+		/* image lines are longer than the buffer, skip their tail */
+		if (strchr(line, '\n') == NULL)
+			while ((c = fgetc(f)) != EOF && c != '\n')
+				;
+		if (strncmp(line, "image ", 6))
+			continue;
+		if ((tmp = realloc(hashes, (*n + 1) * sizeof(*hashes))) == NULL)
+			break;
+		hashes = tmp;
+		hashes[(*n)++] = strtoull(line + 6, NULL, 16);
+	}
+	fclose(f);
+
+	return hashes;
+}
+
+static int have_hash(const unsigned long long *hashes, int n, unsigned long long h)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (hashes[i] == h)
+			return 1;
+	return 0;
+}
+
+/**
+ * @brief Add devices and their images to an archive
+ *
+ * \param archive path of the archive, created if missing
+ * \param devs devices to record, their hash is filled in
+ * \param n number of devices
+ * \param new_images receives the number of images not yet archived
+ *
+ * Images already in the archive, or shared by several of devs, are
+ * written once.  Everything goes out in a single append.
+ * Returns 0 on success, -1 on error.
+ **/
+int backup_write(const char *archive, struct backup_device *devs, int n, int *new_images)
+{
+	unsigned long long *hashes, *tmp;
+	char *buf, *p;
+	int n_hashes, i, j, fd, len, ret = -1;
+	time_t now = time(NULL);
+
+	*new_images = 0;
+	hashes = load_hashes(archive, &n_hashes);
+
+	/* Worst case every device brings a new image */
+	len = 64;
+	for (i = 0; i < n; i++)
+		len += 64 + devs[i].size * 2 + 160;
+	if ((buf = malloc(len)) == NULL)
+		goto done;
+	p = buf;
+	if (n_hashes == 0 && access(archive, F_OK) != 0)
+		p += sprintf(p, "# ftdi-flash-tool eeprom backup\n");
+
+	for (i = 0; i < n; i++) {
+		devs[i].hash = backup_hash(devs[i].image, devs[i].size);
+		if (have_hash(hashes, n_hashes, devs[i].hash))
+			continue;
+		if ((tmp = realloc(hashes, (n_hashes + 1) * sizeof(*hashes))) == NULL)
+			goto done;
+		hashes = tmp;
+		hashes[n_hashes++] = devs[i].hash;
+		(*new_images)++;
+
+		p += sprintf(p, "image %016llx %d ", devs[i].hash, devs[i].size);
+		for (j = 0; j < devs[i].size; j++)
+			p += sprintf(p, "%02x", devs[i].image[j]);
+		*p++ = '\n';
+	}
+	for (i = 0; i < n; i++)
+		p += sprintf(p, "device %016llx %04x:%04x %s %ld %.63s\n", devs[i].hash,
+			devs[i].vid, devs[i].pid, devs[i].path, (long)now,
+			devs[i].serial[0] ? devs[i].serial : "-");
+
+	if ((fd = open(archive, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0)
+		goto done;
+	len = p - buf;
+	ret = (write(fd, buf, len) == len) ? 0 : -1;
+	if (close(fd) != 0)
+		ret = -1;
+
+done:
+	free(buf);
+	free(hashes);
+	return ret;
+}
@@ -0,0 +1,34 @@
+/***************************************************************************
+                            backup.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef BACKUP_H
+#define BACKUP_H
+
+/**
+ * @brief One device to record in a backup archive
+ **/
+struct backup_device {
+	int vid, pid;
+	char path[32];                      /**< USB bus/port path */
+	char serial[64];                    /**< serial string, empty if none */
+	const unsigned char *image;         /**< eeprom contents */
+	int size;                           /**< bytes in image */
+	unsigned long long hash;            /**< set by backup_write() */
+};
+
+unsigned long long backup_hash(const unsigned char *buf, int len);
+int backup_write(const char *archive, struct backup_device *devs, int n, int *new_images);
+
+#endif /* BACKUP_H */
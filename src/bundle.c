@@ -0,0 +1,247 @@
+/***************************************************************************
+                            bundle.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ A bundle holds the eeprom images of a whole production lot in one
+ file, each stored under a key such as its serial string:
+
+   header     magic, byte order mark, counts and section offsets
+   slots      open addressed hash table of entry numbers, a power of
+              two at least twice the number of entries
+   entries    key and image size of every image
+   images     BUNDLE_IMAGE_SIZE bytes per entry
+
+ Integers are in the byte order of the host that wrote the file.  The
+ flash path maps the file once and finds an image with a hash and a
+ short probe, without opening or allocating anything per unit.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bundle.h"
+
+#define BUNDLE_MAGIC "FTDIBNDL"
+#define BUNDLE_BOM 0x01020304
+#define BUNDLE_EMPTY 0xffffffff
+
+struct bundle_header {
+	char magic[8];
+	uint32_t bom;
+	uint32_t count;                     /**< number of entries */
+	uint32_t slots;                     /**< size of the hash table */
+	uint32_t image_size;                /**< bytes reserved per image */
+};
+
+struct bundle_entry {
+	char key[BUNDLE_KEY_LEN + 1];       /**< NUL padded */
+	uint32_t size;                      /**< bytes used in the image */
+};
+
+/**
+ * @brief A mapped bundle
+ **/
+struct bundle {
+	void *map;
+	size_t len;
+	const struct bundle_header *hdr;
+	const uint32_t *slots;
+	const struct bundle_entry *entries;
+	const unsigned char *images;
+};
+
+/**
+ * @brief Hash a bundle key
+ *
+ * Function returns the 32 bit FNV-1a hash of key.
+ **/
+static uint32_t key_hash(const char *key)
+{
+	uint32_t h = 0x811c9dc5;
+
+	for (; *key; key++) {
+		h ^= (unsigned char)*key;
+		h *= 0x01000193;
+	}
+
+	return h;
+}
+
+/**
+ * @brief Write a bundle
+ *
+ * \param path bundle file to create or replace
+ * \param items images to store
+ * \param n number of items
+ *
+ * The bundle is written to a temporary file next to path and renamed
+ * into place, so stations never map half a bundle.
+ * Returns 0 on success, -1 on error, -2 if a key is too long or used
+ * twice.
+ **/
+int bundle_write(const char *path, const struct bundle_item *items, int n)
+{
+	struct bundle_header *hdr;
+	struct bundle_entry *entries;
+	uint32_t *slots, slot, mask;
+	unsigned char *buf, *images;
+	size_t len;
+	char tmp[1024];
+	int i, fd, ret = 0;
+	ssize_t w;
+
+	for (slot = 16; slot < 2u * n; slot <<= 1);
+	mask = slot - 1;
+	len = sizeof(*hdr) + slot * sizeof(*slots) + n * (sizeof(*entries) + BUNDLE_IMAGE_SIZE);
+	if ((buf = calloc(1, len)) == NULL)
+		return -1;
+
+	hdr = (struct bundle_header *)buf;
+	memcpy(hdr->magic, BUNDLE_MAGIC, sizeof(hdr->magic));
+	hdr->bom = BUNDLE_BOM;
+	hdr->count = n;
+	hdr->slots = slot;
+	hdr->image_size = BUNDLE_IMAGE_SIZE;
+	slots = (uint32_t *)(hdr + 1);
+	entries = (struct bundle_entry *)(slots + hdr->slots);
+	images = (unsigned char *)(entries + n);
+	memset(slots, 0xff, hdr->slots * sizeof(*slots));
+
+	for (i = 0; i < n && ret == 0; i++) {
+		if (strlen(items[i].key) > BUNDLE_KEY_LEN || items[i].size > BUNDLE_IMAGE_SIZE) {
+			ret = -2;
+			break;
+		}
+		for (slot = key_hash(items[i].key) & mask; slots[slot] != BUNDLE_EMPTY; slot = (slot + 1) & mask) {
+			if (!strcmp(entries[slots[slot]].key, items[i].key)) {
+				ret = -2;
+				break;
+			}
+		}
+		slots[slot] = i;
+		strcpy(entries[i].key, items[i].key);
+		entries[i].size = items[i].size;
+		memcpy(images + (size_t)i * BUNDLE_IMAGE_SIZE, items[i].image, items[i].size);
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	if (ret == 0 && (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+		w = write(fd, buf, len);
+		if (close(fd) != 0 || w != (ssize_t)len || rename(tmp, path) != 0) {
+			unlink(tmp);
+			ret = -1;
+		}
+	} else if (ret == 0) {
+		ret = -1;
+	}
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * @brief Map a bundle
+ *
+ * \param path bundle file
+ *
+ * Function returns the mapped bundle, or NULL if path is not a bundle
+ * written on a host of the same byte order.
+ **/
+struct bundle *bundle_open(const char *path)
+{
+	struct bundle *b;
+	struct stat sb;
+	int fd;
+
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		return NULL;
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		free(b);
+		return NULL;
+	}
+	if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(*b->hdr) ||
+			(b->map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		free(b);
+		return NULL;
+	}
+	close(fd);
+
+	b->len = sb.st_size;
+	b->hdr = b->map;
+	b->slots = (const uint32_t *)(b->hdr + 1);
+	b->entries = (const struct bundle_entry *)(b->slots + b->hdr->slots);
+	b->images = (const unsigned char *)(b->entries + b->hdr->count);
+	if (memcmp(b->hdr->magic, BUNDLE_MAGIC, sizeof(b->hdr->magic)) || b->hdr->bom != BUNDLE_BOM ||
+			b->hdr->image_size != BUNDLE_IMAGE_SIZE || (b->hdr->slots & (b->hdr->slots - 1)) ||
+			b->hdr->slots <= b->hdr->count ||
+			b->len != sizeof(*b->hdr) + (size_t)b->hdr->slots * sizeof(*b->slots) +
+				(size_t)b->hdr->count * (sizeof(*b->entries) + BUNDLE_IMAGE_SIZE)) {
+		bundle_close(b);
+		return NULL;
+	}
+
+	return b;
+}
+
+/**
+ * @brief Number of images in a bundle
+ **/
+int bundle_count(const struct bundle *b)
+{
+	return b->hdr->count;
+}
+
+/**
+ * @brief Find the image stored under a key
+ *
+ * \param b mapped bundle
+ * \param key serial string or board id
+ * \param size receives the bytes used in the image
+ *
+ * Function returns the image inside the mapping, or NULL if the bundle
+ * holds none for key.
+ **/
+const unsigned char *bundle_find(const struct bundle *b, const char *key, int *size)
+{
+	uint32_t mask = b->hdr->slots - 1, slot, e;
+
+	for (slot = key_hash(key) & mask; (e = b->slots[slot]) != BUNDLE_EMPTY; slot = (slot + 1) & mask) {
+		if (e < b->hdr->count && b->entries[e].size <= BUNDLE_IMAGE_SIZE &&
+				!strncmp(b->entries[e].key, key, sizeof(b->entries[e].key))) {
+			*size = b->entries[e].size;
+			return b->images + (size_t)e * BUNDLE_IMAGE_SIZE;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Unmap a bundle
+ **/
+void bundle_close(struct bundle *b)
+{
+	if (b == NULL)
+		return;
+	munmap(b->map, b->len);
+	free(b);
+}
@@ -0,0 +1,41 @@
+/***************************************************************************
+                            bundle.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+/* Longest key, such as a serial string, a bundle can hold */
+#define BUNDLE_KEY_LEN 63
+/* Room for every image, whatever the eeprom size */
+#define BUNDLE_IMAGE_SIZE 256
+
+/**
+ * @brief One image to store in a bundle
+ **/
+struct bundle_item {
+	const char *key;                    /**< serial string or board id */
+	const unsigned char *image;
+	int size;                           /**< bytes in image */
+};
+
+struct bundle;
+
+int bundle_write(const char *path, const struct bundle_item *items, int n);
+struct bundle *bundle_open(const char *path);
+int bundle_count(const struct bundle *b);
+const unsigned char *bundle_find(const struct bundle *b, const char *key, int *size);
+void bundle_close(struct bundle *b);
+
+#endif /* BUNDLE_H */
@@ -0,0 +1,115 @@
+/***************************************************************************
+                          chip_cache.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ The chip cache remembers which eeprom chip sits behind a device so
+ that detection does not need to erase it.  The file holds one
+ "<chip type> <key>" line per device and is only ever appended to,
+ the last line for a key wins.  Keys name a fixture slot, so the
+ cache is only asked about blank chips the read-only probe can't
+ tell; a probe that finds another chip in the slot appends a new line.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "chip_cache.h"
+
+/**
+ * @brief Default location of the chip cache
+ *
+ * \param buf buffer receiving the path
+ * \param len size of buf
+ *
+ * Function returns $HOME/.ftdi-flash-tool.chips in buf, or NULL
+ * if HOME is not set.
+ **/
+const char *chip_cache_default(char *buf, int len)
+{
+	const char *home = getenv("HOME");
+
+	if (home == NULL || *home == '\0')
+		return NULL;
+	if (snprintf(buf, len, "%s/.ftdi-flash-tool.chips", home) >= len)
+		return NULL;
+	return buf;
+}
+
+/**
+ * @brief Look up the chip type of a device
+ *
+ * \param cache_file path of the cache file
+ * \param key device key, e.g. "0403:6001:1-2.3"
+ * \param chip receives the cached chip type
+ *
+ * Function returns 0 if key was found, -1 otherwise.
+ **/
+int chip_cache_lookup(const char *cache_file, const char *key, int *chip)
+{
+	char line[256];
+	char *p;
+	int found = -1, type;
+	FILE *f;
+
+	if (cache_file == NULL || (f = fopen(cache_file, "r")) == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		type = strtol(line, &p, 0);
+		if (p == line || *p != ' ')
+			continue;
+		if (!strcmp(p + 1, key)) {
+			*chip = type;
+			found = 0;
+		}
+	}
+	fclose(f);
+
+	return found;
+}
+
+/**
+ * @brief Remember the chip type of a device
+ *
+ * \param cache_file path of the cache file
+ * \param key device key
+ * \param chip chip type to store
+ *
+ * The entry is added with a single append so that concurrent
+ * writers never interleave.  Returns 0 on success.
+ **/
+int chip_cache_store(const char *cache_file, const char *key, int chip)
+{
+	char line[256];
+	int fd, len, ret;
+
+	if (cache_file == NULL)
+		return -1;
+
+	len = snprintf(line, sizeof(line), "0x%02x %s\n", chip, key);
+	if (len >= (int)sizeof(line))
+		return -1;
+
+	if ((fd = open(cache_file, O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0)
+		return -1;
+	ret = (write(fd, line, len) == len) ? 0 : -1;
+	close(fd);
+
+	return ret;
+}
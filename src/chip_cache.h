@@ -0,0 +1,23 @@
+/***************************************************************************
+                          chip_cache.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef CHIP_CACHE_H
+#define CHIP_CACHE_H
+
+const char *chip_cache_default(char *buf, int len);
+int chip_cache_lookup(const char *cache_file, const char *key, int *chip);
+int chip_cache_store(const char *cache_file, const char *key, int chip);
+
+#endif /* CHIP_CACHE_H */
@@ -0,0 +1,177 @@
+/***************************************************************************
+                           dev_lock.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Advisory device locks shared by every process on the host.  A device
+ is locked by its USB bus/port path with flock() on a file such as
+ /tmp/ftdi-flash-1-2.3.lock, so two processes never write the same
+ eeprom at once while different devices are worked on in parallel.
+ The kernel drops a lock when its process dies, so a crashed run never
+ leaves a device locked.
+
+ Inside one process the locks are counted instead, the threads of a
+ process are expected to stay out of each other's way.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/file.h>
+
+#include "dev_lock.h"
+
+/**
+ * @brief A lock held by this process
+ **/
+struct dev_lock {
+	char path[32];              /**< USB bus/port path */
+	int fd;                     /**< locked file */
+	int refs;                   /**< acquisitions not yet released */
+};
+
+static pthread_mutex_t lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dev_lock *held = NULL;
+static int n_held = 0;
+static char lock_dir[256] = DEV_LOCK_DIR;
+static int lock_wait = DEV_LOCK_FOREVER;
+
+/**
+ * @brief Configure device locking
+ *
+ * \param dir directory holding the lock files, NULL to stop locking
+ * \param wait_ms how long to wait for a device locked elsewhere, 0 to
+ *         fail at once, DEV_LOCK_FOREVER to wait until it is free
+ *
+ * Locks already held are not affected.
+ **/
+void dev_lock_setup(const char *dir, int wait_ms)
+{
+	pthread_mutex_lock(&lock_mutex);
+	snprintf(lock_dir, sizeof(lock_dir), "%s", dir ? dir : "");
+	lock_wait = wait_ms;
+	pthread_mutex_unlock(&lock_mutex);
+}
+
+/**
+ * @brief Index of a lock held by this process, -1 if there is none
+ **/
+static int find_held(const char *path)
+{
+	int i;
+
+	for (i = 0; i < n_held; i++)
+		if (!strcmp(held[i].path, path))
+			return i;
+
+	return -1;
+}
+
+/**
+ * @brief Lock a device
+ *
+ * \param path USB bus/port path of the device
+ *
+ * Waits as long as dev_lock_setup() allows.  Every successful call
+ * needs a dev_lock_release().
+ * Returns 0 if the device is locked, also when locking is off, -1 if
+ * another process kept it locked, -2 if the lock file can't be used.
+ **/
+int dev_lock_acquire(const char *path)
+{
+	const struct timespec poll = { 0, 10000000L };
+	struct timespec start, now;
+	struct dev_lock *list;
+	char file[320], *p;
+	int i, fd, wait_ms;
+
+	pthread_mutex_lock(&lock_mutex);
+	if (lock_dir[0] == '\0') {
+		pthread_mutex_unlock(&lock_mutex);
+		return 0;
+	}
+	if ((i = find_held(path)) >= 0) {
+		held[i].refs++;
+		pthread_mutex_unlock(&lock_mutex);
+		return 0;
+	}
+	i = snprintf(file, sizeof(file), "%s/ftdi-flash-", lock_dir);
+	wait_ms = lock_wait;
+	pthread_mutex_unlock(&lock_mutex);
+
+	snprintf(file + i, sizeof(file) - i, "%s.lock", path);
+	for (p = file + i; *p; p++)
+		if (*p == '/')
+			*p = '_';
+	if ((fd = open(file, O_RDONLY | O_CREAT, 0666)) < 0) {
+		perror(file);
+		return -2;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		if (flock(fd, wait_ms == DEV_LOCK_FOREVER ? LOCK_EX : LOCK_EX | LOCK_NB) == 0)
+			break;
+		if (errno != EWOULDBLOCK && errno != EINTR) {
+			perror(file);
+			close(fd);
+			return -2;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (wait_ms != DEV_LOCK_FOREVER &&
+			(now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 >= wait_ms) {
+			close(fd);
+			return -1;
+		}
+		nanosleep(&poll, NULL);
+	}
+
+	pthread_mutex_lock(&lock_mutex);
+	if ((list = realloc(held, (n_held + 1) * sizeof(*held))) == NULL) {
+		pthread_mutex_unlock(&lock_mutex);
+		close(fd);
+		return -2;
+	}
+	held = list;
+	snprintf(held[n_held].path, sizeof(held[n_held].path), "%s", path);
+	held[n_held].fd = fd;
+	held[n_held].refs = 1;
+	n_held++;
+	pthread_mutex_unlock(&lock_mutex);
+
+	return 0;
+}
+
+/**
+ * @brief Release a device locked by dev_lock_acquire()
+ *
+ * The lock file stays behind for the next run, removing it could let
+ * two processes lock different files for the same device.
+ **/
+void dev_lock_release(const char *path)
+{
+	int i;
+
+	pthread_mutex_lock(&lock_mutex);
+	if ((i = find_held(path)) >= 0 && --held[i].refs == 0) {
+		close(held[i].fd);
+		held[i] = held[--n_held];
+	}
+	pthread_mutex_unlock(&lock_mutex);
+}
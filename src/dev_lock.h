@@ -0,0 +1,28 @@
+/***************************************************************************
+                           dev_lock.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef DEV_LOCK_H
+#define DEV_LOCK_H
+
+/* Where lock files go unless dev_lock_setup() says otherwise */
+#define DEV_LOCK_DIR "/tmp"
+/* Wait for a lock however long it takes */
+#define DEV_LOCK_FOREVER (-1)
+
+void dev_lock_setup(const char *dir, int wait_ms);
+int dev_lock_acquire(const char *path);
+void dev_lock_release(const char *path);
+
+#endif /* DEV_LOCK_H */
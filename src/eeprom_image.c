@@ -0,0 +1,215 @@
+/***************************************************************************
+                         eeprom_image.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Helpers working on eeprom images alone, without an ftdi_context, so
+ saved images can be checked and decoded without a device.  Only the
+ header every FTDI chip shares is decoded: ids, power settings and
+ the three string descriptors.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <libftdi1/ftdi.h>
+
+#include "eeprom_image.h"
+
+/**
+ * @brief Name of an ftdi_chip_type
+ **/
+const char *image_chip_name(int type)
+{
+	static const char *names[] = {
+		"AM", "BM", "2232C", "R", "2232H", "4232H", "232H", "230X"
+	};
+
+	if (type < 0 || type >= (int)(sizeof(names) / sizeof(names[0])))
+		return "unknown";
+	return names[type];
+}
+
+/**
+ * @brief Compute the checksum of an eeprom image
+ *
+ * \param type ftdi_chip_type of the device
+ * \param buf eeprom contents
+ * \param size eeprom size in bytes
+ *
+ * Function returns the checksum expected in the last word of buf,
+ * computed the way ftdi_eeprom_build() does.  The FT230X user area,
+ * words 0x12 to 0x3f, is not part of it.
+ **/
+unsigned short image_checksum(int type, const unsigned char *buf, int size)
+{
+	unsigned short checksum = 0xaaaa, value;
+	int i;
+
+	for (i = 0; i < size / 2 - 1; i++) {
+		if (type == TYPE_230X && i == 0x12)
+			i = 0x40;
+		value = buf[i*2] | (buf[i*2+1] << 8);
+		checksum = value ^ checksum;
+		checksum = (checksum << 1) | (checksum >> 15);
+	}
+
+	return checksum;
+}
+
+/**
+ * @brief Chip type from the release number ftdi_eeprom_build() stores
+ **/
+static int release_to_type(int release)
+{
+	switch (release >> 8) {
+	case 0x02: return TYPE_AM;
+	case 0x04: return TYPE_BM;
+	case 0x05: return TYPE_2232C;
+	case 0x06: return TYPE_R;
+	case 0x07: return TYPE_2232H;
+	case 0x08: return TYPE_4232H;
+	case 0x09: return TYPE_232H;
+	case 0x10: return TYPE_230X;
+	}
+	return -1;
+}
+
+/**
+ * @brief Copy a string descriptor of an image as ASCII
+ *
+ * \param buf eeprom contents
+ * \param size eeprom size in bytes
+ * \param ptr descriptor offset byte of the header
+ * \param out receives the string
+ * \param len size of out
+ *
+ * Returns 0 on success, -1 if the descriptor lies outside the image
+ * or is not a string descriptor.
+ **/
+static int image_string(const unsigned char *buf, int size, int ptr, char *out, int len)
+{
+	int off = buf[ptr] & (size - 1), n = buf[ptr + 1], i;
+
+	*out = '\0';
+	if (n == 0)
+		return 0;
+	if (n < 2 || off + n > size || buf[off] != n || buf[off + 1] != 0x03)
+		return -1;
+	for (i = 0; i < (n - 2) / 2 && i < len - 1; i++) {
+		out[i] = buf[off + 2 + i*2];
+		if (!isprint((unsigned char)out[i]))
+			out[i] = '?';
+	}
+	out[i] = '\0';
+
+	return 0;
+}
+
+/**
+ * @brief Decode and check an eeprom image
+ *
+ * \param buf eeprom contents
+ * \param size image size in bytes
+ * \param info receives the decoded fields
+ *
+ * Function checks the size, the checksum and the string descriptors
+ * and sets info->status to the first problem found.
+ * Returns 0 if the image is sound, -1 otherwise.
+ **/
+int image_decode(const unsigned char *buf, int size, struct image_info *info)
+{
+	int i;
+
+	memset(info, 0, sizeof(*info));
+	info->type = -1;
+	info->status = "ok";
+
+	if (size != 0x80 && size != 0x100 && size != 0x200) {
+		info->status = "bad size";
+		return -1;
+	}
+	for (i = 0; i < size && buf[i] == 0xff; i++);
+	if (i == size) {
+		info->status = "blank";
+		return -1;
+	}
+
+	info->vid = buf[0x02] | (buf[0x03] << 8);
+	info->pid = buf[0x04] | (buf[0x05] << 8);
+	info->release = buf[0x06] | (buf[0x07] << 8);
+	info->type = release_to_type(info->release);
+	info->self_powered = (buf[0x08] & 0x40) != 0;
+	info->remote_wakeup = (buf[0x08] & 0x20) != 0;
+	info->max_power = buf[0x09] * 2;
+
+	/* The FT232R keeps its configuration in the first 128 bytes */
+	info->size = (info->type == TYPE_R) ? 0x80 : size;
+	info->checksum = buf[info->size - 2] | (buf[info->size - 1] << 8);
+	info->expected = image_checksum(info->type, buf, info->size);
+
+	if (image_string(buf, info->size, 0x0e, info->manufacturer, sizeof(info->manufacturer)) ||
+	    image_string(buf, info->size, 0x10, info->product, sizeof(info->product)) ||
+	    image_string(buf, info->size, 0x12, info->serial, sizeof(info->serial)))
+		info->status = "bad strings";
+	if (info->type < 0)
+		info->status = "unknown chip";
+	if (info->vid == 0 || info->pid == 0)
+		info->status = "no vid/pid";
+	if (info->checksum != info->expected)
+		info->status = "bad checksum";
+
+	return strcmp(info->status, "ok") ? -1 : 0;
+}
+
+/**
+ * @brief Format a hex dump of an eeprom image
+ *
+ * \param out buffer receiving the dump
+ * \param len size of out, 80 bytes per 16 image bytes are enough
+ * \param buf eeprom contents
+ * \param size image size in bytes, a multiple of 16
+ *
+ * The dump is built in memory so it can be written with a single call.
+ * Returns the length of the dump, which is truncated to whole lines
+ * if out is too small.
+ **/
+int image_hexdump(char *out, int len, const unsigned char *buf, int size)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *p = out;
+	int i, j;
+
+	for (i = 0; i < size && out + len - p > 80; i += 16) {
+		p += sprintf(p, "0x%03x:", i);
+		for (j = 0; j < 16; j++) {
+			if (j == 8)
+				*p++ = ' ';
+			*p++ = ' ';
+			*p++ = hex[buf[i+j] >> 4];
+			*p++ = hex[buf[i+j] & 0xf];
+		}
+		*p++ = ' ';
+		for (j = 0; j < 16; j++) {
+			if (j == 8)
+				*p++ = ' ';
+			*p++ = isprint(buf[i+j]) ? buf[i+j] : '.';
+		}
+		*p++ = '\n';
+	}
+	*p = '\0';
+
+	return p - out;
+}
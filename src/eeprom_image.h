@@ -0,0 +1,43 @@
+/***************************************************************************
+                         eeprom_image.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef EEPROM_IMAGE_H
+#define EEPROM_IMAGE_H
+
+/**
+ * @brief Fields common to the eeprom images of every FTDI chip
+ **/
+struct image_info {
+	int type;                   /**< ftdi_chip_type from the release number, -1 if unknown */
+	int vid, pid;
+	int release;                /**< bcdDevice */
+	int self_powered;
+	int remote_wakeup;
+	int max_power;              /**< mA */
+	int size;                   /**< bytes covered by the checksum */
+	unsigned short checksum;    /**< stored in the last word */
+	unsigned short expected;    /**< computed over the image */
+	char manufacturer[128];
+	char product[128];
+	char serial[128];
+	const char *status;         /**< "ok" or what is wrong with the image */
+};
+
+const char *image_chip_name(int type);
+unsigned short image_checksum(int type, const unsigned char *buf, int size);
+int image_decode(const unsigned char *buf, int size, struct image_info *info);
+int image_hexdump(char *out, int len, const unsigned char *buf, int size);
+
+#endif /* EEPROM_IMAGE_H */
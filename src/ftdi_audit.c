@@ -0,0 +1,373 @@
+/***************************************************************************
+                          ftdi_audit.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Checks saved eeprom images, such as those written by ftdi-flash-tool -r
+ or -g, without a device.  Images are mapped rather than read and
+ checked on a pool of worker threads.  Each worker formats its report
+ in memory and reports are written in input order, a whole report per
+ write, so the output does not depend on the number of workers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "eeprom_image.h"
+
+enum audit_mode { AUDIT_SUMMARY, AUDIT_FIELDS, AUDIT_HEX };
+
+/**
+ * @brief One image of an audit
+ **/
+struct audit_job {
+	char *path;
+	char *report;               /**< formatted output, NULL if there is none */
+	int len;                    /**< length of report */
+	const char *status;         /**< "ok" or what is wrong with the image */
+	int done;
+};
+
+/**
+ * @brief Images of an audit, shared by the workers
+ **/
+struct audit {
+	struct audit_job *jobs;
+	int count;
+	int next;                   /**< next job to hand out */
+	int mode;
+	pthread_mutex_t lock;       /**< protects done and printed */
+	int printed;                /**< reports written so far */
+};
+
+/**
+ * @brief Check a single image and format its report
+ *
+ * \param mode one of enum audit_mode, job - image to check.
+ *
+ **/
+static void
+audit_image(int mode, struct audit_job *job) {
+	struct image_info info;
+	struct stat sb;
+	unsigned char *buf;
+	char *p;
+	int fd;
+
+	job->status = "ok";
+	if((fd = open(job->path, O_RDONLY)) < 0) {
+		job->status = "can't open";
+		goto report;
+	}
+	if(fstat(fd, &sb) < 0 || sb.st_size == 0 || sb.st_size > 0x200) {
+		job->status = "bad size";
+		close(fd);
+		goto report;
+	}
+	buf = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(buf == MAP_FAILED) {
+		job->status = "can't map";
+		goto report;
+	}
+	image_decode(buf, sb.st_size, &info);
+	job->status = info.status;
+
+	if(mode == AUDIT_FIELDS) {
+		/* Strings hold printable characters only, see image_decode() */
+		job->report = malloc(strlen(job->path) + 512);
+		if(job->report)
+			job->len = sprintf(job->report,
+				"%s\t%s\t%s\t0x%04x\t0x%04x\t0x%04x\t%d\t%d\t%d\t%d\t0x%04x\t0x%04x\t%s\t%s\t%s\n",
+				job->path, info.status, image_chip_name(info.type), info.vid, info.pid,
+				info.release, info.self_powered, info.remote_wakeup, info.max_power,
+				info.size, info.checksum, info.expected,
+				info.manufacturer, info.product, info.serial);
+	} else if(mode == AUDIT_HEX) {
+		job->report = malloc(strlen(job->path) + 64 + sb.st_size / 16 * 80);
+		if(job->report) {
+			p = job->report + sprintf(job->report, "%s: %s\n", job->path, info.status);
+			p += image_hexdump(p, sb.st_size / 16 * 80 + 1, buf, sb.st_size);
+			job->len = p - job->report;
+		}
+	} else if(strcmp(info.status, "ok")) {
+		job->report = malloc(strlen(job->path) + 96);
+		if(job->report && !strcmp(info.status, "bad checksum"))
+			job->len = sprintf(job->report, "%s: bad checksum 0x%04x, expected 0x%04x\n",
+				job->path, info.checksum, info.expected);
+		else if(job->report)
+			job->len = sprintf(job->report, "%s: %s\n", job->path, info.status);
+	}
+	munmap(buf, sb.st_size);
+	return;
+
+report:
+	/* Images that could not be looked at are reported in every mode */
+	if((job->report = malloc(strlen(job->path) + 32)) != NULL)
+		job->len = sprintf(job->report, "%s: %s\n", job->path, job->status);
+}
+
+/**
+ * @brief Worker checking images until none are left
+ *
+ * \param arg pointer to the struct audit to work on.
+ *
+ * After each image the worker writes every report that is complete
+ * and next in input order.
+ *
+ **/
+static void *
+audit_worker(void *arg) {
+	struct audit *a = arg;
+	struct audit_job *job;
+	int i;
+
+	while((i = __atomic_fetch_add(&a->next, 1, __ATOMIC_RELAXED)) < a->count) {
+		audit_image(a->mode, &a->jobs[i]);
+
+		pthread_mutex_lock(&a->lock);
+		a->jobs[i].done = 1;
+		while(a->printed < a->count && a->jobs[a->printed].done) {
+			job = &a->jobs[a->printed++];
+			if(job->report)
+				fwrite(job->report, 1, job->len, stdout);
+			free(job->report);
+			job->report = NULL;
+		}
+		pthread_mutex_unlock(&a->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Queue an image for the audit
+ *
+ * Function returns 0 on success, -1 if out of memory.
+ *
+ **/
+static int
+audit_add(struct audit *a, const char *path) {
+	struct audit_job *jobs;
+
+	if((a->count & (a->count - 1)) == 0) {
+		if((jobs = realloc(a->jobs, (a->count ? a->count * 2 : 64) * sizeof(*jobs))) == NULL)
+			return -1;
+		a->jobs = jobs;
+	}
+	memset(&a->jobs[a->count], 0, sizeof(*jobs));
+	if((a->jobs[a->count].path = strdup(path)) == NULL)
+		return -1;
+	a->count++;
+
+	return 0;
+}
+
+static int
+cmp_name(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * @brief Queue every .bin image of a directory and its subdirectories
+ *
+ * \param a audit to add to, dir - directory to scan.
+ *
+ * Entries are visited in name order.  Function returns 0 on success
+ * or -1 on error.
+ *
+ **/
+static int
+audit_add_dir(struct audit *a, const char *dir) {
+	DIR *d;
+	struct dirent *de;
+	struct stat sb;
+	char **names = NULL, **tmp, *path;
+	int n = 0, i, len, ret = 0;
+
+	if((d = opendir(dir)) == NULL) {
+		perror(dir);
+		return -1;
+	}
+	while((de = readdir(d)) != NULL) {
+		if(de->d_name[0] == '.')
+			continue;
+		if((tmp = realloc(names, (n + 1) * sizeof(*names))) == NULL ||
+			(tmp[n] = strdup(de->d_name)) == NULL) {
+			names = tmp ? tmp : names;
+			ret = -1;
+			break;
+		}
+		names = tmp;
+		n++;
+	}
+	closedir(d);
+
+	qsort(names, n, sizeof(*names), cmp_name);
+	for(i = 0; i < n; i++) {
+		if(ret == 0 && (path = malloc(strlen(dir) + strlen(names[i]) + 2)) != NULL) {
+			sprintf(path, "%s/%s", dir, names[i]);
+			len = strlen(names[i]);
+			if(stat(path, &sb) == 0 && S_ISDIR(sb.st_mode))
+				ret = audit_add_dir(a, path);
+			else if(len > 4 && !strcasecmp(names[i] + len - 4, ".bin"))
+				ret = audit_add(a, path);
+			free(path);
+		} else {
+			ret = -1;
+		}
+		free(names[i]);
+	}
+	free(names);
+
+	return ret;
+}
+
+/**
+ * @brief Check every queued image on a pool of worker threads
+ *
+ * \param a images to check, workers - number of threads to use.
+ *
+ * Function prints a count of every status to stderr, so the reports
+ * on stdout can be processed further, and returns the number of
+ * images that are not sound.
+ *
+ **/
+static int
+run_audit(struct audit *a, int workers) {
+	pthread_t *threads;
+	struct timespec start, end;
+	const char *seen[16];
+	int counts[16], n_seen = 0;
+	int i, j, started = 0, failed = 0;
+
+	if(workers > a->count)
+		workers = a->count;
+	if(workers < 1)
+		workers = 1;
+	threads = calloc(workers, sizeof(*threads));
+	pthread_mutex_init(&a->lock, NULL);
+
+	if(a->mode == AUDIT_FIELDS)
+		printf("path\tstatus\tchip\tvid\tpid\trelease\tself_powered\tremote_wakeup\tmax_power"
+			"\tsize\tchecksum\texpected\tmanufacturer\tproduct\tserial\n");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; threads && i < workers; i++) {
+		if(pthread_create(&threads[i], NULL, audit_worker, a))
+			break;
+		started++;
+	}
+	if(started == 0)
+		audit_worker(a);
+	for(i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(threads);
+	pthread_mutex_destroy(&a->lock);
+	fflush(stdout);
+
+	for(i = 0; i < a->count; i++) {
+		if(strcmp(a->jobs[i].status, "ok"))
+			failed++;
+		for(j = 0; j < n_seen && strcmp(seen[j], a->jobs[i].status); j++);
+		if(j == n_seen && n_seen < 16) {
+			seen[n_seen] = a->jobs[i].status;
+			counts[n_seen++] = 0;
+		}
+		if(j < n_seen)
+			counts[j]++;
+	}
+	fprintf(stderr, "Audited %d images in %.3f s using %d workers, %d not sound.\n", a->count,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, started ? started : 1, failed);
+	for(j = 0; j < n_seen; j++)
+		fprintf(stderr, "  %-16s %d\n", seen[j], counts[j]);
+
+	return failed;
+}
+
+/**
+ * @brief Output the program's usage.
+ *
+ * \param program a c string containing the program path.
+ *
+ * Function outputs a usage string.
+ *
+ **/
+static void
+usage(char *program) {
+	printf("\n%s [-d | -x] [-j <jobs>] <image or directory>...\n\n", program);
+	printf("Checks the size, checksum and strings of saved eeprom images.  Directories are\n");
+	printf("searched for .bin images, including their subdirectories.\n\n");
+	printf("-d\t\t\tprint the decoded fields of every image, tab separated.\n");
+	printf("-x\t\t\tprint a hex dump of every image.\n");
+	printf("-j <jobs>\t\tnumber of images checked at once (default: one per cpu).\n\n");
+	printf("Without -d or -x only images that are not sound are listed.  The exit\n");
+	printf("status is 1 if there is any.\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	struct audit a;
+	struct stat sb;
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, ret = 0;
+
+	memset(&a, 0, sizeof(a));
+	while ((i = getopt(argc, argv, "dhj:x")) != -1) {
+		switch(i) {
+		case 'd':       /* decoded fields */
+			a.mode = AUDIT_FIELDS;
+			break;
+		case 'x':       /* hex dump */
+			a.mode = AUDIT_HEX;
+			break;
+		case 'j':       /* worker threads */
+			workers = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	for (i = optind; i < argc && ret == 0; i++) {
+		if (stat(argv[i], &sb) == 0 && S_ISDIR(sb.st_mode))
+			ret = audit_add_dir(&a, argv[i]);
+		else
+			ret = audit_add(&a, argv[i]);
+	}
+	if (ret == 0)
+		ret = run_audit(&a, workers) ? 1 : 0;
+	else
+		ret = 2;
+
+	for (i = 0; i < a.count; i++)
+		free(a.jobs[i].path);
+	free(a.jobs);
+
+	return ret;
+}
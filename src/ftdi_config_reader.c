@@ -17,230 +17,336 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <libxml2/libxml/xmlreader.h>
-#include <libxml2/libxml/parser.h>
-#include <libxml2/libxml/xpath.h>
 #include <time.h>
 
-int self_powered = 0;
-int use_serial_number = 0;
+#include "ftdi_xml.h"
 
 /**
- * @brief Detect if provided node is a leaf node
- *
- * \param node xmlNodePtr to node to be checked
- *
- * Function returns a 1 if node is a leaf node, zero otherwise.
- * 
+ * @brief State of a conversion in progress
  **/
-int
-isLeaf(xmlNodePtr node) {
-	xmlNodePtr cur_node = NULL;
-	
-	for(cur_node = node->children; cur_node; cur_node = cur_node->next) {
-		if(cur_node->type == XML_ELEMENT_NODE) return 0;
-	}
-
-	return 1;
-}
+struct xform_state {
+	FILE *f;                            /**< output configuration file */
+	int self_powered;
+	int use_serial_number;
+};
 
 /**
  * @brief Check type of node we are given and output the appropriate string.
  *
- * \param node xmlNodePtr to process, filename - output configuration file.
+ * \param ctx conversion state, port - Port_X the element is in, name - name of the
+ *        leaf element, content - its text.
  *
  * Function Determines what type of node it is and outputs the appropriate text string
  *          to the output configuration file.
  * 
  **/
-void
-process_node(xmlNodePtr node, const char *filename) {
+static void
+process_node(void *ctx, int port, const char *name, const char *content) {
 
-	FILE *f;
-	
-	f = fopen(filename, "a+");
-	if(f == NULL) {
-		perror("Can't produce configuration file.");
-		exit(-1);
-	}
+	struct xform_state *st = ctx;
+	FILE *f = st->f;
 	
-	if(!strcmp(node->name,"Type"))
-		fprintf(f, "type=\"%s\"\n", xmlNodeGetContent(node));
-	else if(!strcmp(node->name,"idVendor"))
-		fprintf(f, "vendor_id=0x%s\n", xmlNodeGetContent(node));
-	else if(!strcmp(node->name,"idProduct"))
-		fprintf(f, "product_id=0x%s\n", xmlNodeGetContent(node));
-	else if(!strcmp(node->name,"SerialNumber_Enabled"))
-		if(!strcmp(xmlNodeGetContent(node),"true")) {
-			use_serial_number = 1;
+	if(!strcmp(name,"Type"))
+		fprintf(f, "type=\"%s\"\n", content);
+	else if(!strcmp(name,"idVendor"))
+		fprintf(f, "vendor_id=0x%s\n", content);
+	else if(!strcmp(name,"idProduct"))
+		fprintf(f, "product_id=0x%s\n", content);
+	else if(!strcmp(name,"SerialNumber_Enabled"))
+		if(!strcmp(content,"true")) {
+			st->use_serial_number = 1;
 			fprintf(f, "use_serial=true\t\t\t# Use the serial number string\n");
 		} else {
 			fprintf(f, "use_serial=false\t\t# Use the serial number string\n");
 		}
-	else if(!strcmp(node->name,"SerialNumber"))
-		fprintf(f, "serial=\"%s\"\t\t# Serial\n",xmlNodeGetContent(node));
-	else if(!strcmp(node->name,"SelfPowered"))
-		if(!strcmp(xmlNodeGetContent(node),"true")) {
+	else if(!strcmp(name,"SerialNumber"))
+		fprintf(f, "serial=\"%s\"\t\t# Serial\n",content);
+	else if(!strcmp(name,"SelfPowered"))
+		if(!strcmp(content,"true")) {
 			fprintf(f, "max_power=0\t\t# Max. power consumption: value * 2 mA. Use 0 if self_powered = true.\n");
 			fprintf(f, "self_powered=true\t\t# Turn this off for bus powered\n");
-			self_powered = 1;
+			st->self_powered = 1;
 		} else {
 			fprintf(f, "self_powered=false\t\t# Turn this off for bus powered\n");
 		}
-	else if(!strcmp(node->name,"MaxPower")) {
-		if(!self_powered)
-			fprintf(f, "max_power=%s\t\t\t# Max. power consumption: value * 2 mA. Use 0 if self_powered = true.\n", xmlNodeGetContent(node));
-	} else if(!strcmp(node->name,"IOpullDown"))
-		fprintf(f, "suspend_pull_downs=%s\t# Enable suspend pull downs for lower power\n",xmlNodeGetContent(node));
-	else if(!strcmp(node->name,"bcdUSB")) {
+	else if(!strcmp(name,"MaxPower")) {
+		if(!st->self_powered)
+			fprintf(f, "max_power=%s\t\t\t# Max. power consumption: value * 2 mA. Use 0 if self_powered = true.\n", content);
+	} else if(!strcmp(name,"IOpullDown"))
+		fprintf(f, "suspend_pull_downs=%s\t# Enable suspend pull downs for lower power\n",content);
+	else if(!strcmp(name,"bcdUSB")) {
 		;
-	} else if(!strcmp(node->name, "Product_Description"))
-		fprintf(f, "product=\"%s\"\t\t# Product\n",xmlNodeGetContent(node));
-	else if(strstr(xmlGetNodePath(node),"Port_A")) {
-		if(!strcmp(node->name,"Virtual_Com_Port") && !strcmp(xmlNodeGetContent(node),"true"))
-			fprintf(f, "channel_a_driver=VCP\t\t# Use VCP driver\n");
-		if(!strcmp(node->name,"D2XX_Direct") && !strcmp(xmlNodeGetContent(node),"true"))
-			fprintf(f, "channel_a_driver=D2XX\t\t# Use D2XX driver\n");
-	} else if(strstr(xmlGetNodePath(node),"Port_B")) {
-		if(!strcmp(node->name,"Virtual_Com_Port") && !strcmp(xmlNodeGetContent(node),"true"))
-			fprintf(f, "channel_b_driver=VCP\t\t# Use VCP driver\n");
-		if(!strcmp(node->name,"D2XX_Direct") && !strcmp(xmlNodeGetContent(node),"true"))
-			fprintf(f, "channel_b_driver=D2XX\t\t# Use D2XX driver\n");
-	} else if(strstr(xmlGetNodePath(node),"Port_C")) {
-		if(!strcmp(node->name,"Virtual_Com_Port") && !strcmp(xmlNodeGetContent(node),"true"))
-			fprintf(f, "channel_c_driver=VCP\t\t# Use VCP driver\n");
-		if(!strcmp(node->name,"D2XX_Direct") && !strcmp(xmlNodeGetContent(node),"true"))
-			fprintf(f, "channel_c_driver=D2XX\t\t# Use D2XX driver\n");
-	} else if(strstr(xmlGetNodePath(node),"Port_D")) {
-		if(!strcmp(node->name,"Virtual_Com_Port") && !strcmp(xmlNodeGetContent(node),"true"))
-			fprintf(f, "channel_d_driver=VCP\t\t# Use VCP driver\n");
-		if(!strcmp(node->name,"D2XX_Direct") && !strcmp(xmlNodeGetContent(node),"true"))
-			fprintf(f, "channel_d_driver=D2XX\t\t# Use D2XX driver\n");
+	} else if(!strcmp(name, "Product_Description"))
+		fprintf(f, "product=\"%s\"\t\t# Product\n",content);
+	else if(port != 0) {
+		/* FT4232H and FT2232H exports call these VCP and D2XX */
+		if((!strcmp(name,"Virtual_Com_Port") || !strcmp(name,"VCP")) && !strcmp(content,"true"))
+			fprintf(f, "channel_%c_driver=VCP\t\t# Use VCP driver\n", port - 'A' + 'a');
+		if((!strcmp(name,"D2XX_Direct") || !strcmp(name,"D2XX")) && !strcmp(content,"true"))
+			fprintf(f, "channel_%c_driver=D2XX\t\t# Use D2XX driver\n", port - 'A' + 'a');
 	}
-	
-
-	fclose(f);
 }
 
 /**
- * @brief For leaf nodes it executes process_node.  For non leaf nodes, it
- *         continues walking down the XML tree.
+ * @brief Generate the output configuration file.
  *
- * \param a_node xmlNodePtr to process, filename - name of input file.
+ * \param filename - input file to process, cfg_file - output file to write to,
+ *        verbose - print progress, err/errlen - buffer receiving the reason of a failure.
  *
- * Function walks an XML tree if a_node is not a leaf node, otherwise, runs
- *          process_node on a_node.
+ * Function streams the XML document and converts only the leaf nodes.
+ *          All state lives in the call, so documents can be converted
+ *          on several threads at once.  Returns 0 on success, -1 on error.
  * 
  **/
-void
-process_elements(xmlNodePtr a_node, const char *filename) {
-	xmlNode *cur_node = NULL;
-	char cur_prefix[20];
+int
+generate_configuration(const char* filename,const char* cfg_file, int verbose, char *err, int errlen) {
+	struct xform_state st;
+	time_t t = time(NULL);
+	struct tm tm;
+	char tbuf[32];
+
+	memset(&st, 0, sizeof(st));
+	st.f = fopen(cfg_file, "w");
+	if(st.f == NULL) {
+		snprintf(err, errlen, "opening %s: %s", cfg_file, strerror(errno));
+		return -1;
+	}
+	setvbuf(st.f, NULL, _IOFBF, 65536);
+
+	if(verbose) printf("Generating configuration file...\n");
+	fprintf(st.f,"# File: %s\n# Time: %s",cfg_file,asctime_r(localtime_r(&t, &tm), tbuf));
+	fprintf(st.f,"##################################\n");
+	fprintf(st.f,"#  ftdi-xform-config generated   #\n");
+	fprintf(st.f,"#  configuration File            #\n");
+	fprintf(st.f,"#  vvvvvvvvvvvvvvvvvvvvvvvvvvvv  #\n");
+	fprintf(st.f,"##################################\n\n");
+
+	if(ftdi_xml_read(filename, !verbose, process_node, &st, err, errlen) != 0) {
+		fclose(st.f);
+		remove(cfg_file);
+		return -1;
+	}
 	
-	for (cur_node = a_node; cur_node; cur_node = cur_node->next) {
-		if (isLeaf(cur_node)) {
-			if(!xmlIsBlankNode(cur_node)) {
-				process_node(cur_node, filename);
-				printf("Node type: Element, name: %s,%s<%s> --\n",cur_node->name,xmlGetNodePath(cur_node),xmlNodeGetContent(cur_node), xmlGetNodePath(cur_node));
-			}
-		} else {
-			process_elements(cur_node->children,filename);
-		}
-		
-		/*print_element_names(cur_node->children); */
+	if(verbose) printf("Appending additional elements...\n");
+	fprintf(st.f,"\n\n##################################\n");
+	fprintf(st.f,"#  ^^^^^^^^^^^^^^^^^^^^^^^^^^^^  #\n");
+	fprintf(st.f,"#  ftdi-xform-config generated   #\n");
+	fprintf(st.f,"#  configuration File            #\n");
+	fprintf(st.f,"##################################\n\n");
+	fprintf(st.f,"###########\n");
+	fprintf(st.f,"# Options #\n");
+	fprintf(st.f,"###########\n");
+	fprintf(st.f,"\n# Adjust your eeprom type for your configuration");
+	fprintf(st.f,"\neeprom_type=?\n\n");
+
+	fprintf(st.f,"########\n");
+	fprintf(st.f,"# Misc #\n");
+	fprintf(st.f,"########\n");
+	fprintf(st.f,"\n# Add a filename here if you need to save your binary");
+	fprintf(st.f,"\nfilename=?\n\n");
+	if(fclose(st.f) != 0) {
+		snprintf(err, errlen, "writing %s: %s", cfg_file, strerror(errno));
+		return -1;
 	}
+	
+	if(verbose) printf("Please check the new configuration file and modify as needed.\n");
+
+	return 0;
 }
 
 /**
- * @brief Generate the output configuration file.
- *
- * \param filename - input file to process, cfg_file - output file to write to.
+ * @brief One document of a batch conversion
+ **/
+struct batch_job {
+	char *input;
+	char *output;
+	int result;                 /**< 0 on success */
+	char err[256];              /**< reason of a failure */
+};
+
+/**
+ * @brief Documents of a batch conversion, shared by the workers
+ **/
+struct batch {
+	struct batch_job *jobs;
+	int count;
+	int next;                   /**< next job to hand out */
+};
+
+/**
+ * @brief Worker converting batch documents until none are left
  *
- * Function walks the XML tree and processes only the leaf nodes.  Probably not
- *          an ideal method, but it does get the job done.
+ * \param arg pointer to the struct batch to work on.
  * 
  **/
-void
-generate_configuration(const char* filename,const char* cfg_file) {
-	xmlDocPtr	doc;
-	xmlNodePtr root_element = NULL;
-	xmlXPathContextPtr xpathCtx;
-	xmlXPathObjectPtr xpathObj;
-	time_t t = time(NULL);
+static void *
+batch_worker(void *arg) {
+	struct batch *b = arg;
+	struct batch_job *job;
 	int i;
 
-	FILE *f;
-	
-	f = fopen(cfg_file, "w");
-	printf("Generating configuration file...\n");
-	fprintf(f,"# File: %s\n# Time: %s",cfg_file,asctime(localtime(&t)));
-	fprintf(f,"##################################\n");
-	fprintf(f,"#  ftdi-xform-config generated   #\n");
-	fprintf(f,"#  configuration File            #\n");
-	fprintf(f,"#  vvvvvvvvvvvvvvvvvvvvvvvvvvvv  #\n");
-	fprintf(f,"##################################\n\n");
-	if(f == NULL) {
-		perror("opening output config file");
-		return;
+	while((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+		job = &b->jobs[i];
+		job->result = generate_configuration(job->input, job->output, 0, job->err, sizeof(job->err));
 	}
-	fclose(f);
 
-	doc = xmlParseFile(filename);
-	if(doc == NULL) {
-		fprintf(stderr, "Failed to parse %s\n", filename);
-		return;
+	return NULL;
+}
+
+/**
+ * @brief Queue an input document for a batch conversion
+ *
+ * \param b batch to add to, input - xml document, outdir - directory for the
+ *        output or NULL to write next to the input.
+ *
+ * The output name is the input name with .xml replaced by .cfg.
+ * Function returns 0 on success, -1 if out of memory.
+ * 
+ **/
+static int
+batch_add(struct batch *b, const char *input, const char *outdir) {
+	struct batch_job *jobs;
+	const char *base = strrchr(input, '/');
+	int len, dirlen;
+
+	if((jobs = realloc(b->jobs, (b->count + 1) * sizeof(*jobs))) == NULL)
+		return -1;
+	b->jobs = jobs;
+	memset(&jobs[b->count], 0, sizeof(*jobs));
+
+	base = base ? base + 1 : input;
+	len = strlen(base);
+	if(len > 4 && !strcasecmp(base + len - 4, ".xml"))
+		len -= 4;
+	dirlen = outdir ? (int)strlen(outdir) + 1 : (int)(base - input);
+	jobs[b->count].input = strdup(input);
+	jobs[b->count].output = malloc(dirlen + len + 5);
+	if(jobs[b->count].input == NULL || jobs[b->count].output == NULL) {
+		free(jobs[b->count].input);
+		free(jobs[b->count].output);
+		return -1;
 	}
+	if(outdir)
+		sprintf(jobs[b->count].output, "%s/%.*s.cfg", outdir, len, base);
+	else
+		sprintf(jobs[b->count].output, "%.*s%.*s.cfg", dirlen, input, len, base);
+	b->count++;
 
-/*	
-	xpathCtx = xmlXPathNewContext(doc);
-	if(xpathCtx == NULL) {
-		fprintf(stderr, "Error: Unable to create new XPath context\n");
-		xmlFreeDoc(doc);
-		return;
+	return 0;
+}
+
+static int
+cmp_name(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/**
+ * @brief Queue every .xml document of a directory
+ *
+ * \param b batch to add to, dir - directory to scan, outdir - see batch_add().
+ *
+ * Documents are queued in name order.  Function returns the number
+ * of documents queued, or -1 on error.
+ * 
+ **/
+static int
+batch_add_dir(struct batch *b, const char *dir, const char *outdir) {
+	DIR *d;
+	struct dirent *de;
+	char **names = NULL, **tmp, *path;
+	int n = 0, i, len, ret = 0;
+
+	if((d = opendir(dir)) == NULL) {
+		perror(dir);
+		return -1;
+	}
+	while((de = readdir(d)) != NULL) {
+		len = strlen(de->d_name);
+		if(len <= 4 || strcasecmp(de->d_name + len - 4, ".xml"))
+			continue;
+		if((tmp = realloc(names, (n + 1) * sizeof(*names))) == NULL ||
+			(tmp[n] = strdup(de->d_name)) == NULL) {
+			names = tmp ? tmp : names;
+			ret = -1;
+			break;
+		}
+		names = tmp;
+		n++;
 	}
+	closedir(d);
 
-	xpathObj = xmlXPathEvalExpression("/FT_EEPROM/Hardware_Specific/Port_A", xpathCtx);
-	if(xpathObj == NULL) {
-		fprintf(stderr, "Error: unable to evaluate xpath expresssion \"%s\"\n", "/FT_EEPROM/Hardware_Specific/Port_A");
-		xmlXPathFreeContext(xpathCtx);
-		xmlFreeDoc(doc);
-		return;
+	qsort(names, n, sizeof(*names), cmp_name);
+	for(i = 0; i < n; i++) {
+		if(ret == 0 && (path = malloc(strlen(dir) + strlen(names[i]) + 2)) != NULL) {
+			sprintf(path, "%s/%s", dir, names[i]);
+			if(batch_add(b, path, outdir) < 0)
+				ret = -1;
+			free(path);
+		} else {
+			ret = -1;
+		}
+		free(names[i]);
 	}
-*/
-	root_element = xmlDocGetRootElement(doc);
-	process_elements(root_element,cfg_file);
-	
-	f = fopen(cfg_file, "a+");
-	printf("Appending additional elements...\n");
-	fprintf(f,"\n\n##################################\n");
-	fprintf(f,"#  ^^^^^^^^^^^^^^^^^^^^^^^^^^^^  #\n");
-	fprintf(f,"#  ftdi-xform-config generated   #\n");
-	fprintf(f,"#  configuration File            #\n");
-	fprintf(f,"##################################\n\n");
-	if(f == NULL) {
-		perror("opening output config file");
-		return;
+	free(names);
+
+	return ret < 0 ? -1 : n;
+}
+
+/**
+ * @brief Convert every queued document on a pool of worker threads
+ *
+ * \param b documents to convert, workers - number of threads to use.
+ *
+ * Function prints a summary with every failure and returns the
+ * number of documents that could not be converted.
+ * 
+ **/
+static int
+run_batch(struct batch *b, int workers) {
+	pthread_t *threads;
+	struct timespec start, end;
+	int i, started = 0, failed = 0;
+
+	if(workers > b->count)
+		workers = b->count;
+	if(workers < 1)
+		workers = 1;
+	threads = calloc(workers, sizeof(*threads));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; threads && i < workers; i++) {
+		if(pthread_create(&threads[i], NULL, batch_worker, b))
+			break;
+		started++;
 	}
-	fprintf(f,"###########\n");
-	fprintf(f,"# Options #\n");
-	fprintf(f,"###########\n");
-	fprintf(f,"\n# Adjust your eeprom type for your configuration");
-	fprintf(f,"\neeprom_type=?\n\n");
-
-	fprintf(f,"########\n");
-	fprintf(f,"# Misc #\n");
-	fprintf(f,"########\n");
-	fprintf(f,"\n# Add a filename here if you need to save your binary");
-	fprintf(f,"\nfilename=?\n\n");
-	fclose(f);
-	
-	printf("Please check the new configuration file and modify as needed.\n");
-	
-//	for(i = xpathObj->nodesetval->nodeNr-1; i >= 0; i--)
-//		print_element_names(xpathObj->nodesetval->nodeTab[i],"");
-	
+	if(started == 0)
+		batch_worker(b);
+	for(i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	free(threads);
 
-	xmlFreeDoc(doc);
+	for(i = 0; i < b->count; i++)
+		if(b->jobs[i].result)
+			failed++;
+	printf("Converted %d of %d files in %.3f s using %d workers.\n", b->count - failed, b->count,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, started ? started : 1);
+	if(failed) {
+		printf("Failed:\n");
+		for(i = 0; i < b->count; i++)
+			if(b->jobs[i].result)
+				printf("  %s: %s\n", b->jobs[i].input, b->jobs[i].err);
+	}
+
+	return failed;
 }
 
 /**
@@ -253,7 +359,11 @@ generate_configuration(const char* filename,const char* cfg_file) {
  **/
 void
 usage(char *program) {
-	printf("\n%s <input FTDI xml configuration> <output configuration file>\n\n", program);
+	printf("\n%s <input FTDI xml configuration> <output configuration file>\n", program);
+	printf("%s -b [-j <jobs>] [-o <output dir>] <xml file or directory>...\n\n", program);
+	printf("-b\t\t\tconvert every listed file and every .xml file of listed directories.\n");
+	printf("-j <jobs>\t\tnumber of documents converted at once (default: one per cpu).\n");
+	printf("-o <output dir>\t\twrite batch output there instead of next to each input.\n\n");
 	printf("NOTE: Output configuration file is also compatible with ftdi_eeprom.\n");
 	printf("      When using this tool with ftdi_eeprom, please change your eeprom_type.\n");
 	printf("      This will avoid any potential \"bricking\" issues with ftdi_eeprom.\n");
@@ -271,23 +381,59 @@ usage(char *program) {
  * 
  **/
 int main(int argc, char **argv) {
+	struct batch b = { NULL, 0, 0 };
+	struct stat sb;
+	char err[256];
+	char *outdir = NULL;
+	int _batch = 0, workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, ret = 0;
 
 		printf ("\nftdi-xform-config %s\n", EEPROM_VERSION_STRING);
     printf ("\nAn FTDI eeprom configuration conversion tool\n");
     printf ("(c) Brandon Warhurst\n");
 
-	if (argc < 2)
+	while ((i = getopt(argc, argv, "bhj:o:")) != -1) {
+		switch(i) {
+		case 'b':       /* batch mode */
+			_batch = 1;
+			break;
+		case 'j':       /* worker threads */
+			workers = atoi(optarg);
+			break;
+		case 'o':       /* batch output directory */
+			outdir = optarg;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((_batch && optind >= argc) || (!_batch && argc - optind < 2))
 		usage(argv[0]);
 
 	xmlInitParser();
 	
 	LIBXML_TEST_VERSION
 
-	generate_configuration(argv[1],argv[2]);
+	if (_batch) {
+		for (i = optind; i < argc && ret == 0; i++) {
+			if (stat(argv[i], &sb) == 0 && S_ISDIR(sb.st_mode))
+				ret = batch_add_dir(&b, argv[i], outdir) < 0;
+			else
+				ret = batch_add(&b, argv[i], outdir) < 0;
+		}
+		if (ret == 0)
+			ret = run_batch(&b, workers);
+		for (i = 0; i < b.count; i++) {
+			free(b.jobs[i].input);
+			free(b.jobs[i].output);
+		}
+		free(b.jobs);
+	} else if ((ret = generate_configuration(argv[optind],argv[optind+1],1,err,sizeof(err))) != 0) {
+		fprintf(stderr, "%s: %s\n", argv[optind], err);
+	}
 
 	xmlCleanupParser();
 
-	xmlMemoryDump();
-
-	return(0);
+	return(ret ? 1 : 0);
 }
@@ -0,0 +1,839 @@
+/***************************************************************************
+                           ftdi_dev.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Device access layer.  Everything that talks to a device goes through
+ a struct fdev_ops backend: the default one drives real hardware with
+ libftdi, the emulator in ftdi_emu.c keeps eeproms in memory.  Building
+ and decoding eeprom images stays with libftdi regardless of backend.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ftdi_dev.h"
+#include "dev_lock.h"
+
+static const struct fdev_ops *backend = &fdev_libftdi_ops;
+static int pipeline = FDEV_PIPELINE_DEPTH;
+
+/**
+ * @brief Select the backend used by subsequent scans and opens
+ *
+ * \param ops backend operations, NULL for the libftdi backend
+ **/
+void fdev_set_backend(const struct fdev_ops *ops)
+{
+	backend = ops ? ops : &fdev_libftdi_ops;
+}
+
+/**
+ * @brief Return the backend used by scans and opens
+ **/
+const struct fdev_ops *fdev_backend(void)
+{
+	return backend;
+}
+
+/**
+ * @brief Set how many eeprom transfers may be in flight at once
+ *
+ * \param depth transfers in flight, 1 for one synchronous transfer
+ *         per word as libftdi does
+ **/
+void fdev_set_pipeline(int depth)
+{
+	pipeline = depth < 1 ? 1 : depth;
+}
+
+int fdev_pipeline(void)
+{
+	return pipeline;
+}
+
+/**
+ * @brief Format the USB bus/port path of a device
+ *
+ * \param dev libusb device to describe
+ * \param buf buffer receiving the path, e.g. "1-2.3"
+ * \param len size of buf
+ *
+ * Function returns buf.  The path stays stable for a given
+ * physical port, so it identifies a unit on a fixture even
+ * when every board carries the same serial number.
+ **/
+char *fdev_usb_path(struct libusb_device *dev, char *buf, int len)
+{
+	uint8_t ports[7];
+	int i, n, pos;
+
+	pos = snprintf(buf, len, "%d", libusb_get_bus_number(dev));
+	n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	for (i = 0; i < n && pos < len; i++)
+		pos += snprintf(buf + pos, len - pos, "%c%d", i ? '.' : '-', ports[i]);
+
+	return buf;
+}
+
+/**
+ * @brief List the devices matching a vid/pid
+ *
+ * \param ftdi pointer to ftdi_context used for enumeration
+ * \param vid vendor id to match
+ * \param pid product id to match
+ * \param list receives an array to release with fdev_scan_free()
+ *
+ * Function returns the number of devices found, or a negative
+ * value on error.
+ **/
+int fdev_scan(struct ftdi_context *ftdi, int vid, int pid, struct fdev_info **list)
+{
+	*list = NULL;
+	return backend->scan(ftdi, vid, pid, list);
+}
+
+void fdev_scan_free(struct fdev_info *list, int n)
+{
+	if (list)
+		backend->scan_free(list, n);
+}
+
+/**
+ * @brief Open a device found by fdev_scan()
+ *
+ * \param dev device to initialize
+ * \param ftdi context holding the eeprom state of the device
+ * \param info device to open
+ *
+ * The device is locked by its path first, so no other process opens
+ * it until fdev_close().  info must come from a scan of ftdi: the
+ * pipelined transfers are completed by handling the events of ftdi's
+ * libusb context, and a device of another context never sees them.
+ * Returns 0 on success, FDEV_LOCKED if another process keeps it
+ * locked, a negative value otherwise.
+ **/
+int fdev_open_info(struct fdev *dev, struct ftdi_context *ftdi, const struct fdev_info *info)
+{
+	int ret;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->ftdi = ftdi;
+	dev->vid = info->vid;
+	dev->pid = info->pid;
+	strcpy(dev->path, info->path);
+	if ((ret = dev_lock_acquire(info->path)) < 0) {
+		ftdi->error_str = ret == -1 ? "device locked by another process" : "can't lock device";
+		return ret == -1 ? FDEV_LOCKED : -4;
+	}
+	if ((ret = backend->open(dev, info)) == 0)
+		dev->ops = backend;
+	else
+		dev_lock_release(info->path);
+
+	return ret;
+}
+
+/**
+ * @brief Add a vid/pid pair to a device selection
+ *
+ * \param m selection to extend
+ * \param vid vendor id
+ * \param pid product id
+ *
+ * Pairs with a zero id, pairs already present and pairs beyond
+ * FDEV_MATCH_IDS are ignored.
+ **/
+void fdev_match_add(struct fdev_match *m, int vid, int pid)
+{
+	int i;
+
+	if (vid == 0 || pid == 0 || m->n_ids >= FDEV_MATCH_IDS)
+		return;
+	for (i = 0; i < m->n_ids; i++)
+		if (m->ids[i][0] == vid && m->ids[i][1] == pid)
+			return;
+	m->ids[m->n_ids][0] = vid;
+	m->ids[m->n_ids][1] = pid;
+	m->n_ids++;
+}
+
+/**
+ * @brief Check the string criteria of a selection against a device
+ **/
+static int match_strings(struct ftdi_context *ftdi, const struct fdev_match *m, const struct fdev_info *info)
+{
+	char product[128] = "", serial[128] = "";
+
+	if (m->serial == NULL && m->product == NULL)
+		return 1;
+	if (backend->describe(ftdi, info, product, sizeof(product), serial, sizeof(serial)) < 0)
+		return 0;
+
+	return (m->serial == NULL || !strcmp(m->serial, serial)) &&
+		(m->product == NULL || !strcmp(m->product, product));
+}
+
+/**
+ * @brief Open the device picked by a selection
+ *
+ * \param dev device to initialize
+ * \param ftdi context holding the eeprom state of the device
+ * \param m selection criteria
+ *
+ * Devices are enumerated once.  Candidates must match the path and
+ * one of the vid/pid pairs, or any id if m has none.  They are ranked
+ * by the pair's position, the string criteria are checked in that
+ * order, asking the device only when needed, and the index-th
+ * survivor is opened.
+ * Behaves like ftdi_usb_open(): returns 0 on success, -3 if no
+ * device was found, FDEV_LOCKED if the chosen one is locked by
+ * another process, or the error of the backend.
+ **/
+int fdev_select(struct fdev *dev, struct ftdi_context *ftdi, const struct fdev_match *m)
+{
+	struct fdev_info *list;
+	int n, i, k, found = 0, ret = -3;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->ftdi = ftdi;
+	if ((n = fdev_scan(ftdi, FDEV_ANY_ID, FDEV_ANY_ID, &list)) < 0)
+		return n;
+
+	for (k = 0; (k < m->n_ids || k == 0) && ret == -3; k++) {
+		for (i = 0; i < n; i++) {
+			if (m->n_ids && (list[i].vid != m->ids[k][0] || list[i].pid != m->ids[k][1]))
+				continue;
+			if (m->path && strcmp(m->path, list[i].path))
+				continue;
+			if (!match_strings(ftdi, m, &list[i]))
+				continue;
+			if (found++ == m->index) {
+				ret = fdev_open_info(dev, ftdi, &list[i]);
+				break;
+			}
+		}
+	}
+	fdev_scan_free(list, n);
+	if (ret == -3)
+		ftdi->error_str = "device not found";
+
+	return ret;
+}
+
+/**
+ * @brief Close a device, if it is open
+ *
+ * Returns 0 on success, the error of the backend otherwise.
+ **/
+int fdev_close(struct fdev *dev)
+{
+	int ret = 0;
+
+	if (dev->ops) {
+		ret = dev->ops->close(dev);
+		dev_lock_release(dev->path);
+	}
+	dev->ops = NULL;
+
+	return ret;
+}
+
+/*
+ Pipelined eeprom transfers.  libftdi reads and writes the eeprom with
+ one synchronous control transfer per word, so every word costs a full
+ round trip to the device.  Here up to depth transfers are submitted
+ at once through the backend's submit and each completion submits the
+ next word.  The device serves its control endpoint strictly in order
+ and completes a write request only once the word is written, so words
+ still reach the eeprom one after the other, in the order given.
+ The engine is the same for every backend, only submit, wait and
+ cancel differ.
+ */
+
+#define PIPE_MAX_DEPTH 32
+
+struct pipe_slot {
+	struct fdev_xfer x;
+	struct pipe *pipe;
+	int index;                          /**< word carried by the transfer */
+	int busy;                           /**< submitted and not completed */
+};
+
+struct pipe {
+	struct fdev *dev;
+	int out;                            /**< 1 to write, 0 to read */
+	const unsigned short *addrs;
+	unsigned short *vals;
+	int n;
+	int next;                           /**< next word to submit */
+	int in_flight;
+	int idle;                           /**< set once nothing is in flight */
+	int error;
+};
+
+/**
+ * @brief Submit the next word of a pipe on a free slot
+ **/
+static void pipe_submit(struct pipe *p, struct pipe_slot *slot)
+{
+	int i;
+
+	if (p->error || p->next >= p->n)
+		return;
+	i = slot->index = p->next++;
+	slot->x.out = p->out;
+	slot->x.addr = p->addrs[i];
+	slot->x.val = p->out ? p->vals[i] : 0;
+	if (p->dev->ops->submit(p->dev, &slot->x) < 0) {
+		p->error = 1;
+		return;
+	}
+	slot->busy = 1;
+	p->in_flight++;
+	p->dev->transfers++;
+}
+
+static void pipe_done(struct fdev_xfer *x)
+{
+	struct pipe_slot *slot = x->priv;
+	struct pipe *p = slot->pipe;
+
+	slot->busy = 0;
+	p->in_flight--;
+	if (x->status < 0)
+		p->error = 1;
+	else if (!p->out)
+		p->vals[slot->index] = x->val;
+	pipe_submit(p, slot);
+	if (p->in_flight == 0)
+		p->idle = 1;
+}
+
+/**
+ * @brief Transfer eeprom words with several transfers in flight
+ *
+ * \param dev opened device whose backend can submit transfers
+ * \param out 1 to write vals, 0 to read into vals
+ * \param addrs word addresses
+ * \param vals words to write or receiving the words read
+ * \param n number of words
+ * \param depth transfers to keep in flight
+ *
+ * Returns 0 on success, -1 if any transfer failed.
+ **/
+static int fdev_pipe(struct fdev *dev, int out, const unsigned short *addrs, unsigned short *vals, int n, int depth)
+{
+	struct pipe_slot slots[PIPE_MAX_DEPTH];
+	struct pipe p;
+	int i;
+
+	if (n == 0)
+		return 0;
+	memset(&p, 0, sizeof(p));
+	p.dev = dev;
+	p.out = out;
+	p.addrs = addrs;
+	p.vals = vals;
+	p.n = n;
+	if (depth > PIPE_MAX_DEPTH)
+		depth = PIPE_MAX_DEPTH;
+	if (depth > n)
+		depth = n;
+	if (depth < 1)
+		depth = 1;
+
+	memset(slots, 0, depth * sizeof(slots[0]));
+	for (i = 0; i < depth; i++) {
+		slots[i].pipe = &p;
+		slots[i].x.done = pipe_done;
+		slots[i].x.priv = &slots[i];
+	}
+	for (i = 0; i < depth; i++)
+		pipe_submit(&p, &slots[i]);
+	p.idle = (p.in_flight == 0);
+	while (!p.idle) {
+		if (dev->ops->wait(dev, &p.idle) < 0 && !p.error) {
+			/* Nothing may stay in flight once the slots go out of scope */
+			p.error = 1;
+			for (i = 0; i < depth; i++)
+				if (slots[i].busy)
+					dev->ops->cancel(dev, &slots[i].x);
+		}
+	}
+	for (i = 0; i < depth; i++)
+		if (slots[i].x.backend)
+			dev->ops->release(dev, &slots[i].x);
+
+	if (p.error || p.next < n) {
+		dev->ftdi->error_str = out ? "unable to write eeprom" : "reading eeprom failed";
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Read the whole eeprom
+ *
+ * \param dev opened device
+ * \param buf buffer of FTDI_MAX_EEPROM_SIZE bytes receiving the contents
+ * \param size receives the eeprom size guessed from the contents,
+ *         -1 if it is blank
+ *
+ * The contents are also loaded into the eeprom state of dev->ftdi,
+ * as ftdi_read_eeprom() does.
+ **/
+int fdev_read_eeprom(struct fdev *dev, unsigned char *buf, int *size)
+{
+	return dev->ops->read_eeprom(dev, buf, size);
+}
+
+int fdev_read_word(struct fdev *dev, int addr, unsigned short *val)
+{
+	return dev->ops->read_word(dev, addr, val);
+}
+
+/**
+ * @brief Read eeprom words
+ *
+ * \param dev opened device
+ * \param addrs word addresses
+ * \param vals receives the words
+ * \param n number of words
+ *
+ * Up to fdev_pipeline() transfers are kept in flight.
+ **/
+int fdev_read_words(struct fdev *dev, const unsigned short *addrs, unsigned short *vals, int n)
+{
+	int i;
+
+	if (dev->ops->submit)
+		return fdev_pipe(dev, 0, addrs, vals, n, pipeline);
+	for (i = 0; i < n; i++)
+		if (dev->ops->read_word(dev, addrs[i], &vals[i]) < 0)
+			return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Prepare a device for fdev_write_word()
+ **/
+int fdev_write_begin(struct fdev *dev)
+{
+	return dev->ops->write_begin(dev);
+}
+
+int fdev_write_word(struct fdev *dev, int addr, unsigned short val)
+{
+	return dev->ops->write_word(dev, addr, val);
+}
+
+/**
+ * @brief Write eeprom words
+ *
+ * \param dev device prepared with fdev_write_begin()
+ * \param addrs word addresses
+ * \param vals words to write
+ * \param n number of words
+ *
+ * Words are written in the order given, with up to fdev_pipeline()
+ * transfers in flight.  Nothing is submitted after a failure, but
+ * words already in flight may still be written.
+ **/
+int fdev_write_words(struct fdev *dev, const unsigned short *addrs, const unsigned short *vals, int n)
+{
+	int i;
+
+	if (dev->ops->submit)
+		return fdev_pipe(dev, 1, addrs, (unsigned short *)vals, n, pipeline);
+	for (i = 0; i < n; i++)
+		if (dev->ops->write_word(dev, addrs[i], vals[i]) < 0)
+			return -1;
+
+	return 0;
+}
+
+/**
+ * @brief Erase the eeprom
+ *
+ * \param dev opened device
+ * \param chip receives the eeprom type found while erasing,
+ *         0 for an internal eeprom and -1 if there is none
+ **/
+int fdev_erase(struct fdev *dev, int *chip)
+{
+	return dev->ops->erase(dev, chip);
+}
+
+/**
+ * @brief Reset the device so it re-enumerates with its new eeprom
+ *
+ * Every attempt is counted in dev->resets.
+ **/
+int fdev_reset(struct fdev *dev)
+{
+	dev->resets++;
+	return dev->ops->reset(dev);
+}
+
+/**
+ * @brief Initialize the eeprom state of a device with defaults
+ *
+ * \param dev opened device
+ * \param manufacturer manufacturer string
+ * \param product product string
+ * \param serial serial string
+ *
+ * Wraps ftdi_eeprom_initdefaults(), which refuses to work without
+ * a libusb handle although it never uses it.  Devices without one,
+ * emulated ones, get a placeholder for the duration of the call;
+ * libftdi has no other public way to set the strings and eeprom size
+ * of such a context.  Returns 0, or what ftdi_eeprom_initdefaults()
+ * returns on error, in which case nothing can be built.
+ **/
+int fdev_initdefaults(struct fdev *dev, char *manufacturer, char *product, char *serial)
+{
+	static char placeholder;
+	struct libusb_device_handle *usb_dev = dev->ftdi->usb_dev;
+	int ret;
+
+	if (usb_dev == NULL)
+		dev->ftdi->usb_dev = (struct libusb_device_handle *)&placeholder;
+	ret = ftdi_eeprom_initdefaults(dev->ftdi, manufacturer, product, serial);
+	dev->ftdi->usb_dev = usb_dev;
+
+	return ret;
+}
+
+/**
+ * @brief Control transfers of an ftdi_erase_eeprom() call
+ *
+ * \param type ftdi_chip_type of the device
+ * \param ret what the erase returned
+ * \param chip eeprom type the erase found
+ *
+ * libftdi erases, writes a marker at word 0xc0 and reads words 0x00,
+ * 0x40 and 0xc0 until it finds the marker, then erases again.
+ * Internal eeproms are left alone.  A failed erase is counted as its
+ * first transfer.
+ **/
+int fdev_erase_transfers(int type, int ret, int chip)
+{
+	if (type == TYPE_R || type == TYPE_230X)
+		return 0;
+	if (ret != 0)
+		return 1;
+
+	return chip == 0x46 ? 4 : chip == 0x56 ? 5 : 6;
+}
+
+/**
+ * @brief Guess the eeprom size from its contents
+ *
+ * \param type ftdi_chip_type of the device
+ * \param buf FTDI_MAX_EEPROM_SIZE bytes read from the device
+ *
+ * Same guess as ftdi_read_eeprom(): smaller eeproms wrap around, so
+ * their contents repeat.  Returns the size in bytes, -1 if blank.
+ **/
+int fdev_guess_size(int type, const unsigned char *buf)
+{
+	int i;
+
+	for (i = 0; i < FTDI_MAX_EEPROM_SIZE; i++)
+		if (buf[i] != 0xff) break;
+	if (type == TYPE_R)
+		return 0x80;
+	if (i == FTDI_MAX_EEPROM_SIZE)
+		return -1;
+	if (memcmp(buf, buf + 0x80, 0x80) == 0)
+		return 0x80;
+	if (memcmp(buf, buf + 0x40, 0x40) == 0)
+		return 0x40;
+	return 0x100;
+}
+
+/*
+ libftdi backend
+ */
+
+/**
+ * @brief List every USB device, whatever its vid/pid
+ **/
+static int libftdi_scan_any(struct ftdi_context *ftdi, struct fdev_info **list)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device **devs;
+	int n, i, k = 0;
+
+	if ((n = libusb_get_device_list(ftdi->usb_ctx, &devs)) < 0) {
+		ftdi->error_str = "libusb_get_device_list() failed";
+		return -5;
+	}
+	if ((*list = calloc(n ? n : 1, sizeof(**list))) == NULL) {
+		libusb_free_device_list(devs, 1);
+		ftdi->error_str = "out of memory";
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (libusb_get_device_descriptor(devs[i], &desc) != 0)
+			continue;
+		(*list)[k].handle = libusb_ref_device(devs[i]);
+		(*list)[k].vid = desc.idVendor;
+		(*list)[k].pid = desc.idProduct;
+		fdev_usb_path(devs[i], (*list)[k].path, sizeof((*list)[k].path));
+		k++;
+	}
+	libusb_free_device_list(devs, 1);
+
+	return k;
+}
+
+static int libftdi_scan(struct ftdi_context *ftdi, int vid, int pid, struct fdev_info **list)
+{
+	struct ftdi_device_list *devlist, *cur;
+	struct libusb_device_descriptor desc;
+	int n, i = 0;
+
+	if (vid == FDEV_ANY_ID)
+		return libftdi_scan_any(ftdi, list);
+	if ((n = ftdi_usb_find_all(ftdi, &devlist, vid, pid)) <= 0)
+		return n;
+	if ((*list = calloc(n, sizeof(**list))) == NULL) {
+		ftdi_list_free(&devlist);
+		ftdi->error_str = "out of memory";
+		return -1;
+	}
+	for (cur = devlist; cur && i < n; cur = cur->next, i++) {
+		(*list)[i].handle = libusb_ref_device(cur->dev);
+		if (libusb_get_device_descriptor(cur->dev, &desc) == 0) {
+			(*list)[i].vid = desc.idVendor;
+			(*list)[i].pid = desc.idProduct;
+		}
+		fdev_usb_path(cur->dev, (*list)[i].path, sizeof((*list)[i].path));
+	}
+	ftdi_list_free(&devlist);
+
+	return i;
+}
+
+static void libftdi_scan_free(struct fdev_info *list, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		libusb_unref_device(list[i].handle);
+	free(list);
+}
+
+static int libftdi_describe(struct ftdi_context *ftdi, const struct fdev_info *info,
+	char *product, int product_len, char *serial, int serial_len)
+{
+	return ftdi_usb_get_strings(ftdi, info->handle, NULL, 0, product, product_len, serial, serial_len);
+}
+
+static int libftdi_open(struct fdev *dev, const struct fdev_info *info)
+{
+	struct libusb_device_descriptor desc;
+	int ret;
+
+	if ((ret = ftdi_usb_open_dev(dev->ftdi, info->handle)) < 0)
+		return ret;
+	if (libusb_get_device_descriptor(info->handle, &desc) != 0)
+		return 0;
+	if (desc.iManufacturer)
+		libusb_get_string_descriptor_ascii(dev->ftdi->usb_dev, desc.iManufacturer,
+			(unsigned char *)dev->manufacturer, sizeof(dev->manufacturer));
+	if (desc.iProduct)
+		libusb_get_string_descriptor_ascii(dev->ftdi->usb_dev, desc.iProduct,
+			(unsigned char *)dev->product, sizeof(dev->product));
+	if (desc.iSerialNumber)
+		libusb_get_string_descriptor_ascii(dev->ftdi->usb_dev, desc.iSerialNumber,
+			(unsigned char *)dev->serial, sizeof(dev->serial));
+
+	return 0;
+}
+
+static int libftdi_close(struct fdev *dev)
+{
+	return ftdi_usb_close(dev->ftdi);
+}
+
+static int libftdi_read_eeprom(struct fdev *dev, unsigned char *buf, int *size)
+{
+	unsigned short addrs[FTDI_MAX_EEPROM_SIZE / 2], words[FTDI_MAX_EEPROM_SIZE / 2];
+	int ret, i;
+
+	*size = -1;
+	if (fdev_pipeline() > 1) {
+		for (i = 0; i < FTDI_MAX_EEPROM_SIZE / 2; i++)
+			addrs[i] = i;
+		if (fdev_pipe(dev, 0, addrs, words, FTDI_MAX_EEPROM_SIZE / 2, fdev_pipeline()) < 0)
+			return -1;
+		for (i = 0; i < FTDI_MAX_EEPROM_SIZE / 2; i++) {
+			buf[i*2] = words[i] & 0xff;
+			buf[i*2+1] = words[i] >> 8;
+		}
+		*size = fdev_guess_size(dev->ftdi->type, buf);
+		return ftdi_set_eeprom_buf(dev->ftdi, buf, FTDI_MAX_EEPROM_SIZE);
+	}
+
+	/* ftdi_read_eeprom() reads every word, one transfer each */
+	dev->transfers += FTDI_MAX_EEPROM_SIZE / 2;
+	if ((ret = ftdi_read_eeprom(dev->ftdi)) != 0 ||
+		(ret = ftdi_get_eeprom_buf(dev->ftdi, buf, FTDI_MAX_EEPROM_SIZE)) != 0)
+		return ret;
+	ftdi_get_eeprom_value(dev->ftdi, CHIP_SIZE, size);
+
+	return 0;
+}
+
+static int libftdi_read_word(struct fdev *dev, int addr, unsigned short *val)
+{
+	dev->transfers++;
+	return ftdi_read_eeprom_location(dev->ftdi, addr, val);
+}
+
+static int libftdi_write_begin(struct fdev *dev)
+{
+	unsigned short status;
+
+	/* These commands were traced while running MProg (see ftdi_write_eeprom) */
+	dev->transfers++;
+	if (ftdi_usb_reset(dev->ftdi) != 0)
+		return -1;
+	dev->transfers++;
+	if (ftdi_poll_modem_status(dev->ftdi, &status) != 0)
+		return -1;
+	dev->transfers++;
+	if (ftdi_set_latency_timer(dev->ftdi, 0x77) != 0)
+		return -1;
+
+	return 0;
+}
+
+static int libftdi_write_word(struct fdev *dev, int addr, unsigned short val)
+{
+	/* ftdi_write_eeprom_location() only accepts the user area */
+	dev->transfers++;
+	if (libusb_control_transfer(dev->ftdi->usb_dev, FTDI_DEVICE_OUT_REQTYPE,
+			SIO_WRITE_EEPROM_REQUEST, val, addr,
+			NULL, 0, dev->ftdi->usb_write_timeout) < 0) {
+		dev->ftdi->error_str = "unable to write eeprom";
+		return -1;
+	}
+
+	return 0;
+}
+
+static int libftdi_erase(struct fdev *dev, int *chip)
+{
+	int ret;
+
+	*chip = -1;
+	ret = ftdi_erase_eeprom(dev->ftdi);
+	ftdi_get_eeprom_value(dev->ftdi, CHIP_TYPE, chip);
+	dev->transfers += fdev_erase_transfers(dev->ftdi->type, ret, *chip);
+
+	return ret;
+}
+
+static int libftdi_reset(struct fdev *dev)
+{
+	return libusb_reset_device(dev->ftdi->usb_dev);
+}
+
+static void LIBUSB_CALL libftdi_xfer_done(struct libusb_transfer *transfer)
+{
+	struct fdev_xfer *x = transfer->user_data;
+	unsigned char *data;
+
+	x->status = 0;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+			(!x->out && transfer->actual_length < 2)) {
+		x->status = -1;
+	} else if (!x->out) {
+		data = libusb_control_transfer_get_data(transfer);
+		x->val = data[0] | (data[1] << 8);
+	}
+	x->done(x);
+}
+
+/**
+ * @brief Submit an eeprom transfer, reusing the libusb transfer of x
+ **/
+static int libftdi_submit(struct fdev *dev, struct fdev_xfer *x)
+{
+	struct ftdi_context *ftdi = dev->ftdi;
+	struct libusb_transfer *transfer = x->backend;
+
+	if (transfer == NULL) {
+		if ((transfer = libusb_alloc_transfer(0)) == NULL)
+			return -1;
+		if ((transfer->buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + 2)) == NULL) {
+			libusb_free_transfer(transfer);
+			return -1;
+		}
+		transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		x->backend = transfer;
+	}
+	if (x->out)
+		libusb_fill_control_setup(transfer->buffer, FTDI_DEVICE_OUT_REQTYPE,
+			SIO_WRITE_EEPROM_REQUEST, x->val, x->addr, 0);
+	else
+		libusb_fill_control_setup(transfer->buffer, FTDI_DEVICE_IN_REQTYPE,
+			SIO_READ_EEPROM_REQUEST, 0, x->addr, 2);
+	libusb_fill_control_transfer(transfer, ftdi->usb_dev, transfer->buffer, libftdi_xfer_done, x,
+		x->out ? ftdi->usb_write_timeout : ftdi->usb_read_timeout);
+
+	return libusb_submit_transfer(transfer) < 0 ? -1 : 0;
+}
+
+static int libftdi_wait(struct fdev *dev, int *completed)
+{
+	return libusb_handle_events_completed(dev->ftdi->usb_ctx, completed);
+}
+
+static void libftdi_cancel(struct fdev *dev, struct fdev_xfer *x)
+{
+	libusb_cancel_transfer(x->backend);
+}
+
+static void libftdi_release(struct fdev *dev, struct fdev_xfer *x)
+{
+	libusb_free_transfer(x->backend);
+	x->backend = NULL;
+}
+
+const struct fdev_ops fdev_libftdi_ops = {
+	"libftdi",
+	libftdi_scan,
+	libftdi_scan_free,
+	libftdi_describe,
+	libftdi_open,
+	libftdi_close,
+	libftdi_read_eeprom,
+	libftdi_read_word,
+	libftdi_write_begin,
+	libftdi_write_word,
+	libftdi_erase,
+	libftdi_reset,
+	libftdi_submit,
+	libftdi_wait,
+	libftdi_cancel,
+	libftdi_release
+};
@@ -0,0 +1,165 @@
+/***************************************************************************
+                           ftdi_dev.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef FTDI_DEV_H
+#define FTDI_DEV_H
+
+#include <libusb-1.0/libusb.h>
+#include <libftdi1/ftdi.h>
+
+/**
+ * @brief A device found by a scan, not yet opened
+ **/
+struct fdev_info {
+	void *handle;               /**< backend reference to the device */
+	int vid, pid;
+	char path[32];              /**< USB bus/port path */
+};
+
+/**
+ * @brief Control transfers fdev_read_words() and fdev_write_words()
+ *        keep in flight unless fdev_set_pipeline() says otherwise
+ **/
+#define FDEV_PIPELINE_DEPTH 8
+
+/**
+ * @brief One eeprom word transfer of the pipelined engine
+ *
+ * The engine in ftdi_dev.c fills in the request and done, the backend
+ * fills in the result before calling done.
+ **/
+struct fdev_xfer {
+	int out;                            /**< 1 to write val, 0 to read into val */
+	int addr;                           /**< word address */
+	unsigned short val;                 /**< word written, or word read */
+	int status;                         /**< 0 if the transfer succeeded, negative if not */
+	void (*done)(struct fdev_xfer *x);  /**< completion, called from the backend's wait */
+	void *priv;                         /**< engine state */
+	void *backend;                      /**< backend state, freed by its release */
+};
+
+/**
+ * @brief vid or pid matching any device in fdev_scan()
+ **/
+#define FDEV_ANY_ID (-1)
+
+/**
+ * @brief vid/pid pairs a struct fdev_match can hold
+ **/
+#define FDEV_MATCH_IDS 16
+
+/**
+ * @brief fdev_open_info() and fdev_select() result for a device
+ *        another process keeps locked, see dev_lock.h
+ **/
+#define FDEV_LOCKED (-20)
+
+/**
+ * @brief How fdev_select() picks a device
+ *
+ * Candidates are taken in the order of ids, and in bus order for each
+ * pair.  Without ids every device is a candidate.  Unset string
+ * criteria are NULL.
+ **/
+struct fdev_match {
+	int ids[FDEV_MATCH_IDS][2]; /**< vid/pid pairs, most wanted first */
+	int n_ids;
+	const char *serial;         /**< serial string to match */
+	const char *product;        /**< product string to match */
+	const char *path;           /**< USB bus/port path to match */
+	int index;                  /**< which of the matching devices to open */
+};
+
+/**
+ * @brief An opened device
+ *
+ * The eeprom image is always built and decoded by libftdi in ftdi,
+ * only the traffic with the device goes through the backend.
+ **/
+struct fdev {
+	struct ftdi_context *ftdi;          /**< eeprom state and error string */
+	const struct fdev_ops *ops;         /**< backend the device was opened with */
+	void *priv;                         /**< backend private data */
+	int vid, pid;
+	char path[32];                      /**< USB bus/port path */
+	char manufacturer[64];              /**< manufacturer string, empty if none */
+	char product[64];                   /**< product string, empty if none */
+	char serial[64];                    /**< serial string, empty if none */
+	int transfers;                      /**< eeprom control transfers issued since the open */
+	int resets;                         /**< resets issued since the open, see fdev_reset() */
+};
+
+/**
+ * @brief Operations provided by a device backend
+ *
+ * Every operation returns 0 on success and a negative value on
+ * failure, with an explanation left in ftdi->error_str.  A backend
+ * providing submit, wait, cancel and release has fdev_read_words() and
+ * fdev_write_words() run several transfers at once: submit starts a
+ * transfer, wait blocks until transfers complete, calling their done
+ * in the order the device served them, and returns once *completed
+ * is set or something completed.  A backend without them gets one
+ * word at a time.
+ * Every control transfer an operation issues for the eeprom, including
+ * those libftdi issues on its behalf, is counted in dev->transfers.
+ **/
+struct fdev_ops {
+	const char *name;
+	int (*scan)(struct ftdi_context *ftdi, int vid, int pid, struct fdev_info **list);
+	void (*scan_free)(struct fdev_info *list, int n);
+	int (*describe)(struct ftdi_context *ftdi, const struct fdev_info *info,
+		char *product, int product_len, char *serial, int serial_len);
+	int (*open)(struct fdev *dev, const struct fdev_info *info);
+	int (*close)(struct fdev *dev);
+	int (*read_eeprom)(struct fdev *dev, unsigned char *buf, int *size);
+	int (*read_word)(struct fdev *dev, int addr, unsigned short *val);
+	int (*write_begin)(struct fdev *dev);
+	int (*write_word)(struct fdev *dev, int addr, unsigned short val);
+	int (*erase)(struct fdev *dev, int *chip);
+	int (*reset)(struct fdev *dev);
+	int (*submit)(struct fdev *dev, struct fdev_xfer *x);
+	int (*wait)(struct fdev *dev, int *completed);
+	void (*cancel)(struct fdev *dev, struct fdev_xfer *x);
+	void (*release)(struct fdev *dev, struct fdev_xfer *x);
+};
+
+extern const struct fdev_ops fdev_libftdi_ops;
+
+void fdev_set_backend(const struct fdev_ops *ops);
+const struct fdev_ops *fdev_backend(void);
+void fdev_set_pipeline(int depth);
+int fdev_pipeline(void);
+char *fdev_usb_path(struct libusb_device *dev, char *buf, int len);
+
+int fdev_scan(struct ftdi_context *ftdi, int vid, int pid, struct fdev_info **list);
+void fdev_scan_free(struct fdev_info *list, int n);
+void fdev_match_add(struct fdev_match *m, int vid, int pid);
+int fdev_select(struct fdev *dev, struct ftdi_context *ftdi, const struct fdev_match *m);
+int fdev_open_info(struct fdev *dev, struct ftdi_context *ftdi, const struct fdev_info *info);
+int fdev_close(struct fdev *dev);
+
+int fdev_read_eeprom(struct fdev *dev, unsigned char *buf, int *size);
+int fdev_read_word(struct fdev *dev, int addr, unsigned short *val);
+int fdev_read_words(struct fdev *dev, const unsigned short *addrs, unsigned short *vals, int n);
+int fdev_write_begin(struct fdev *dev);
+int fdev_write_word(struct fdev *dev, int addr, unsigned short val);
+int fdev_write_words(struct fdev *dev, const unsigned short *addrs, const unsigned short *vals, int n);
+int fdev_erase(struct fdev *dev, int *chip);
+int fdev_reset(struct fdev *dev);
+int fdev_initdefaults(struct fdev *dev, char *manufacturer, char *product, char *serial);
+int fdev_erase_transfers(int type, int ret, int chip);
+int fdev_guess_size(int type, const unsigned char *buf);
+
+#endif /* FTDI_DEV_H */
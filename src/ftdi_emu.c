@@ -0,0 +1,653 @@
+/***************************************************************************
+                           ftdi_emu.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ In-memory FTDI emulator.  Each unit holds the words of a 93C46, 93C56,
+ 93C66, an internal eeprom or no eeprom at all.  Addresses wrap the way
+ microwire parts ignore address bits they do not have, so chip detection
+ sees what it would see on hardware.  Every word access can be slowed
+ down and made to fail at random, which makes the flashing code
+ measurable and testable on machines without USB devices.
+
+ Pipelined transfers go through the same engine as on hardware: each
+ one is queued on its unit, which serves them one at a time and in
+ order, and completes half a round trip after the unit is done with
+ it.  Waiting for completions sleeps until the next one is due.
+
+ The emulator is configured with a comma separated list of options:
+   chip=46|56|66|internal|none    eeprom of every unit (default 56)
+   count=<n>                      number of units (default 1)
+   vid=<vid>,pid=<pid>            ids the units enumerate with
+   read_us=<us>                   time the unit takes to read a word
+   write_us=<us>                  time the unit takes to write a word
+   erase_us=<us>                  latency of erasing a word
+   rtt_us=<us>                    USB round trip of every control transfer
+   fail_open=<p>,fail_read=<p>,fail_write=<p>
+                                  probability of an operation failing
+   unplug_after=<n>               disconnect each unit once, after n words written
+   reenum_ms=<ms>                 time a unit is gone from the bus after a reset
+   seed=<n>                       seed of the failure injection
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ftdi_emu.h"
+
+#define EMU_MAX_UNITS 64
+#define EMU_WORDS (FTDI_MAX_EEPROM_SIZE / 2)
+
+/**
+ * @brief A pipelined transfer queued on a unit
+ **/
+struct emu_pending {
+	struct fdev_xfer *x;
+	long long start_us;             /**< when the unit starts serving it */
+	long long due_us;               /**< when it completes on the host */
+	int cancelled;
+	struct emu_pending *next;
+};
+
+struct emu_unit {
+	pthread_mutex_t lock;
+	int chip;                       /**< 0x46, 0x56, 0x66, 0 internal, -1 none */
+	int words;                      /**< words the eeprom really has */
+	unsigned short mem[256];
+	int open;
+	int unplugged;
+	int unplug_done;
+	unsigned int seed;
+	struct timespec back;           /**< re-enumeration after a reset completes */
+	struct emu_pending *head, *tail;    /**< transfers in flight, in the order served */
+	long long free_us;              /**< when the unit is done with the last of them */
+	char path[16], serial[16];
+	struct emu_counters count;
+};
+
+static struct {
+	int chip, count, vid, pid;
+	long read_us, write_us, erase_us, rtt_us;
+	double fail_open, fail_read, fail_write;
+	long unplug_after;
+	long reenum_ms;
+	unsigned int seed;
+} emu = { 0x56, 1, 0x403, 0x6001, 0, 0, 0, 0, 0.0, 0.0, 0.0, 0, 0, 1 };
+
+static struct emu_unit *units;
+static int n_units;
+
+/**
+ * @brief Parse an emulator option list and create the units
+ *
+ * \param spec comma separated options, see the top of this file
+ *
+ * Function returns the number of units created, or -1 if spec
+ * is invalid.  Every unit starts blank.
+ **/
+int emu_setup(const char *spec)
+{
+	char *copy, *opt, *val, *save = NULL;
+	int i, j, ret = 0;
+
+	emu_cleanup();
+	if ((copy = strdup(spec ? spec : "")) == NULL)
+		return -1;
+	for (opt = strtok_r(copy, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+		if ((val = strchr(opt, '=')) == NULL) {
+			fprintf(stderr, "Emulator option '%s' needs a value\n", opt);
+			ret = -1;
+			break;
+		}
+		*val++ = '\0';
+		if (!strcmp(opt, "chip")) {
+			if (!strcmp(val, "internal"))
+				emu.chip = 0;
+			else if (!strcmp(val, "none"))
+				emu.chip = -1;
+			else
+				emu.chip = strtol(val + (strncasecmp(val, "93c", 3) ? 0 : 3), NULL, 16);
+			if (emu.chip != 0 && emu.chip != -1 && emu.chip != 0x46 &&
+				emu.chip != 0x56 && emu.chip != 0x66) {
+				fprintf(stderr, "Unsupported emulated eeprom '%s'\n", val);
+				ret = -1;
+				break;
+			}
+		} else if (!strcmp(opt, "count"))
+			emu.count = atoi(val);
+		else if (!strcmp(opt, "vid"))
+			emu.vid = strtol(val, NULL, 0);
+		else if (!strcmp(opt, "pid"))
+			emu.pid = strtol(val, NULL, 0);
+		else if (!strcmp(opt, "read_us"))
+			emu.read_us = atol(val);
+		else if (!strcmp(opt, "write_us"))
+			emu.write_us = atol(val);
+		else if (!strcmp(opt, "erase_us"))
+			emu.erase_us = atol(val);
+		else if (!strcmp(opt, "rtt_us"))
+			emu.rtt_us = atol(val);
+		else if (!strcmp(opt, "fail_open"))
+			emu.fail_open = atof(val);
+		else if (!strcmp(opt, "fail_read"))
+			emu.fail_read = atof(val);
+		else if (!strcmp(opt, "fail_write"))
+			emu.fail_write = atof(val);
+		else if (!strcmp(opt, "unplug_after"))
+			emu.unplug_after = atol(val);
+		else if (!strcmp(opt, "reenum_ms"))
+			emu.reenum_ms = atol(val);
+		else if (!strcmp(opt, "seed"))
+			emu.seed = strtoul(val, NULL, 0);
+		else {
+			fprintf(stderr, "Unknown emulator option '%s'\n", opt);
+			ret = -1;
+			break;
+		}
+	}
+	free(copy);
+	if (ret < 0)
+		return -1;
+	if (emu.count < 1 || emu.count > EMU_MAX_UNITS) {
+		fprintf(stderr, "Emulated unit count must be 1 to %d\n", EMU_MAX_UNITS);
+		return -1;
+	}
+
+	if ((units = calloc(emu.count, sizeof(*units))) == NULL)
+		return -1;
+	for (i = 0; i < emu.count; i++) {
+		pthread_mutex_init(&units[i].lock, NULL);
+		units[i].chip = emu.chip;
+		switch (emu.chip) {
+		case 0x46: units[i].words = 64; break;
+		case 0x66: units[i].words = 256; break;
+		case -1: units[i].words = 0; break;
+		default: units[i].words = 128; break;
+		}
+		for (j = 0; j < 256; j++)
+			units[i].mem[j] = 0xffff;
+		units[i].seed = emu.seed + i;
+		snprintf(units[i].path, sizeof(units[i].path), "emu-%d", i + 1);
+		snprintf(units[i].serial, sizeof(units[i].serial), "EMU%05d", i + 1);
+	}
+	n_units = emu.count;
+
+	return n_units;
+}
+
+/**
+ * @brief Return the number of emulated units
+ **/
+int emu_units(void)
+{
+	return n_units;
+}
+
+/**
+ * @brief Copy the operation counters of an emulated unit
+ *
+ * \param unit unit number, starting at 0
+ * \param c receives the counters
+ **/
+void emu_get_counters(int unit, struct emu_counters *c)
+{
+	memset(c, 0, sizeof(*c));
+	if (unit < 0 || unit >= n_units)
+		return;
+	pthread_mutex_lock(&units[unit].lock);
+	*c = units[unit].count;
+	pthread_mutex_unlock(&units[unit].lock);
+}
+
+void emu_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < n_units; i++)
+		pthread_mutex_destroy(&units[i].lock);
+	free(units);
+	units = NULL;
+	n_units = 0;
+}
+
+/**
+ * @brief Wait for the emulated duration of an operation
+ **/
+static void emu_delay(long us)
+{
+	struct timespec ts;
+
+	if (us <= 0)
+		return;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+/**
+ * @brief Monotonic time in microseconds
+ **/
+static long long emu_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Decide whether an operation fails, with the unit locked
+ **/
+static int emu_inject(struct emu_unit *u, double rate)
+{
+	if (rate <= 0.0 || (double)rand_r(&u->seed) / RAND_MAX >= rate)
+		return 0;
+	u->count.failures++;
+	return 1;
+}
+
+/**
+ * @brief Check whether a unit is on the bus, i.e. not re-enumerating
+ **/
+static int emu_present(struct emu_unit *u)
+{
+	struct timespec now;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pthread_mutex_lock(&u->lock);
+	ret = now.tv_sec > u->back.tv_sec ||
+		(now.tv_sec == u->back.tv_sec && now.tv_nsec >= u->back.tv_nsec);
+	pthread_mutex_unlock(&u->lock);
+
+	return ret;
+}
+
+static int emu_scan(struct ftdi_context *ftdi, int vid, int pid, struct fdev_info **list)
+{
+	int i, n = 0;
+
+	if (n_units == 0)
+		return 0;
+	if ((*list = calloc(n_units, sizeof(**list))) == NULL) {
+		ftdi->error_str = "out of memory";
+		return -1;
+	}
+	for (i = 0; i < n_units; i++) {
+		if ((vid > 0 && vid != emu.vid) || (pid > 0 && pid != emu.pid) || !emu_present(&units[i]))
+			continue;
+		(*list)[n].handle = &units[i];
+		(*list)[n].vid = emu.vid;
+		(*list)[n].pid = emu.pid;
+		strcpy((*list)[n].path, units[i].path);
+		n++;
+	}
+
+	return n;
+}
+
+static void emu_scan_free(struct fdev_info *list, int n)
+{
+	free(list);
+}
+
+/**
+ * @brief The strings blank FT232R and FT232BM chips report
+ **/
+static const char *emu_product(const struct emu_unit *u)
+{
+	return u->chip == 0 ? "FT232R USB UART" : "USB <-> Serial";
+}
+
+static int emu_describe(struct ftdi_context *ftdi, const struct fdev_info *info,
+	char *product, int product_len, char *serial, int serial_len)
+{
+	struct emu_unit *u = info->handle;
+
+	snprintf(product, product_len, "%s", emu_product(u));
+	snprintf(serial, serial_len, "%s", u->serial);
+
+	return 0;
+}
+
+static int emu_open(struct fdev *dev, const struct fdev_info *info)
+{
+	struct emu_unit *u = info->handle;
+	int ret = 0;
+
+	if (!emu_present(u)) {
+		dev->ftdi->error_str = "device not found";
+		return -3;
+	}
+	pthread_mutex_lock(&u->lock);
+	if (u->open) {
+		dev->ftdi->error_str = "unable to claim usb device";
+		ret = -5;
+	} else if (emu_inject(u, emu.fail_open)) {
+		dev->ftdi->error_str = "usb_open() failed (emulated)";
+		ret = -4;
+	} else {
+		u->open = 1;
+		u->unplugged = 0;
+		u->count.opens++;
+		dev->priv = u;
+		dev->ftdi->type = u->chip == 0 ? TYPE_R : TYPE_BM;
+		strcpy(dev->manufacturer, "FTDI");
+		strcpy(dev->product, emu_product(u));
+		strcpy(dev->serial, u->serial);
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	return ret;
+}
+
+static int emu_close(struct fdev *dev)
+{
+	struct emu_unit *u = dev->priv;
+
+	pthread_mutex_lock(&u->lock);
+	u->open = 0;
+	pthread_mutex_unlock(&u->lock);
+
+	return 0;
+}
+
+/**
+ * @brief Map a word address onto the words the eeprom really has
+ **/
+static int emu_addr(const struct emu_unit *u, int addr)
+{
+	return u->chip == 0 ? addr & 0x7f : addr & (u->words - 1);
+}
+
+/**
+ * @brief Read a word, with the unit locked
+ **/
+static int emu_read_locked(struct fdev *dev, struct emu_unit *u, int addr, unsigned short *val)
+{
+	if (u->unplugged) {
+		dev->ftdi->error_str = "device disconnected (emulated)";
+		return -1;
+	}
+	if (emu_inject(u, emu.fail_read)) {
+		dev->ftdi->error_str = "reading eeprom failed (emulated)";
+		return -1;
+	}
+	*val = u->words ? u->mem[emu_addr(u, addr)] : 0xffff;
+	u->count.reads++;
+
+	return 0;
+}
+
+static int emu_read_word(struct fdev *dev, int addr, unsigned short *val)
+{
+	struct emu_unit *u = dev->priv;
+	int ret;
+
+	pthread_mutex_lock(&u->lock);
+	emu_delay(emu.rtt_us + emu.read_us);
+	dev->transfers++;
+	ret = emu_read_locked(dev, u, addr, val);
+	pthread_mutex_unlock(&u->lock);
+
+	return ret;
+}
+
+static int emu_read_eeprom(struct fdev *dev, unsigned char *buf, int *size)
+{
+	unsigned short addrs[EMU_WORDS], vals[EMU_WORDS];
+	int i;
+
+	*size = -1;
+	for (i = 0; i < EMU_WORDS; i++)
+		addrs[i] = i;
+	if (fdev_read_words(dev, addrs, vals, EMU_WORDS) < 0)
+		return -1;
+	for (i = 0; i < EMU_WORDS; i++) {
+		buf[i*2] = vals[i] & 0xff;
+		buf[i*2+1] = vals[i] >> 8;
+	}
+	*size = fdev_guess_size(dev->ftdi->type, buf);
+
+	return ftdi_set_eeprom_buf(dev->ftdi, buf, FTDI_MAX_EEPROM_SIZE);
+}
+
+static int emu_write_begin(struct fdev *dev)
+{
+	struct emu_unit *u = dev->priv;
+	int ret = 0;
+
+	pthread_mutex_lock(&u->lock);
+	if (u->unplugged) {
+		dev->ftdi->error_str = "device disconnected (emulated)";
+		ret = -1;
+	}
+	pthread_mutex_unlock(&u->lock);
+	/* The reset, modem status and latency timer requests of libftdi_write_begin() */
+	dev->transfers += ret ? 1 : 3;
+
+	return ret;
+}
+
+/**
+ * @brief Write a word, with the unit locked
+ **/
+static int emu_write_locked(struct fdev *dev, struct emu_unit *u, int addr, unsigned short val)
+{
+	if (!u->unplug_done && emu.unplug_after > 0 && u->count.writes >= emu.unplug_after) {
+		/* Only once, so the next attempt on the unit goes through */
+		u->unplugged = 1;
+		u->unplug_done = 1;
+	}
+	if (u->unplugged) {
+		dev->ftdi->error_str = "device disconnected (emulated)";
+		return -1;
+	}
+	if (emu_inject(u, emu.fail_write)) {
+		dev->ftdi->error_str = "unable to write eeprom (emulated)";
+		return -1;
+	}
+	if (u->words)
+		u->mem[emu_addr(u, addr)] = val;
+	u->count.writes++;
+
+	return 0;
+}
+
+static int emu_write_word(struct fdev *dev, int addr, unsigned short val)
+{
+	struct emu_unit *u = dev->priv;
+	int ret;
+
+	pthread_mutex_lock(&u->lock);
+	emu_delay(emu.rtt_us + emu.write_us);
+	dev->transfers++;
+	ret = emu_write_locked(dev, u, addr, val);
+	pthread_mutex_unlock(&u->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Queue a pipelined transfer on the unit
+ *
+ * The request reaches the unit half a round trip after it is sent,
+ * waits there for the transfers ahead of it and completes another
+ * half round trip after the unit has served it.
+ **/
+static int emu_submit(struct fdev *dev, struct fdev_xfer *x)
+{
+	struct emu_unit *u = dev->priv;
+	struct emu_pending *e = x->backend;
+	long long arrive = emu_now_us() + emu.rtt_us / 2;
+	int ret = 0;
+
+	if (e == NULL) {
+		if ((e = calloc(1, sizeof(*e))) == NULL)
+			return -1;
+		x->backend = e;
+	}
+	pthread_mutex_lock(&u->lock);
+	if (u->unplugged) {
+		dev->ftdi->error_str = "device disconnected (emulated)";
+		ret = -1;
+	} else {
+		e->x = x;
+		e->cancelled = 0;
+		e->next = NULL;
+		e->start_us = arrive > u->free_us ? arrive : u->free_us;
+		u->free_us = e->start_us + (x->out ? emu.write_us : emu.read_us);
+		e->due_us = u->free_us + emu.rtt_us - emu.rtt_us / 2;
+		if (u->tail)
+			u->tail->next = e;
+		else
+			u->head = e;
+		u->tail = e;
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Complete the pipelined transfers that are due
+ *
+ * Sleeps until the first transfer in flight is due, then completes it
+ * and every other one due by then.  The word is read or written as the
+ * transfer completes, which keeps the order the unit served them in.
+ * A transfer cancelled before the unit got to it is not carried out
+ * and completes with an error.
+ **/
+static int emu_wait(struct fdev *dev, int *completed)
+{
+	struct emu_unit *u = dev->priv;
+	struct emu_pending *e;
+	struct fdev_xfer *x;
+	long long now = emu_now_us();
+
+	pthread_mutex_lock(&u->lock);
+	if ((e = u->head) == NULL) {
+		pthread_mutex_unlock(&u->lock);
+		return -1;
+	}
+	if (e->due_us > now) {
+		/* Only this thread completes the unit's transfers */
+		pthread_mutex_unlock(&u->lock);
+		emu_delay(e->due_us - now);
+		now = e->due_us;
+		pthread_mutex_lock(&u->lock);
+	}
+	while (!*completed && (e = u->head) != NULL && e->due_us <= now) {
+		if ((u->head = e->next) == NULL)
+			u->tail = NULL;
+		x = e->x;
+		if (e->cancelled) {
+			dev->ftdi->error_str = "transfer cancelled";
+			x->status = -1;
+		} else if (x->out) {
+			x->status = emu_write_locked(dev, u, x->addr, x->val);
+		} else {
+			x->status = emu_read_locked(dev, u, x->addr, &x->val);
+		}
+		/* done may submit the next word, which takes the lock */
+		pthread_mutex_unlock(&u->lock);
+		x->done(x);
+		pthread_mutex_lock(&u->lock);
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	return 0;
+}
+
+static void emu_cancel(struct fdev *dev, struct fdev_xfer *x)
+{
+	struct emu_unit *u = dev->priv;
+	struct emu_pending *e = x->backend;
+
+	pthread_mutex_lock(&u->lock);
+	e->cancelled = emu_now_us() < e->start_us;
+	pthread_mutex_unlock(&u->lock);
+}
+
+static void emu_release(struct fdev *dev, struct fdev_xfer *x)
+{
+	free(x->backend);
+	x->backend = NULL;
+}
+
+static int emu_erase(struct fdev *dev, int *chip)
+{
+	struct emu_unit *u = dev->priv;
+	int i, ret = 0;
+
+	pthread_mutex_lock(&u->lock);
+	*chip = u->chip;
+	if (u->unplugged) {
+		dev->ftdi->error_str = "device disconnected (emulated)";
+		ret = -1;
+	} else if (u->chip > 0) {
+		/* Internal eeproms can't be erased, ftdi_erase_eeprom() skips them */
+		emu_delay(emu.erase_us * u->words);
+		for (i = 0; i < u->words; i++)
+			u->mem[i] = 0xffff;
+		u->count.erases++;
+	}
+	pthread_mutex_unlock(&u->lock);
+	dev->transfers += fdev_erase_transfers(dev->ftdi->type, ret, *chip);
+
+	return ret;
+}
+
+static int emu_reset(struct fdev *dev)
+{
+	struct emu_unit *u = dev->priv;
+
+	pthread_mutex_lock(&u->lock);
+	u->count.resets++;
+	if (emu.reenum_ms > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &u->back);
+		u->back.tv_sec += emu.reenum_ms / 1000;
+		u->back.tv_nsec += (emu.reenum_ms % 1000) * 1000000L;
+		if (u->back.tv_nsec >= 1000000000L) {
+			u->back.tv_sec++;
+			u->back.tv_nsec -= 1000000000L;
+		}
+	}
+	pthread_mutex_unlock(&u->lock);
+
+	return 0;
+}
+
+const struct fdev_ops fdev_emu_ops = {
+	"emulator",
+	emu_scan,
+	emu_scan_free,
+	emu_describe,
+	emu_open,
+	emu_close,
+	emu_read_eeprom,
+	emu_read_word,
+	emu_write_begin,
+	emu_write_word,
+	emu_erase,
+	emu_reset,
+	emu_submit,
+	emu_wait,
+	emu_cancel,
+	emu_release
+};
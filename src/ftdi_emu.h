@@ -0,0 +1,40 @@
+/***************************************************************************
+                           ftdi_emu.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef FTDI_EMU_H
+#define FTDI_EMU_H
+
+#include "ftdi_dev.h"
+
+/**
+ * @brief Operations counted by an emulated device
+ **/
+struct emu_counters {
+	long opens;
+	long reads;         /**< words read */
+	long writes;        /**< words written */
+	long erases;
+	long resets;
+	long failures;      /**< injected failures */
+};
+
+extern const struct fdev_ops fdev_emu_ops;
+
+int emu_setup(const char *spec);
+int emu_units(void);
+void emu_get_counters(int unit, struct emu_counters *c);
+void emu_cleanup(void);
+
+#endif /* FTDI_EMU_H */
@@ -0,0 +1,203 @@
+/***************************************************************************
+                           ftdi_xml.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Reader for the FT_EEPROM xml documents written by FTDI's FT_Prog.
+ The document is streamed with an xmlTextReader, so memory use does
+ not depend on the size of the input.  Only leaf elements carry
+ settings; each one is handed to the caller as soon as its end tag is
+ seen, with the names of its ancestors kept on a small stack so the
+ caller can tell which Port_X it belongs to.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libxml2/libxml/xmlreader.h>
+
+#include "ftdi_xml.h"
+
+#define MAX_DEPTH 16
+#define MAX_NAME 64
+#define MAX_TEXT 256
+
+/**
+ * @brief State of a document being read
+ **/
+struct xml_state {
+	ftdi_xml_leaf_fn leaf;
+	void *ctx;
+	char names[MAX_DEPTH][MAX_NAME];    /**< open elements, outermost first */
+	int has_child[MAX_DEPTH];           /**< element contains other elements */
+	int depth;
+	char text[MAX_TEXT];                /**< content of the innermost element */
+	int text_len;
+};
+
+/**
+ * @brief Find the port an element belongs to
+ *
+ * \param st reader state
+ *
+ * Function returns 'A' to 'D' if one of the open elements is
+ * Port_A to Port_D, zero otherwise.
+ **/
+static int current_port(const struct xml_state *st)
+{
+	int i;
+
+	for (i = 0; i < st->depth && i < MAX_DEPTH; i++) {
+		if (!strncmp(st->names[i], "Port_", 5) && st->names[i][5] >= 'A' &&
+			st->names[i][5] <= 'D' && st->names[i][6] == '\0')
+			return st->names[i][5];
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Stream a document through the leaf callback
+ *
+ * \param st reader state
+ * \param reader reader positioned before the first node
+ *
+ * Function returns 0 once the document is fully read, -1 on a parse
+ * error.  When nothing could be read at all, -2 is returned instead.
+ **/
+static int read_elements(struct xml_state *st, xmlTextReaderPtr reader)
+{
+	const char *name, *value;
+	int ret, len, nodes = 0;
+
+	while ((ret = xmlTextReaderRead(reader)) == 1) {
+		nodes++;
+		switch (xmlTextReaderNodeType(reader)) {
+		case XML_READER_TYPE_ELEMENT:
+			name = (const char *)xmlTextReaderConstName(reader);
+			if (st->depth > 0 && st->depth <= MAX_DEPTH)
+				st->has_child[st->depth - 1] = 1;
+			if (st->depth < MAX_DEPTH) {
+				snprintf(st->names[st->depth], MAX_NAME, "%s", name);
+				st->has_child[st->depth] = 0;
+			}
+			st->depth++;
+			st->text_len = 0;
+			st->text[0] = '\0';
+			if (!xmlTextReaderIsEmptyElement(reader))
+				break;
+			/* <Element /> has no end tag, handle it as one right away */
+		case XML_READER_TYPE_END_ELEMENT:
+			if (st->depth <= MAX_DEPTH && !st->has_child[st->depth - 1])
+				st->leaf(st->ctx, current_port(st), st->names[st->depth - 1], st->text);
+			st->depth--;
+			break;
+		case XML_READER_TYPE_TEXT:
+		case XML_READER_TYPE_CDATA:
+		case XML_READER_TYPE_SIGNIFICANT_WHITESPACE:
+			value = (const char *)xmlTextReaderConstValue(reader);
+			len = strlen(value);
+			if (len > MAX_TEXT - 1 - st->text_len)
+				len = MAX_TEXT - 1 - st->text_len;
+			memcpy(st->text + st->text_len, value, len);
+			st->text_len += len;
+			st->text[st->text_len] = '\0';
+			break;
+		}
+	}
+
+	if (ret < 0)
+		return nodes ? -1 : -2;
+	return 0;
+}
+
+/**
+ * @brief Check whether a file is an FTDI xml document
+ *
+ * \param filename file to check
+ *
+ * Function looks for the FT_EEPROM root element at the start of the
+ * file and returns 1 if it is there, 0 otherwise.
+ **/
+int ftdi_xml_detect(const char *filename)
+{
+	char buf[512];
+	FILE *fp;
+	int n;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+		return 0;
+	n = fread(buf, 1, sizeof(buf) - 1, fp);
+	fclose(fp);
+	buf[n] = '\0';
+
+	return strstr(buf, "<FT_EEPROM") != NULL;
+}
+
+/**
+ * @brief Read an FTDI xml document
+ *
+ * \param filename document to read
+ * \param quiet non-zero to keep libxml2 from printing parse errors
+ * \param leaf callback receiving every leaf element
+ * \param ctx passed to leaf
+ * \param err buffer receiving the reason of a failure
+ * \param errlen size of err
+ *
+ * FT_Prog labels its exports utf-16 while writing them in UTF-8, so a
+ * document that fails right away is read again as UTF-8.  All state
+ * lives in the call, so documents can be read on several threads at
+ * once.  Returns 0 on success, -1 on error.
+ **/
+int ftdi_xml_read(const char *filename, int quiet, ftdi_xml_leaf_fn leaf, void *ctx, char *err, int errlen)
+{
+	struct xml_state st;
+	xmlTextReaderPtr reader;
+	xmlErrorPtr xml_err;
+	int ret;
+
+	memset(&st, 0, sizeof(st));
+	st.leaf = leaf;
+	st.ctx = ctx;
+
+	/* The last error is per thread, but it outlives the document it came from */
+	xmlResetLastError();
+	reader = xmlReaderForFile(filename, NULL, XML_PARSE_NONET | XML_PARSE_NOERROR | XML_PARSE_NOWARNING);
+	ret = reader ? read_elements(&st, reader) : -2;
+	if (reader)
+		xmlFreeTextReader(reader);
+	if (ret == -2) {
+		memset(&st, 0, sizeof(st));
+		st.leaf = leaf;
+		st.ctx = ctx;
+		xmlResetLastError();
+		reader = xmlReaderForFile(filename, "UTF-8", XML_PARSE_NONET |
+			(quiet ? XML_PARSE_NOERROR | XML_PARSE_NOWARNING : 0));
+		ret = reader ? read_elements(&st, reader) : -1;
+		if (reader)
+			xmlFreeTextReader(reader);
+	}
+	if (ret < 0 && reader == NULL) {
+		snprintf(err, errlen, "can't read file");
+		return -1;
+	}
+	if (ret < 0) {
+		xml_err = xmlGetLastError();
+		snprintf(err, errlen, "failed to parse: %s", xml_err && xml_err->message ?
+			xml_err->message : "unknown error");
+		err[strcspn(err, "\n")] = '\0';
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,32 @@
+/***************************************************************************
+                           ftdi_xml.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef FTDI_XML_H
+#define FTDI_XML_H
+
+/**
+ * @brief Called for every leaf element of an FTDI xml document
+ *
+ * \param ctx caller data
+ * \param port 'A' to 'D' inside Port_A to Port_D, zero elsewhere
+ * \param name element name
+ * \param content element text, empty for <Element />
+ **/
+typedef void (*ftdi_xml_leaf_fn)(void *ctx, int port, const char *name, const char *content);
+
+int ftdi_xml_detect(const char *filename);
+int ftdi_xml_read(const char *filename, int quiet, ftdi_xml_leaf_fn leaf, void *ctx, char *err, int errlen);
+
+#endif /* FTDI_XML_H */
@@ -0,0 +1,193 @@
+/***************************************************************************
+                         ftdi_xml_cfg.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Loads an FT_Prog FT_EEPROM document straight into a configuration
+ made from the opts[] table, so -f accepts the xml without going
+ through ftdi-xform-config.  Settings the document does not describe
+ keep their defaults; the eeprom type is left to detection.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libxml2/libxml/parser.h>
+
+#include "ftdi_xml.h"
+#include "ftdi_xml_cfg.h"
+
+/**
+ * @brief State of a document being loaded
+ **/
+struct xml_cfg_state {
+	cfg_t *cfg;
+	int self_powered;
+	int auto_serial;                    /**< SerialNumber_AutoGenerate */
+	char serial[64];
+	char prefix[16];                    /**< SerialNumberPrefix */
+};
+
+/**
+ * @brief Default product ids of the FTDI chips, by FT_Prog chip name
+ *
+ * Chips are matched on a prefix of the Chip_Details Type, so
+ * "FT2232D/C" and "FT2232H" both find FT2232.
+ **/
+static const struct {
+	const char *type;
+	int pid;
+} chip_pids[] = {
+	{ "FT232H", 0x6014 },
+	{ "FT2232", 0x6010 },
+	{ "FT4232", 0x6011 },
+	{ "FT232R", 0x6001 },
+	{ "FT245R", 0x6001 },
+	{ "FT232B", 0x6001 },
+	{ "FT245B", 0x6001 },
+	{ "FT232A", 0x6001 },
+	{ "FT245A", 0x6001 },
+	{ NULL, 0 }
+};
+
+/**
+ * @brief Set the target ids from the chip type
+ *
+ * \param cfg configuration to update
+ * \param type Chip_Details Type
+ *
+ * A blank chip enumerates with FTDI's default ids, which is how the
+ * target_* settings find it.  The FT-X series (FT230X, FT234XD, ...)
+ * all share one product id.
+ **/
+static void set_chip_type(cfg_t *cfg, const char *type)
+{
+	int i;
+
+	for (i = 0; chip_pids[i].type; i++) {
+		if (!strncmp(type, chip_pids[i].type, strlen(chip_pids[i].type)))
+			break;
+	}
+	if (chip_pids[i].type == NULL && !strncmp(type, "FT", 2) && strchr(type + 2, 'X'))
+		cfg_setint(cfg, "target_product_id", 0x6015);
+	else if (chip_pids[i].type)
+		cfg_setint(cfg, "target_product_id", chip_pids[i].pid);
+	else
+		return;
+	cfg_setint(cfg, "target_vendor_id", 0x403);
+}
+
+/**
+ * @brief Map one leaf element onto the configuration
+ *
+ * \param ctx load state
+ * \param port 'A' to 'D' inside Port_A to Port_D, zero elsewhere
+ * \param name element name
+ * \param content element text
+ **/
+static void load_node(void *ctx, int port, const char *name, const char *content)
+{
+	struct xml_cfg_state *st = ctx;
+	cfg_t *cfg = st->cfg;
+	int on = !strcmp(content, "true");
+	char opt[24];
+
+	if (port != 0) {
+		/* FT2232D exports use the long names, FT4232H/FT2232H ones the short */
+		if ((!strcmp(name, "Virtual_Com_Port") || !strcmp(name, "VCP")) && on) {
+			snprintf(opt, sizeof(opt), "channel_%c_driver", port - 'A' + 'a');
+			cfg_setstr(cfg, opt, "VCP");
+		} else if ((!strcmp(name, "D2XX_Direct") || !strcmp(name, "D2XX")) && on) {
+			snprintf(opt, sizeof(opt), "channel_%c_driver", port - 'A' + 'a');
+			cfg_setstr(cfg, opt, "D2XX");
+		} else if (!strcmp(name, "RI_RS485")) {
+			snprintf(opt, sizeof(opt), "channel_%c_rs485", port - 'A' + 'a');
+			cfg_setbool(cfg, opt, on ? cfg_true : cfg_false);
+		}
+	} else if (!strcmp(name, "Type")) {
+		set_chip_type(cfg, content);
+	} else if (!strcmp(name, "idVendor")) {
+		cfg_setint(cfg, "vendor_id", strtol(content, NULL, 16));
+	} else if (!strcmp(name, "idProduct")) {
+		cfg_setint(cfg, "product_id", strtol(content, NULL, 16));
+	} else if (!strcmp(name, "RemoteWakeupEnabled")) {
+		cfg_setbool(cfg, "remote_wakeup", on ? cfg_true : cfg_false);
+	} else if (!strcmp(name, "SelfPowered")) {
+		st->self_powered = on;
+		cfg_setbool(cfg, "self_powered", on ? cfg_true : cfg_false);
+	} else if (!strcmp(name, "MaxPower")) {
+		cfg_setint(cfg, "max_power", strtol(content, NULL, 10));
+	} else if (!strcmp(name, "IOpullDown")) {
+		cfg_setbool(cfg, "suspend_pull_downs", on ? cfg_true : cfg_false);
+	} else if (!strcmp(name, "Manufacturer")) {
+		cfg_setstr(cfg, "manufacturer", content);
+	} else if (!strcmp(name, "Product_Description")) {
+		cfg_setstr(cfg, "product", content);
+	} else if (!strcmp(name, "SerialNumber_Enabled")) {
+		cfg_setbool(cfg, "use_serial", on ? cfg_true : cfg_false);
+	} else if (!strcmp(name, "SerialNumber")) {
+		snprintf(st->serial, sizeof(st->serial), "%s", content);
+	} else if (!strcmp(name, "SerialNumberPrefix")) {
+		snprintf(st->prefix, sizeof(st->prefix), "%s", content);
+	} else if (!strcmp(name, "SerialNumber_AutoGenerate")) {
+		st->auto_serial = on;
+	}
+}
+
+/**
+ * @brief Load an FTDI xml document into a configuration
+ *
+ * \param cfg configuration initialized from the opts[] table
+ * \param filename FT_EEPROM document written by FT_Prog
+ * \param err buffer receiving the reason of a failure
+ * \param errlen size of err
+ *
+ * A fixed SerialNumber is used as is, with any '%' escaped so it is
+ * not taken for a serial template.  An auto generated one becomes a
+ * template of SerialNumberPrefix and six hex digits, FT_Prog's eight
+ * character form, allocated from serial_counter like any template.
+ * The xml parser is initialized here, so call this before starting
+ * any thread that uses libxml2.  Returns 0 on success, -1 on error.
+ **/
+int ftdi_xml_load_cfg(cfg_t *cfg, const char *filename, char *err, int errlen)
+{
+	struct xml_cfg_state st;
+	char serial[132];
+	const char *p;
+	int n = 0;
+
+	memset(&st, 0, sizeof(st));
+	st.cfg = cfg;
+	xmlInitParser();
+	if (ftdi_xml_read(filename, 1, load_node, &st, err, errlen) != 0)
+		return -1;
+
+	if (st.self_powered)
+		cfg_setint(cfg, "max_power", 0);
+
+	if (st.serial[0] != '\0') {
+		for (p = st.serial; *p; p++) {
+			if (*p == '%')
+				serial[n++] = '%';
+			serial[n++] = *p;
+		}
+		serial[n] = '\0';
+		cfg_setstr(cfg, "serial", serial);
+	} else if (st.auto_serial) {
+		snprintf(serial, sizeof(serial), "%s%%06X", st.prefix);
+		cfg_setstr(cfg, "serial", serial);
+	}
+
+	return 0;
+}
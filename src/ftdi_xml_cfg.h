@@ -0,0 +1,23 @@
+/***************************************************************************
+                         ftdi_xml_cfg.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef FTDI_XML_CFG_H
+#define FTDI_XML_CFG_H
+
+#include <confuse.h>
+
+int ftdi_xml_load_cfg(cfg_t *cfg, const char *filename, char *err, int errlen);
+
+#endif /* FTDI_XML_CFG_H */
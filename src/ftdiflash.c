@@ -0,0 +1,1691 @@
+/***************************************************************************
+                          ftdiflash.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include <confuse.h>
+#include <libusb-1.0/libusb.h>
+#include <libftdi1/ftdi.h>
+
+#include "ftdiflash.h"
+#include "chip_cache.h"
+#include "serial_alloc.h"
+#include "hotplug.h"
+#include "ftdi_xml.h"
+#include "ftdi_xml_cfg.h"
+#include "eeprom_image.h"
+#include "dev_lock.h"
+
+/*
+ settings of a product, taken by the file level and by every profile
+ */
+#define FLASH_SETTINGS \
+    CFG_INT("target_vendor_id", 0x403, 0), \
+    CFG_INT("target_product_id", 0x6001, 0), \
+    CFG_INT("vendor_id", 0, 0), \
+    CFG_INT("product_id", 0, 0), \
+    CFG_BOOL("self_powered", cfg_true, 0), \
+    CFG_BOOL("remote_wakeup", cfg_true, 0), \
+    CFG_BOOL("in_is_isochronous", cfg_false, 0), \
+    CFG_BOOL("out_is_isochronous", cfg_false, 0), \
+    CFG_BOOL("suspend_pull_downs", cfg_false, 0), \
+    CFG_BOOL("use_serial", cfg_false, 0), \
+    CFG_BOOL("change_usb_version", cfg_false, 0), \
+    CFG_INT("usb_version", 0, 0), \
+    CFG_INT("default_pid", 0x6001, 0), \
+    CFG_INT("max_power", 0, 0), \
+    CFG_STR("manufacturer", "Acme Inc.", 0), \
+    CFG_STR("product", "USB Serial Converter", 0), \
+    CFG_STR("serial", "08-15", 0), \
+    CFG_STR("serial_counter", "serial.counter", 0), \
+    CFG_INT("serial_start", 1, 0), \
+    CFG_BOOL("serial_sync", cfg_true, 0), \
+    CFG_INT("eeprom_type", 0x00, 0), \
+    CFG_STR("filename", "", 0), \
+    CFG_STR("chip_cache", 0, 0), \
+    CFG_BOOL("flash_raw", cfg_false, 0), \
+    CFG_BOOL("high_current", cfg_false, 0), \
+    CFG_STR_LIST("cbus0", "{TXDEN,PWREN,RXLED,TXLED,TXRXLED,SLEEP,CLK48,CLK24,CLK12,CLK6,IO_MODE,BITBANG_WR,BITBANG_RD,SPECIAL}", 0), \
+    CFG_STR_LIST("cbus1", "{TXDEN,PWREN,RXLED,TXLED,TXRXLED,SLEEP,CLK48,CLK24,CLK12,CLK6,IO_MODE,BITBANG_WR,BITBANG_RD,SPECIAL}", 0), \
+    CFG_STR_LIST("cbus2", "{TXDEN,PWREN,RXLED,TXLED,TXRXLED,SLEEP,CLK48,CLK24,CLK12,CLK6,IO_MODE,BITBANG_WR,BITBANG_RD,SPECIAL}", 0), \
+    CFG_STR_LIST("cbus3", "{TXDEN,PWREN,RXLED,TXLED,TXRXLED,SLEEP,CLK48,CLK24,CLK12,CLK6,IO_MODE,BITBANG_WR,BITBANG_RD,SPECIAL}", 0), \
+    CFG_STR_LIST("cbus4", "{TXDEN,PWRON,RXLED,TXLED,TX_RX_LED,SLEEP,CLK48,CLK24,CLK12,CLK6}", 0), \
+    CFG_BOOL("invert_txd", cfg_false, 0), \
+    CFG_BOOL("invert_rxd", cfg_false, 0), \
+    CFG_BOOL("invert_rts", cfg_false, 0), \
+    CFG_BOOL("invert_cts", cfg_false, 0), \
+    CFG_BOOL("invert_dtr", cfg_false, 0), \
+    CFG_BOOL("invert_dsr", cfg_false, 0), \
+    CFG_BOOL("invert_dcd", cfg_false, 0), \
+    CFG_BOOL("invert_ri", cfg_false, 0), \
+    CFG_STR("channel_a_driver", "VCP", 0), \
+    CFG_STR("channel_b_driver", "VCP", 0), \
+    CFG_STR("channel_c_driver", "VCP", 0), \
+    CFG_STR("channel_d_driver", "VCP", 0), \
+    CFG_BOOL("channel_a_rs485", cfg_false, 0), \
+    CFG_BOOL("channel_b_rs485", cfg_false, 0), \
+    CFG_BOOL("channel_c_rs485", cfg_false, 0), \
+    CFG_BOOL("channel_d_rs485", cfg_false, 0)
+
+static cfg_opt_t profile_opts[] =
+{
+    FLASH_SETTINGS,
+    CFG_END()
+};
+
+/*
+ configuration options
+ */
+static cfg_opt_t flash_opts[] =
+{
+    FLASH_SETTINGS,
+    CFG_SEC("profile", profile_opts, CFGF_MULTI | CFGF_TITLE),
+    CFG_END()
+};
+
+/**
+ * @brief An open device and everything kept between operations on it
+ **/
+struct flash_session {
+	struct ftdi_context *ftdi;  /**< holds the libusb context for the session's lifetime */
+	struct fdev dev;            /**< open device, dev.ops is NULL if none */
+	cfg_t *cfg;                 /**< configuration, NULL until one is loaded */
+	struct profile_index profiles;  /**< products of cfg */
+	struct run_stats *st;       /**< statistics to update, or NULL */
+	unsigned char image[FTDI_MAX_EEPROM_SIZE];  /**< image last written, for flash_session_verify() */
+	int image_size;             /**< 0 if nothing was written yet */
+	char error[256];            /**< what made the last operation fail */
+};
+
+static flash_log_fn log_fn = NULL;
+static void *log_arg = NULL;
+
+/* Last error logged by this thread, so a session can report it */
+static __thread char last_error[256];
+
+/**
+ * @brief Send log messages somewhere else
+ *
+ * \param fn function receiving every message, NULL to print them
+ * \param arg passed to fn
+ *
+ * fn may be called from several threads at once during parallel runs.
+ **/
+void flash_set_log(flash_log_fn fn, void *arg)
+{
+	log_fn = fn;
+	log_arg = arg;
+}
+
+/**
+ * @brief Log a message
+ *
+ * \param level enum flash_log_level of the message
+ * \param fmt printf format of the message, ending in a newline
+ **/
+void flash_log(int level, const char *fmt, ...)
+{
+	char msg[2048];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	if (level == FLASH_LOG_ERROR) {
+		if ((len = strlen(msg)) >= (int)sizeof(last_error))
+			len = sizeof(last_error) - 1;
+		memcpy(last_error, msg, len);
+		last_error[len] = '\0';
+		while (len > 0 && last_error[len-1] == '\n')
+			last_error[--len] = '\0';
+	}
+	if (log_fn)
+		log_fn(log_arg, level, msg);
+	else
+		fputs(msg, level == FLASH_LOG_ERROR ? stderr : stdout);
+}
+
+/**
+ * @brief Convert driver options strings to a value
+ *
+ * \param str pointer to driver option string to convert
+ *
+ * Function will return the value of the option string.
+ * This is used to determine the correct values to set for
+ * drivers.
+ *
+ **/
+static int str_to_drvr(char *str) {
+	const int max_options = 4;
+	int cmp_len=0,i;
+	const char* options[] = { "D2XX", "VCP", "RS485" };
+
+	for(i = 0; i < max_options; i++) {
+		cmp_len = (strlen(str) >= strlen(options[i])) ? strlen(options[i]) : strlen(str);
+		if(!strncmp(str,options[i],cmp_len)) break;
+	}
+
+	return i;
+}
+
+/**
+ * @brief Convert CBUS options strings to an index
+ *
+ * \param str pointer to CBUS option string to index
+ * \param max_allowed last CBUS option to allow in returned index
+ *
+ * Function will return 0 if no options are found.  A message
+ * will be sent to the terminal.
+ **/
+static int str_to_cbus(char *str, int max_allowed)
+{
+    #define MAX_OPTION 14
+    const char* options[MAX_OPTION] = {
+     "TXDEN", "PWREN", "RXLED", "TXLED", "TXRXLED", "SLEEP",
+     "CLK48", "CLK24", "CLK12", "CLK6",
+     "IO_MODE", "BITBANG_WR", "BITBANG_RD", "SPECIAL"};
+    int i;
+    max_allowed += 1;
+    if (max_allowed > MAX_OPTION) max_allowed = MAX_OPTION;
+    for (i=0; i<max_allowed; i++) {
+        if (!(strcmp(options[i], str))) {
+            return i;
+        }
+    }
+    flash_log(FLASH_LOG_INFO, "WARNING: Invalid cbus option '%s'\n", str);
+    return 0;
+}
+
+/**
+ * @brief Set eeprom value
+ *
+ * \param ftdi pointer to ftdi_context
+ * \param value_name Enum of the value to set
+ * \param value Value to set
+ *
+ * Function returns 0 on success, -1 on error
+ **/
+static int eeprom_set_value(struct ftdi_context *ftdi, enum ftdi_eeprom_value value_name, int value)
+{
+    if (ftdi_set_eeprom_value(ftdi, value_name, value) < 0)
+    {
+        flash_log(FLASH_LOG_ERROR, "Unable to set eeprom value %d: %s\n", value_name, ftdi_get_error_string(ftdi));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Get eeprom value
+ *
+ * \param ftdi pointer to ftdi_context
+ * \param value_name Enum of the value to get
+ * \param value Value to get
+ *
+ * Function returns 0 on success, -1 on error
+ **/
+static int eeprom_get_value(struct ftdi_context *ftdi, enum ftdi_eeprom_value value_name, int *value)
+{
+    if (ftdi_get_eeprom_value(ftdi, value_name, value) < 0)
+    {
+        flash_log(FLASH_LOG_ERROR, "Unable to get eeprom value %d: %s\n", value_name, ftdi_get_error_string(ftdi));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Build the chip cache key of an opened device
+ *
+ * \param dev opened device
+ * \param buf buffer receiving the key
+ * \param len size of buf
+ *
+ * The key is "<vid>:<pid>:<bus path>", the fixture slot rather than
+ * the unit, so a fixture of identical boards hits the cache for every
+ * unit it takes and the cache stays one line per slot.  Units of a
+ * serial template would each add a line if their serial were part of it.
+ * Function returns buf.
+ **/
+static char *device_key(struct fdev *dev, char *buf, int len)
+{
+	snprintf(buf, len, "%04x:%04x:%s", dev->vid, dev->pid, dev->path);
+
+	return buf;
+}
+
+/**
+ * @brief Probe eeprom type without modifying the eeprom
+ *
+ * \param dev opened device
+ * \param image eeprom contents as returned by fdev_read_eeprom()
+ * \param st run statistics to update, or NULL
+ *
+ * Microwire eeproms ignore address bits they do not have, so reading
+ * past the end of a 93C46/93C56 wraps to its first word.  This is the
+ * same wrap ftdi_erase_eeprom() looks for after writing a marker, here
+ * tested with reads against the existing contents instead.
+ * Function returns the chip type, or -1 if the contents are too
+ * uniform to tell (a blank chip, for instance).
+ **/
+static int probe_eeprom(struct fdev *dev, const unsigned char *image, struct run_stats *st)
+{
+	unsigned short addrs[8], vals[8];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		if (image[i] != 0xff) break;
+	if (i == 16)
+		return -1;
+
+	for (i = 0; i < 8; i++)
+		addrs[i] = 0x80 + i;
+	if (fdev_read_words(dev, addrs, vals, 8) < 0)
+		return -1;
+	for (i = 0; i < 8; i++)
+		if (vals[i] != (image[i*2] | (image[i*2+1] << 8)))
+			return 0x66;
+
+	return memcmp(image, image + 0x80, 0x80) ? 0x56 : 0x46;
+}
+
+/**
+ * @brief Detect eeprom type
+ *
+ * \param dev opened device
+ * \param eeprom_type configured eeprom type, 0 to detect it
+ * \param image eeprom contents as read from the device, or NULL
+ * \param cache_file chip cache to consult and update, or NULL
+ * \param erased set to 1 if the eeprom was erased, 0 if it was
+ *         left untouched or -1 if its contents are unknown
+ * \param st run statistics to update, or NULL
+ *
+ * Detection tries a read-only probe, then the chip cache and only
+ * erases the eeprom when neither can tell, which in practice means
+ * the chip is blank anyway.  The probe goes first because the cache
+ * names a fixture slot, which may now hold a board of another chip;
+ * a cache line the probe disagrees with is replaced.
+ * Function will return the eeprom type detected or
+ * the eeprom_type if detection failed.
+ **/
+static int detect_eeprom(struct fdev *dev, int eeprom_type, const unsigned char *image, const char *cache_file, int *erased, struct run_stats *st) {
+	char key[160];
+	int i, f, cached, c = 0;
+
+	*erased = 0;
+	if (eeprom_type != 0) {
+		flash_log(FLASH_LOG_INFO, "Using configured EEPROM type 0x%02x\n", eeprom_type);
+		return eeprom_type;
+	}
+	if (dev->ftdi->type == TYPE_R || dev->ftdi->type == TYPE_230X) {
+		flash_log(FLASH_LOG_INFO, "Internal EEPROM\n");
+		return 0;
+	}
+
+	device_key(dev, key, sizeof(key));
+	cached = chip_cache_lookup(cache_file, key, &c) == 0;
+	if (image && (i = probe_eeprom(dev, image, st)) > 0) {
+		flash_log(FLASH_LOG_INFO, "Found 93x%02x\n", i);
+		if (!cached || c != i)
+			chip_cache_store(cache_file, key, i);
+		return i;
+	}
+	if (cached) {
+		flash_log(FLASH_LOG_INFO, "Found 93x%02x (cached)\n", c);
+		return c;
+	}
+
+    f = fdev_erase(dev, &i); /* needed to determine EEPROM chip type */
+    *erased = (f == 0) ? 1 : -1;
+    if (f < 0)
+        flash_log(FLASH_LOG_ERROR, "FTDI erase eeprom: %d (%s)\n",
+                f, ftdi_get_error_string(dev->ftdi));
+	if (i == -1)
+		flash_log(FLASH_LOG_INFO, "No EEPROM\n");
+	else if (i == 0)
+		flash_log(FLASH_LOG_INFO, "Internal EEPROM\n");
+	else {
+		flash_log(FLASH_LOG_INFO, "Found 93x%02x\n", i);
+		chip_cache_store(cache_file, key, i);
+	}
+
+	return i;
+}
+
+/**
+ * @brief locate an ftdi device based on vid/pid values and device details
+ *
+ * \param dev device to open
+ * \param ftdi pointer to ftdi_context
+ * \param m vid/pid pairs to try, most wanted first, and optional
+ *         serial, product, path and index to narrow them down
+ * \param st run statistics to update, or NULL
+ *
+ * Function enumerates the devices once and opens the one picked by m,
+ * waiting for its lock as dev_lock_setup() allows.
+ * Returns the status of the fdev_select routine.
+ **/
+int flash_locate(struct fdev *dev, struct ftdi_context *ftdi, const struct fdev_match *m, struct run_stats *st)
+{
+	char msg[512];
+	int i, k, n;
+
+	i = fdev_select(dev, ftdi, m);
+
+	if (i == FDEV_LOCKED) {
+		flash_log(FLASH_LOG_ERROR, "Device (%04x,%04x) at %s is locked by another process.\n", dev->vid, dev->pid, dev->path);
+	} else if(i!=0) {
+		n = snprintf(msg, sizeof(msg), "Unable to find FTDI devices under given vendor/product id:");
+		for (k = 0; k < m->n_ids; k++)
+			n += snprintf(msg + n, sizeof(msg) - n, " 0x%X/0x%X", m->ids[k][0], m->ids[k][1]);
+		if (m->serial) n += snprintf(msg + n, sizeof(msg) - n, ", serial '%.64s'", m->serial);
+		if (m->product) n += snprintf(msg + n, sizeof(msg) - n, ", product '%.64s'", m->product);
+		if (m->path) n += snprintf(msg + n, sizeof(msg) - n, ", path %.32s", m->path);
+		if (m->index) n += snprintf(msg + n, sizeof(msg) - n, ", index %d", m->index);
+		flash_log(FLASH_LOG_ERROR, "%s\nError code: %d (%s)\n", msg, i, ftdi_get_error_string(ftdi));
+	} else {
+		flash_log(FLASH_LOG_INFO, "Device (%04x,%04x) located at %s.\n", dev->vid, dev->pid, dev->path);
+	}
+
+	return i;
+}
+
+/**
+ * @brief Read and decode EEPROM information
+ *
+ * \param ftdi pointer to ftdi_context
+ * \param value eeprom size as returned by the last read, -1 if none
+ * \param debug value indicating whether more output is wanted.
+ *         0 = standard output
+ *         1 = debug output
+ *
+ * Function will provide the decoded EEPROM information
+ * to the command line.  The debug output is the byte
+ * buffer, displayed as a hex dump.
+ **/
+int flash_decode(struct ftdi_context *ftdi, int value, int debug)
+{
+	int f;
+	int size;
+	unsigned char buf[256];
+	char dump[256 / 16 * 80 + 1];
+
+	if (value <0)
+	{
+		flash_log(FLASH_LOG_ERROR, "No EEPROM found or EEPROM empty\n");
+		return -1;
+	}
+	flash_log(FLASH_LOG_INFO, "Chip type %d ftdi_eeprom_size: %d\n", ftdi->type, value);
+	if (ftdi->type == TYPE_R)
+		size = 0xa0;
+	else
+		size = value;
+
+	if(debug > 0) {
+		ftdi_get_eeprom_buf(ftdi, buf, size);
+		image_hexdump(dump, sizeof(dump), buf, size);
+		flash_log(FLASH_LOG_INFO, "%s", dump);
+	}
+
+	f = ftdi_eeprom_decode(ftdi, 1);
+	if (f < 0)
+	{
+		flash_log(FLASH_LOG_ERROR, "ftdi_eeprom_decode: %d (%s)\n",
+				f, ftdi_get_error_string(ftdi));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Write the eeprom words that differ from the device contents
+ *
+ * \param dev opened device
+ * \param old current device contents, or NULL to write every word
+ * \param image eeprom image to write
+ * \param size size of image in bytes
+ * \param written receives the number of words written
+ * \param skipped receives the number of words left untouched
+ * \param st run statistics to update, or NULL
+ *
+ * Function issues the same preamble as ftdi_write_eeprom() followed
+ * by one control transfer per changed word, several in flight at once.
+ * The checksum word goes last, once every other word is written, so an
+ * interrupted write never leaves a valid checksum over wrong data.
+ * Nothing at all is sent when the device already holds image.
+ * Returns 0 on success.
+ **/
+static int write_eeprom_diff(struct fdev *dev, const unsigned char *old, const unsigned char *image, int size, int *written, int *skipped, struct run_stats *st)
+{
+	unsigned short addrs[FTDI_MAX_EEPROM_SIZE / 2], vals[FTDI_MAX_EEPROM_SIZE / 2];
+	int i, n = 0, changed = 0;
+
+	*written = 0;
+	*skipped = 0;
+
+	for (i = 0; i < size / 2; i++) {
+		/* The reserved area is never written, so it can't count as changed */
+		if ((dev->ftdi->type == TYPE_230X) && (i >= 0x40) && (i < 0x50))
+			continue;
+		if (!old || old[i*2] != image[i*2] || old[i*2+1] != image[i*2+1])
+			changed++;
+	}
+	if (changed == 0) {
+		*skipped = size / 2;
+		return 0;
+	}
+
+	if (fdev_write_begin(dev) != 0)
+		return -1;
+
+	for (i = 0; i < size / 2; i++) {
+		/* Do not try to write to reserved area */
+		if ((dev->ftdi->type == TYPE_230X) && (i >= 0x40) && (i < 0x50)) {
+			(*skipped)++;
+			continue;
+		}
+		if (old && old[i*2] == image[i*2] && old[i*2+1] == image[i*2+1]) {
+			(*skipped)++;
+			continue;
+		}
+		addrs[n] = i;
+		vals[n++] = image[i*2] | (image[i*2+1] << 8);
+	}
+
+	/* The checksum is the last word of the image */
+	i = (n > 0 && addrs[n-1] == size / 2 - 1) ? n - 1 : n;
+	if (i > 0 && fdev_write_words(dev, addrs, vals, i) < 0) {
+		flash_log(FLASH_LOG_ERROR, "Unable to write eeprom words 0x%02x to 0x%02x\n", addrs[0], addrs[i-1]);
+		return -1;
+	}
+	if (i < n) {
+		if (fdev_write_word(dev, addrs[i], vals[i]) < 0) {
+			flash_log(FLASH_LOG_ERROR, "Unable to write eeprom word 0x%02x\n", addrs[i]);
+			return -1;
+		}
+	}
+	*written = n;
+
+	return 0;
+}
+
+/**
+ * @brief Load a raw eeprom image
+ *
+ * \param filename file to read, "-" for stdin
+ * \param buf buffer receiving the image
+ * \param len size of buf
+ *
+ * Function returns the number of bytes read, or -1 if the
+ * file can't be opened or holds less than 128 bytes.
+ **/
+int flash_load_image(const char *filename, unsigned char *buf, int len)
+{
+	FILE *fp;
+	int size;
+
+	fp = strcmp(filename, "-") ? fopen(filename, "rb") : stdin;
+	if (fp == NULL)
+	{
+		flash_log(FLASH_LOG_ERROR, "Can't open eeprom file %s.\n", filename);
+		return -1;
+	}
+	size = fread(buf, 1, len, fp);
+	if (fp != stdin)
+		fclose(fp);
+	if (size < 128)
+	{
+		flash_log(FLASH_LOG_ERROR, "Can't read eeprom file %s.\n", filename);
+		return -1;
+	}
+
+	return size;
+}
+
+/**
+ * @brief Compare the eeprom contents with an image
+ *
+ * \param dev opened device
+ * \param old device contents before writing, or NULL if unknown
+ * \param image expected eeprom contents
+ * \param size size of image in bytes
+ * \param mode which words to read back
+ * \param st run statistics to update, or NULL
+ *
+ * With VERIFY_WRITTEN only words differing from old are read, one
+ * control transfer each, several in flight; the others were just read
+ * before writing.
+ * VERIFY_FULL reads everything back with fdev_read_eeprom().
+ * Function logs every word that differs from image and returns
+ * the number of mismatched words, or -1 if the eeprom could not
+ * be read.
+ **/
+static int verify_eeprom(struct fdev *dev, const unsigned char *old, const unsigned char *image, int size, int mode, struct run_stats *st)
+{
+	unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+	unsigned short addrs[FTDI_MAX_EEPROM_SIZE / 2], vals[FTDI_MAX_EEPROM_SIZE / 2];
+	int i, k, n = 0, f, chip_size, bad = 0;
+
+	for (i = (mode == VERIFY_CHECKSUM) ? size / 2 - 1 : 0; i < size / 2; i++) {
+		if ((dev->ftdi->type == TYPE_230X) && (i >= 0x40) && (i < 0x50))
+			continue;
+		if (mode == VERIFY_WRITTEN && old && old[i*2] == image[i*2] && old[i*2+1] == image[i*2+1])
+			continue;
+		addrs[n++] = i;
+	}
+
+	if (mode == VERIFY_FULL) {
+		if ((f = fdev_read_eeprom(dev, buf, &chip_size))) {
+			flash_log(FLASH_LOG_ERROR, "FTDI read eeprom: %d (%s)\n", f, ftdi_get_error_string(dev->ftdi));
+			return -1;
+		}
+	} else {
+		if (fdev_read_words(dev, addrs, vals, n) < 0) {
+			flash_log(FLASH_LOG_ERROR, "Unable to read eeprom words back\n");
+			return -1;
+		}
+		for (k = 0; k < n; k++) {
+			buf[addrs[k]*2] = vals[k] & 0xff;
+			buf[addrs[k]*2+1] = vals[k] >> 8;
+		}
+	}
+
+	for (k = 0; k < n; k++) {
+		i = addrs[k];
+		if (buf[i*2] != image[i*2] || buf[i*2+1] != image[i*2+1]) {
+			flash_log(FLASH_LOG_ERROR, "Verify: word 0x%02x is 0x%02x%02x, expected 0x%02x%02x\n", i,
+				buf[i*2+1], buf[i*2], image[i*2+1], image[i*2]);
+			bad++;
+		}
+	}
+
+	return bad;
+}
+
+/**
+ * @brief Reset a device and wait until it is back on the bus
+ *
+ * \param dev opened device, reopened under its new identity on success
+ * \param timeout_ms how long to wait for the device
+ * \param st run statistics to update, or NULL
+ *
+ * A reset makes the device reload its eeprom and, with a new vid, pid
+ * or serial, enumerate again as another USB device.  Function reopens
+ * the device by its bus path as soon as it can.  A hotplug monitor,
+ * registered before the reset so the arrival can't be missed, wakes
+ * it up on libftdi devices; otherwise the bus is polled every 10 ms.
+ * Returns 0 once reopened, -1 on timeout with dev closed.
+ **/
+static int reset_and_reopen(struct fdev *dev, int timeout_ms, struct run_stats *st)
+{
+	struct ftdi_context *ftdi = dev->ftdi;
+	struct hotplug_monitor *mon = NULL;
+	struct hotplug_event ev;
+	struct fdev_match m;
+	struct timespec start, now;
+	const struct timespec poll = { 0, 10000000L };
+	int ids[1][2] = { { LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY } };
+	char path[32];
+	double ms;
+	int ret, transfers = dev->transfers, resets = dev->resets;
+
+	strcpy(path, dev->path);
+	memset(&m, 0, sizeof(m));
+	m.path = path;
+	/* Keep the device locked while it is away */
+	dev_lock_acquire(path);
+	if (dev->ops == &fdev_libftdi_ops && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		mon = hotplug_start(ftdi->usb_ctx, ids, 1);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fdev_reset(dev);
+	fdev_close(dev);
+	stats_phase(st, PHASE_RESET);
+
+	for (;;) {
+		ret = fdev_select(dev, ftdi, &m);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ms = (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6;
+		if (ret == 0 || ms >= timeout_ms)
+			break;
+		if (mon == NULL)
+			nanosleep(&poll, NULL);
+		else if (hotplug_wait(mon, &ev, timeout_ms - ms < 100 ? (int)(timeout_ms - ms) + 1 : 100) == 0 && ev.dev)
+			libusb_unref_device(ev.dev);
+	}
+	if (mon)
+		hotplug_stop(mon);
+	dev_lock_release(path);
+	/* The run's transfers and resets carry over to the device it gets back */
+	dev->transfers = transfers;
+	dev->resets = resets + 1;
+	stats_phase(st, PHASE_REENUM);
+
+	if (ret != 0) {
+		flash_log(FLASH_LOG_ERROR, "Device at %s did not come back within %d ms.\n", path, timeout_ms);
+		return -1;
+	}
+	flash_log(FLASH_LOG_INFO, "Device back as %04x:%04x%s%s at %s after %.1f ms.\n", dev->vid, dev->pid,
+		dev->serial[0] ? ", serial " : "", dev->serial, dev->path, ms);
+
+	return 0;
+}
+
+/**
+ * @brief Write an image into an opened device and finish the flash cycle
+ *
+ * \param dev opened device
+ * \param old device contents read before writing, or NULL if unknown
+ * \param image eeprom image to write
+ * \param size size of image in bytes
+ * \param fopts flash options
+ * \param verify enum verify_mode to apply
+ * \param st run statistics to update, or NULL
+ * \param s session remembering the image for flash_session_verify(),
+ *         or NULL
+ *
+ * Function writes the words that differ, verifies them, decodes the
+ * eeprom if asked to and resets the device if anything was written,
+ * unless fopts leaves that to the caller, waiting for it to come back
+ * if fopts asks to.
+ * Returns FLASH_OK on success, FLASH_FAILED if writing failed or the
+ * device did not come back and FLASH_VERIFY_FAILED if verification
+ * failed.
+ **/
+static int commit_image(struct fdev *dev, const unsigned char *old, const unsigned char *image, int size,
+	const struct flash_options *fopts, int verify, struct run_stats *st, struct flash_session *s)
+{
+	int written, skipped, bad, ret = FLASH_OK;
+
+	if (fopts->force)
+		old = NULL;
+	ret = write_eeprom_diff(dev, old, image, size, &written, &skipped, st);
+	stats_phase(st, PHASE_WRITE);
+	if (ret) {
+		flash_log(FLASH_LOG_ERROR, "FTDI write eeprom: %s\n", ftdi_get_error_string(dev->ftdi));
+		return FLASH_FAILED;
+	}
+	flash_log(FLASH_LOG_INFO, "EEPROM words written: %d, skipped: %d\n", written, skipped);
+	if (s) {
+		memcpy(s->image, image, size);
+		s->image_size = size;
+	}
+
+	if (written == 0) {
+		flash_log(FLASH_LOG_INFO, "EEPROM already up to date.\n");
+	} else if (verify != VERIFY_NONE) {
+		if ((bad = verify_eeprom(dev, old, image, size, verify, st)) != 0) {
+			flash_log(FLASH_LOG_ERROR, "EEPROM verification failed (%d words).\n", bad);
+			ret = FLASH_VERIFY_FAILED;
+		} else {
+			flash_log(FLASH_LOG_INFO, "EEPROM verified.\n");
+		}
+		stats_phase(st, PHASE_VERIFY);
+	}
+
+	if(fopts->decode > 0) {
+		flash_decode(dev->ftdi,size,fopts->debug);
+		stats_phase(st, PHASE_DECODE);
+	}
+	if (written == 0 || fopts->no_reset) {
+		/* nothing to reload, or the caller resets when it is done */
+	} else if (fopts->reenum_ms > 0) {
+		if (reset_and_reopen(dev, fopts->reenum_ms, st) < 0 && ret == FLASH_OK)
+			ret = FLASH_FAILED;
+	} else {
+		fdev_reset(dev);
+		stats_phase(st, PHASE_RESET);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Program a raw eeprom image, see flash_image()
+ *
+ * \param s session remembering the image, or NULL
+ **/
+static int write_image(struct fdev *dev, const unsigned char *image, int size, const struct flash_options *fopts,
+	struct run_stats *st, struct flash_session *s)
+{
+	unsigned char old_buf[FTDI_MAX_EEPROM_SIZE];
+	int have_old = 0, chip_size = -1, f;
+
+	f = fdev_read_eeprom(dev, old_buf, &chip_size);
+	stats_phase(st, PHASE_READ);
+	if (f) {
+		flash_log(FLASH_LOG_ERROR, "FTDI read eeprom: %d (%s)\n", f, ftdi_get_error_string(dev->ftdi));
+		chip_size = -1;
+	} else {
+		have_old = 1;
+	}
+
+	/* Writing past the end of a small eeprom wraps onto its first words */
+	if (chip_size > 0 && chip_size < size) {
+		flash_log(FLASH_LOG_INFO, "Image is %d bytes, eeprom holds %d. Writing %d bytes.\n", size, chip_size, chip_size);
+		size = chip_size;
+	}
+
+	return commit_image(dev, have_old ? old_buf : NULL, image, size, fopts,
+		fopts->verify ? fopts->verify : VERIFY_WRITTEN, st, s);
+}
+
+/**
+ * @brief Program a raw eeprom image into an opened device
+ *
+ * \param dev opened device
+ * \param image eeprom image to write
+ * \param size size of image in bytes
+ * \param fopts flash options
+ * \param st run statistics to update, or NULL
+ *
+ * This is the fast path for golden images: no configuration is
+ * applied, no image is built and the chip type is not detected.
+ * Function writes the words that differ, verifies them and resets
+ * the device.  Returns what commit_image() returns.
+ **/
+int flash_image(struct fdev *dev, const unsigned char *image, int size, const struct flash_options *fopts, struct run_stats *st)
+{
+	return write_image(dev, image, size, fopts, st, NULL);
+}
+
+/**
+ * @brief Allocate the serial number of the next unit
+ *
+ * \param cfg parsed configuration holding a serial template
+ * \param buf buffer receiving the serial number
+ * \param len size of buf
+ *
+ * Function takes the next value of the serial_counter file, adds
+ * serial_start and expands the serial template with it.
+ * Returns 0 on success, -1 on error.
+ **/
+static int allocate_serial(cfg_t *cfg, char *buf, int len)
+{
+	long offset;
+
+	if (serial_alloc_next(cfg_getstr(cfg, "serial_counter"),
+			cfg_getbool(cfg, "serial_sync"), &offset) < 0) {
+		flash_log(FLASH_LOG_ERROR, "Can't allocate a serial number from %s.\n", cfg_getstr(cfg, "serial_counter"));
+		return -1;
+	}
+	if (serial_format(cfg_getstr(cfg, "serial"), cfg_getint(cfg, "serial_start") + offset, buf, len) < 0) {
+		flash_log(FLASH_LOG_ERROR, "Serial number template '%s' does not fit.\n", cfg_getstr(cfg, "serial"));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Serial number of the next unit
+ *
+ * \param cfg parsed configuration
+ * \param buf buffer receiving an allocated serial number
+ * \param len size of buf
+ *
+ * Function returns the serial of the configuration, or the next one
+ * allocated in buf if it is a template, NULL on error.
+ **/
+static char *unit_serial(cfg_t *cfg, char *buf, int len)
+{
+	char *serial = cfg_getstr(cfg, "serial");
+
+	if (serial_is_template(serial)) {
+		if (allocate_serial(cfg, buf, len) < 0)
+			return NULL;
+		serial = buf;
+		flash_log(FLASH_LOG_INFO, "Serial number: %s\n", serial);
+	}
+
+	return serial;
+}
+
+/**
+ * @brief Build the eeprom image described by a configuration
+ *
+ * \param dev device whose eeprom state is built; it does not need to
+ *         be open, ftdi->type alone selects the layout
+ * \param cfg parsed configuration
+ * \param chip eeprom type, 0x46, 0x56, 0x66 or 0 for an internal one
+ * \param serial serial string to put in the image
+ * \param buf buffer of FTDI_MAX_EEPROM_SIZE bytes receiving the image
+ * \param size receives the size of the image in bytes
+ * \param st run statistics to update, or NULL
+ *
+ * Function returns what ftdi_eeprom_build() returns: the number of
+ * unused bytes, -1 if the strings do not fit or another negative
+ * value on error.  FLASH_BUILD_REJECTED means libftdi refused the
+ * defaults or one of the settings and nothing was built.
+ **/
+int flash_build_image(struct fdev *dev, cfg_t *cfg, int chip, char *serial, unsigned char *buf, int *size, struct run_stats *st)
+{
+	struct ftdi_context *ftdi = dev->ftdi;
+	int size_check, bad = 0;
+
+	if (fdev_initdefaults (dev, cfg_getstr(cfg, "manufacturer"),
+									cfg_getstr(cfg, "product"),
+									serial) < 0) {
+		flash_log(FLASH_LOG_ERROR, "Unable to set eeprom defaults: %s\n", ftdi_get_error_string(ftdi));
+		return FLASH_BUILD_REJECTED;
+	}
+
+	bad |= eeprom_set_value(ftdi, CHIP_TYPE, chip);
+
+	bad |= eeprom_set_value(ftdi, VENDOR_ID, cfg_getint(cfg, "vendor_id"));
+	bad |= eeprom_set_value(ftdi, PRODUCT_ID, cfg_getint(cfg, "product_id"));
+
+	bad |= eeprom_set_value(ftdi, SELF_POWERED, cfg_getbool(cfg, "self_powered"));
+	bad |= eeprom_set_value(ftdi, REMOTE_WAKEUP, cfg_getbool(cfg, "remote_wakeup"));
+	bad |= eeprom_set_value(ftdi, MAX_POWER, cfg_getint(cfg, "max_power"));
+
+	bad |= eeprom_set_value(ftdi, IN_IS_ISOCHRONOUS, cfg_getbool(cfg, "in_is_isochronous"));
+	bad |= eeprom_set_value(ftdi, OUT_IS_ISOCHRONOUS, cfg_getbool(cfg, "out_is_isochronous"));
+	bad |= eeprom_set_value(ftdi, SUSPEND_PULL_DOWNS, cfg_getbool(cfg, "suspend_pull_downs"));
+
+	bad |= eeprom_set_value(ftdi, USE_SERIAL, cfg_getbool(cfg, "use_serial"));
+	bad |= eeprom_set_value(ftdi, USE_USB_VERSION, cfg_getbool(cfg, "change_usb_version"));
+	bad |= eeprom_set_value(ftdi, USB_VERSION, cfg_getint(cfg, "usb_version"));
+
+	bad |= eeprom_set_value(ftdi, HIGH_CURRENT, cfg_getbool(cfg, "high_current"));
+	bad |= eeprom_set_value(ftdi, CBUS_FUNCTION_0, str_to_cbus(cfg_getstr(cfg, "cbus0"), 13));
+	bad |= eeprom_set_value(ftdi, CBUS_FUNCTION_1, str_to_cbus(cfg_getstr(cfg, "cbus1"), 13));
+	bad |= eeprom_set_value(ftdi, CBUS_FUNCTION_2, str_to_cbus(cfg_getstr(cfg, "cbus2"), 13));
+	bad |= eeprom_set_value(ftdi, CBUS_FUNCTION_3, str_to_cbus(cfg_getstr(cfg, "cbus3"), 13));
+	bad |= eeprom_set_value(ftdi, CBUS_FUNCTION_4, str_to_cbus(cfg_getstr(cfg, "cbus4"), 9));
+	int invert = 0;
+	if (cfg_getbool(cfg, "invert_rxd")) invert |= INVERT_RXD;
+	if (cfg_getbool(cfg, "invert_txd")) invert |= INVERT_TXD;
+	if (cfg_getbool(cfg, "invert_rts")) invert |= INVERT_RTS;
+	if (cfg_getbool(cfg, "invert_cts")) invert |= INVERT_CTS;
+	if (cfg_getbool(cfg, "invert_dtr")) invert |= INVERT_DTR;
+	if (cfg_getbool(cfg, "invert_dsr")) invert |= INVERT_DSR;
+	if (cfg_getbool(cfg, "invert_dcd")) invert |= INVERT_DCD;
+	if (cfg_getbool(cfg, "invert_ri")) invert |= INVERT_RI;
+	bad |= eeprom_set_value(ftdi, INVERT, invert);
+
+	bad |= eeprom_set_value(ftdi, CHANNEL_A_DRIVER, str_to_drvr(cfg_getstr(cfg,"channel_a_driver")) ? DRIVER_VCP : 0);
+	bad |= eeprom_set_value(ftdi, CHANNEL_B_DRIVER, str_to_drvr(cfg_getstr(cfg,"channel_b_driver")) ? DRIVER_VCP : 0);
+	bad |= eeprom_set_value(ftdi, CHANNEL_C_DRIVER, str_to_drvr(cfg_getstr(cfg,"channel_c_driver")) ? DRIVER_VCP : 0);
+	bad |= eeprom_set_value(ftdi, CHANNEL_D_DRIVER, str_to_drvr(cfg_getstr(cfg,"channel_d_driver")) ? DRIVER_VCP : 0);
+	bad |= eeprom_set_value(ftdi, CHANNEL_A_RS485, cfg_getbool(cfg,"channel_a_rs485"));
+	bad |= eeprom_set_value(ftdi, CHANNEL_B_RS485, cfg_getbool(cfg,"channel_b_rs485"));
+	bad |= eeprom_set_value(ftdi, CHANNEL_C_RS485, cfg_getbool(cfg,"channel_c_rs485"));
+	bad |= eeprom_set_value(ftdi, CHANNEL_D_RS485, cfg_getbool(cfg,"channel_d_rs485"));
+
+	stats_phase(st, PHASE_CONFIG);
+	if (bad)
+		return FLASH_BUILD_REJECTED;
+	size_check = ftdi_eeprom_build(ftdi);
+	stats_phase(st, PHASE_BUILD);
+
+	/* Without a size the chip type decides, as for a blank eeprom */
+	if (eeprom_get_value(ftdi, CHIP_SIZE, size) < 0 || *size < 0)
+		*size = (chip == 0x56 || chip == 0x66) ? 0x100 : 0x80;
+	ftdi_get_eeprom_buf(ftdi, buf, FTDI_MAX_EEPROM_SIZE);
+
+	return size_check;
+}
+
+/**
+ * @brief Program the eeprom from a configuration, see flash_device()
+ *
+ * \param s session remembering the image, or NULL
+ **/
+static int program_device(struct fdev *dev, cfg_t *cfg, const struct flash_options *fopts, struct run_stats *st,
+	struct flash_session *s)
+{
+	struct ftdi_context *ftdi = dev->ftdi;
+	const int max_eeprom_size = 256;
+	unsigned char eeprom_buf[max_eeprom_size];
+	unsigned char old_buf[max_eeprom_size];
+	int have_old = 0, erased;
+	int my_eeprom_size = 0, chip_size;
+	int size_check;
+	int i, f;
+	char *filename = cfg_getstr(cfg, "filename");
+	char *serial, serial_buf[128];
+	char cache_path[512];
+	const char *cache_file = cfg_getstr(cfg, "chip_cache");
+
+	if (cfg_getbool(cfg, "flash_raw") && filename != NULL && strlen(filename) > 0)
+	{
+		if ((f = flash_load_image(filename, eeprom_buf, max_eeprom_size)) < 0)
+			return FLASH_FAILED;
+		return write_image(dev, eeprom_buf, f, fopts, st, s);
+	}
+
+	if (fopts->bundle != NULL)
+	{
+		const unsigned char *image;
+		const char *key = fopts->key;
+
+		if (key == NULL && (key = unit_serial(cfg, serial_buf, sizeof(serial_buf))) == NULL)
+			return FLASH_FAILED;
+		if ((image = bundle_find(fopts->bundle, key, &f)) == NULL) {
+			flash_log(FLASH_LOG_ERROR, "No image for '%s' in the bundle.\n", key);
+			return FLASH_FAILED;
+		}
+		return write_image(dev, image, f, fopts, st, s);
+	}
+
+	if (cache_file == NULL)
+		cache_file = chip_cache_default(cache_path, sizeof(cache_path));
+	else if (*cache_file == '\0')
+		cache_file = NULL;
+
+	f = fdev_read_eeprom(dev, old_buf, &chip_size);
+	stats_phase(st, PHASE_READ);
+	if(f) {
+		flash_log(FLASH_LOG_ERROR, "FTDI read eeprom: %d (%s)\n", f, ftdi_get_error_string(ftdi));
+	} else {
+		have_old = 1;
+	}
+
+	i = detect_eeprom(dev, cfg_getint(cfg,"eeprom_type"),
+		have_old ? old_buf : NULL, cache_file, &erased, st);
+	stats_phase(st, PHASE_DETECT);
+	if (erased > 0) {
+		memset(old_buf, 0xff, max_eeprom_size);
+		have_old = 1;
+	} else if (erased < 0) {
+		have_old = 0;
+	}
+
+	if ((serial = unit_serial(cfg, serial_buf, sizeof(serial_buf))) == NULL)
+		return FLASH_FAILED;
+
+	size_check = flash_build_image(dev, cfg, i, serial, eeprom_buf, &my_eeprom_size, st);
+	if (size_check == FLASH_BUILD_REJECTED)
+		return FLASH_FAILED;
+	flash_log(FLASH_LOG_INFO, "EEPROM size: %d\n",my_eeprom_size);
+
+	if (size_check == -1)
+	{
+		flash_log(FLASH_LOG_ERROR, "Sorry, the eeprom can only contain 128 bytes (100 bytes for your strings).\n"
+			"You need to short your string by: %d bytes\n", size_check);
+		return FLASH_FAILED;
+	} else if (size_check < 0) {
+		/* libftdi left the buffer unbuilt, there is nothing to write */
+		flash_log(FLASH_LOG_ERROR, "ftdi_eeprom_build(): error: %d (%s)\n", size_check, ftdi_get_error_string(ftdi));
+		return FLASH_FAILED;
+	}
+	else
+	{
+		flash_log(FLASH_LOG_INFO, "Used eeprom space: %d bytes\n", my_eeprom_size-size_check);
+	}
+
+	return commit_image(dev, have_old ? old_buf : NULL, eeprom_buf, my_eeprom_size,
+		fopts, fopts->verify, st, s);
+}
+
+/**
+ * @brief Program the eeprom of an opened device from a configuration
+ *
+ * \param dev opened device
+ * \param cfg parsed configuration
+ * \param fopts flash options
+ * \param st run statistics to update, or NULL
+ *
+ * Function builds the eeprom image described by cfg and writes the
+ * words that differ from the current device contents.  The device
+ * is reset if anything was written.  With flash_raw the image is
+ * taken from filename through flash_image() instead, and with a
+ * bundle it is the one stored under the key or the unit's serial.
+ * Returns FLASH_OK on success, FLASH_FAILED on failure and
+ * FLASH_VERIFY_FAILED if verification failed.
+ **/
+int flash_device(struct fdev *dev, cfg_t *cfg, const struct flash_options *fopts, struct run_stats *st)
+{
+	return program_device(dev, cfg, fopts, st, NULL);
+}
+
+/**
+ * @brief Check whether a device already holds the image of a configuration
+ *
+ * \param dev opened device
+ * \param cfg parsed configuration
+ * \param st run statistics to update, or NULL
+ *
+ * The expected image is built in memory, with the serial the device
+ * reports if the configuration numbers units from a template.  Only
+ * the vid, pid and checksum words are compared; the rest of the eeprom
+ * is, to count and log the words that differ, only if one of them
+ * does not match.
+ * Since the checksum covers every word, a device passing the first
+ * read differs from the image at most by a checksum collision.  The
+ * eeprom type comes from the configuration, or else from a probe of
+ * the contents, which are read for it; the chip cache only answers
+ * for a blank chip.  Nothing is ever written or erased.
+ * Returns FLASH_OK if the device matches, FLASH_MISMATCH if not or
+ * FLASH_FAILED.
+ **/
+int flash_check(struct fdev *dev, cfg_t *cfg, struct run_stats *st)
+{
+	unsigned char image[FTDI_MAX_EEPROM_SIZE], buf[FTDI_MAX_EEPROM_SIZE];
+	unsigned short addrs[3], vals[3], words[FTDI_MAX_EEPROM_SIZE / 2], word_vals[FTDI_MAX_EEPROM_SIZE / 2];
+	char *serial = cfg_getstr(cfg, "serial"), *filename = cfg_getstr(cfg, "filename");
+	char serial_buf[64], key[160], cache_path[512];
+	const char *cache_file = cfg_getstr(cfg, "chip_cache");
+	int chip, cached, size, i, k, n, bad, have_buf = 0;
+
+	if (cfg_getbool(cfg, "flash_raw") && filename != NULL && strlen(filename) > 0) {
+		if ((size = flash_load_image(filename, image, sizeof(image))) < 0)
+			return FLASH_FAILED;
+	} else {
+		chip = cfg_getint(cfg, "eeprom_type");
+		if (cache_file == NULL)
+			cache_file = chip_cache_default(cache_path, sizeof(cache_path));
+		else if (*cache_file == '\0')
+			cache_file = NULL;
+		if (chip == 0 && dev->ftdi->type != TYPE_R && dev->ftdi->type != TYPE_230X) {
+			if ((i = fdev_read_eeprom(dev, buf, &size)) != 0) {
+				flash_log(FLASH_LOG_ERROR, "FTDI read eeprom: %d (%s)\n", i, ftdi_get_error_string(dev->ftdi));
+				return FLASH_FAILED;
+			}
+			have_buf = 1;
+			cached = chip_cache_lookup(cache_file, device_key(dev, key, sizeof(key)), &i) == 0;
+			if ((chip = probe_eeprom(dev, buf, st)) > 0) {
+				if (!cached || i != chip)
+					chip_cache_store(cache_file, key, chip);
+			} else if (cached) {
+				chip = i;
+			} else {
+				flash_log(FLASH_LOG_ERROR, "EEPROM is blank.\n");
+				return FLASH_MISMATCH;
+			}
+		}
+		stats_phase(st, PHASE_DETECT);
+
+		if (serial_is_template(serial)) {
+			if (dev->serial[0] == '\0') {
+				flash_log(FLASH_LOG_ERROR, "Device has no serial number to check against.\n");
+				return FLASH_MISMATCH;
+			}
+			snprintf(serial_buf, sizeof(serial_buf), "%s", dev->serial);
+			serial = serial_buf;
+		}
+		if (flash_build_image(dev, cfg, chip, serial, image, &size, st) < 0) {
+			flash_log(FLASH_LOG_ERROR, "Can't build the image of the configuration.\n");
+			return FLASH_FAILED;
+		}
+	}
+
+	addrs[0] = 1;
+	addrs[1] = 2;
+	addrs[2] = size / 2 - 1;
+	if (have_buf) {
+		for (i = 0; i < 3; i++)
+			vals[i] = buf[addrs[i]*2] | (buf[addrs[i]*2+1] << 8);
+	} else {
+		if (fdev_read_words(dev, addrs, vals, 3) < 0) {
+			flash_log(FLASH_LOG_ERROR, "Unable to read eeprom words\n");
+			return FLASH_FAILED;
+		}
+	}
+	for (i = 0; i < 3; i++)
+		if (vals[i] != (image[addrs[i]*2] | (image[addrs[i]*2+1] << 8)))
+			break;
+	if (i == 3) {
+		stats_phase(st, PHASE_VERIFY);
+		flash_log(FLASH_LOG_INFO, "EEPROM matches the configuration.\n");
+		return FLASH_OK;
+	}
+
+	for (i = n = 0; i < size / 2; i++)
+		if (dev->ftdi->type != TYPE_230X || i < 0x40 || i >= 0x50)
+			words[n++] = i;
+	if (!have_buf) {
+		if (fdev_read_words(dev, words, word_vals, n) < 0) {
+			flash_log(FLASH_LOG_ERROR, "Unable to read eeprom words\n");
+			return FLASH_FAILED;
+		}
+		for (i = 0; i < n; i++) {
+			buf[words[i]*2] = word_vals[i] & 0xff;
+			buf[words[i]*2+1] = word_vals[i] >> 8;
+		}
+	}
+	stats_phase(st, PHASE_VERIFY);
+	for (i = bad = 0; i < n; i++) {
+		k = words[i];
+		if (buf[k*2] == image[k*2] && buf[k*2+1] == image[k*2+1])
+			continue;
+		if (bad++ < 8)
+			flash_log(FLASH_LOG_INFO, "Word 0x%02x is 0x%02x%02x, expected 0x%02x%02x\n", k,
+				buf[k*2+1], buf[k*2], image[k*2+1], image[k*2]);
+	}
+	flash_log(FLASH_LOG_ERROR, "EEPROM differs from the configuration in %d words.\n", bad);
+
+	return FLASH_MISMATCH;
+}
+
+/**
+ * @brief Load a configuration file or FT_Prog xml template
+ *
+ * \param filename file to load
+ *
+ * Returns the parsed configuration, to be released with cfg_free(),
+ * or NULL if it can't be loaded.
+ **/
+cfg_t *flash_config_load(const char *filename)
+{
+	char err[256];
+	cfg_t *cfg;
+	FILE *fp;
+
+	if ((fp = fopen(filename, "r")) == NULL)
+	{
+		flash_log(FLASH_LOG_ERROR, "Can't open configuration file %s\n", filename);
+		return NULL;
+	}
+	fclose (fp);
+
+	if ((cfg = cfg_init(flash_opts, 0)) == NULL)
+		return NULL;
+	if (ftdi_xml_detect(filename)) {
+		if (ftdi_xml_load_cfg(cfg, filename, err, sizeof(err)) != 0) {
+			flash_log(FLASH_LOG_ERROR, "Can't load %s: %s\n", filename, err);
+			cfg_free(cfg);
+			return NULL;
+		}
+	} else if (cfg_parse(cfg, filename) != CFG_SUCCESS) {
+		flash_log(FLASH_LOG_ERROR, "Can't parse configuration file %s\n", filename);
+		cfg_free(cfg);
+		return NULL;
+	}
+
+	return cfg;
+}
+
+/**
+ * @brief Remember why a session operation failed
+ *
+ * \param s session
+ * \param result result to return
+ * \param why explanation used if nothing was logged as an error
+ *
+ * Function returns result.
+ **/
+static int session_fail(struct flash_session *s, int result, const char *why)
+{
+	snprintf(s->error, sizeof(s->error), "%s", last_error[0] ? last_error : why);
+
+	return result;
+}
+
+/**
+ * @brief Start a session operation
+ *
+ * \param s session
+ * \param need_device whether the operation needs an open device
+ *
+ * Returns FLASH_OK, or FLASH_NO_DEVICE if a device is needed and none
+ * is open.
+ **/
+static int session_begin(struct flash_session *s, int need_device)
+{
+	s->error[0] = '\0';
+	last_error[0] = '\0';
+	if (need_device && s->dev.ops == NULL)
+		return session_fail(s, FLASH_NO_DEVICE, "no device open");
+
+	return FLASH_OK;
+}
+
+/**
+ * @brief Close the device of a session, if any
+ *
+ * The control transfers made through the device are added to the
+ * statistics of the session.
+ **/
+static int session_close_device(struct flash_session *s)
+{
+	stats_usb(s->st, s->dev.transfers);
+	s->dev.transfers = 0;
+
+	return fdev_close(&s->dev);
+}
+
+/**
+ * @brief Create a session
+ *
+ * Returns the session, or NULL if libftdi could not be initialized.
+ **/
+struct flash_session *flash_session_new(void)
+{
+	struct flash_session *s = calloc(1, sizeof(*s));
+
+	if (s == NULL)
+		return NULL;
+	if ((s->ftdi = ftdi_new()) == NULL) {
+		free(s);
+		return NULL;
+	}
+	s->dev.ftdi = s->ftdi;
+
+	return s;
+}
+
+/**
+ * @brief Close the device of a session, if any, and free it
+ **/
+void flash_session_free(struct flash_session *s)
+{
+	if (s == NULL)
+		return;
+	session_close_device(s);
+	profile_index_free(&s->profiles);
+	if (s->cfg)
+		cfg_free(s->cfg);
+	ftdi_deinit(s->ftdi);
+	ftdi_free(s->ftdi);
+	free(s);
+}
+
+/**
+ * @brief Explanation of the last failed operation, "" if it succeeded
+ **/
+const char *flash_session_error(const struct flash_session *s)
+{
+	return s->error;
+}
+
+/**
+ * @brief Record the timing and USB traffic of later operations in st
+ *
+ * The control transfers of a device are added when it is closed.
+ *
+ * \param s session
+ * \param st statistics to update, NULL to stop recording
+ **/
+void flash_session_set_stats(struct flash_session *s, struct run_stats *st)
+{
+	s->st = st;
+}
+
+/**
+ * @brief ftdi_context of a session, for enumerating devices
+ **/
+struct ftdi_context *flash_session_ftdi(struct flash_session *s)
+{
+	return s->ftdi;
+}
+
+/**
+ * @brief Device of a session, opened or not
+ **/
+struct fdev *flash_session_device(struct flash_session *s)
+{
+	return &s->dev;
+}
+
+/**
+ * @brief Configuration of a session, NULL if none is loaded
+ **/
+cfg_t *flash_session_cfg(struct flash_session *s)
+{
+	return s->cfg;
+}
+
+/**
+ * @brief Profiles of the session's configuration
+ *
+ * Without a configuration the index is empty.
+ **/
+const struct profile_index *flash_session_profiles(struct flash_session *s)
+{
+	return &s->profiles;
+}
+
+/**
+ * @brief Profile the open device would be programmed with
+ *
+ * Returns the profile, or NULL if no device is open, no configuration
+ * is loaded or no profile claims the device.
+ **/
+const struct profile *flash_session_match(struct flash_session *s)
+{
+	if (s->dev.ops == NULL || s->cfg == NULL)
+		return NULL;
+
+	return profile_match(&s->profiles, s->dev.vid, s->dev.pid);
+}
+
+/**
+ * @brief Load the configuration used by later operations
+ *
+ * \param s session
+ * \param filename configuration file or FT_Prog xml template
+ *
+ * The file is parsed and its profiles indexed once, here.  The
+ * previous configuration is kept if the new one can't be loaded.
+ * Returns FLASH_OK or FLASH_NO_CONFIG.
+ **/
+int flash_session_config(struct flash_session *s, const char *filename)
+{
+	struct profile_index profiles;
+	cfg_t *cfg;
+
+	session_begin(s, 0);
+	if ((cfg = flash_config_load(filename)) == NULL)
+		return session_fail(s, FLASH_NO_CONFIG, "can't load configuration");
+	if (profile_index_build(&profiles, cfg) < 0) {
+		cfg_free(cfg);
+		return session_fail(s, FLASH_NO_CONFIG, "out of memory");
+	}
+	profile_index_free(&s->profiles);
+	if (s->cfg)
+		cfg_free(s->cfg);
+	s->cfg = cfg;
+	s->profiles = profiles;
+
+	return FLASH_OK;
+}
+
+/**
+ * @brief Choose the profile of devices no profile claims
+ *
+ * \param s session
+ * \param name profile of the loaded configuration, NULL for none
+ *
+ * Blank devices carry the target ids every profile shares, so they
+ * need this choice.  Loading another configuration drops it.
+ * Returns FLASH_OK or FLASH_NO_CONFIG if there is no such profile.
+ **/
+int flash_session_profile(struct flash_session *s, const char *name)
+{
+	session_begin(s, 0);
+	if (s->cfg == NULL)
+		return session_fail(s, FLASH_NO_CONFIG, "no configuration loaded");
+	if (profile_set_fallback(&s->profiles, name) < 0) {
+		flash_log(FLASH_LOG_ERROR, "No profile %s in the configuration.\n", name);
+		return session_fail(s, FLASH_NO_CONFIG, "no such profile");
+	}
+
+	return FLASH_OK;
+}
+
+/**
+ * @brief Open a device, closing the one open before
+ *
+ * \param s session
+ * \param m device to open, NULL for the first one found
+ *
+ * Without ids in m the vid/pid of every profile is tried first, then
+ * their target vid/pid; without a configuration the default FTDI
+ * vid/pid.
+ * The device stays locked against other processes until it is closed.
+ * Returns FLASH_OK, FLASH_NO_DEVICE if nothing matched, FLASH_BUSY if
+ * another process kept it locked or FLASH_FAILED if it could not be
+ * opened.
+ **/
+int flash_session_open(struct flash_session *s, const struct fdev_match *m)
+{
+	struct fdev_match def;
+	int ids[FDEV_MATCH_IDS][2];
+	int f, i, n, target;
+
+	session_begin(s, 0);
+	session_close_device(s);
+	s->image_size = 0;
+
+	if (m == NULL || m->n_ids == 0) {
+		if (m)
+			def = *m;
+		else
+			memset(&def, 0, sizeof(def));
+		for (target = 0; target < 2; target++) {
+			n = profile_ids(&s->profiles, target, ids, FDEV_MATCH_IDS);
+			for (i = 0; i < n; i++)
+				fdev_match_add(&def, ids[i][0], ids[i][1]);
+		}
+		fdev_match_add(&def, 0x403, 0x6001);
+		m = &def;
+	}
+
+	f = flash_locate(&s->dev, s->ftdi, m, s->st);
+	stats_phase(s->st, PHASE_OPEN);
+	if (f == -3)
+		return session_fail(s, FLASH_NO_DEVICE, "no matching device");
+	if (f == FDEV_LOCKED)
+		return session_fail(s, FLASH_BUSY, "device locked by another process");
+	if (f != 0)
+		return session_fail(s, FLASH_FAILED, ftdi_get_error_string(s->ftdi));
+	if (s->st)
+		strcpy(s->st->device, s->dev.path);
+
+	return FLASH_OK;
+}
+
+/**
+ * @brief Close the device of a session
+ *
+ * Returns FLASH_OK, also if no device was open, or FLASH_FAILED.
+ **/
+int flash_session_close(struct flash_session *s)
+{
+	session_begin(s, 0);
+	if (session_close_device(s) != 0)
+		return session_fail(s, FLASH_FAILED, ftdi_get_error_string(s->ftdi));
+
+	return FLASH_OK;
+}
+
+/**
+ * @brief Read the whole eeprom of the open device
+ *
+ * \param s session
+ * \param buf buffer of FTDI_MAX_EEPROM_SIZE bytes receiving the contents
+ * \param size receives the eeprom size in bytes, -1 if it is blank
+ *
+ * Returns FLASH_OK, FLASH_NO_DEVICE or FLASH_FAILED.
+ **/
+int flash_session_read(struct flash_session *s, unsigned char *buf, int *size)
+{
+	int f;
+
+	if ((f = session_begin(s, 1)) != FLASH_OK)
+		return f;
+	f = fdev_read_eeprom(&s->dev, buf, size);
+	stats_phase(s->st, PHASE_READ);
+	if (f) {
+		flash_log(FLASH_LOG_ERROR, "FTDI read eeprom: %d (%s)\n", f, ftdi_get_error_string(s->ftdi));
+		return session_fail(s, FLASH_FAILED, "read failed");
+	}
+
+	return FLASH_OK;
+}
+
+/**
+ * @brief Decode the eeprom last read or written
+ *
+ * \param s session
+ * \param size eeprom size returned by flash_session_read()
+ * \param debug include a hex dump
+ *
+ * libftdi prints the decoded fields itself.  It only keeps what its
+ * decoder needs after a read one word at a time, that is with
+ * fdev_set_pipeline(1).
+ * Returns FLASH_OK, FLASH_NO_DEVICE or FLASH_FAILED.
+ **/
+int flash_session_decode(struct flash_session *s, int size, int debug)
+{
+	int f;
+
+	if ((f = session_begin(s, 1)) != FLASH_OK)
+		return f;
+	f = flash_decode(s->ftdi, size, debug);
+	stats_phase(s->st, PHASE_DECODE);
+
+	return f ? session_fail(s, FLASH_FAILED, "decode failed") : FLASH_OK;
+}
+
+/**
+ * @brief Program the open device from the session's configuration
+ *
+ * \param s session
+ * \param fopts flash options, NULL for the defaults
+ *
+ * The device gets the profile matching its ids, see profile_match().
+ * Returns FLASH_OK, FLASH_NO_DEVICE, FLASH_NO_CONFIG, FLASH_FAILED or
+ * FLASH_VERIFY_FAILED.
+ **/
+int flash_session_program(struct flash_session *s, const struct flash_options *fopts)
+{
+	static const struct flash_options defaults;
+	const struct profile *p;
+	int f;
+
+	if ((f = session_begin(s, 1)) != FLASH_OK)
+		return f;
+	if (s->cfg == NULL)
+		return session_fail(s, FLASH_NO_CONFIG, "no configuration loaded");
+	if ((p = flash_session_match(s)) == NULL) {
+		flash_log(FLASH_LOG_ERROR, "No single profile for %04x:%04x, choose one.\n", s->dev.vid, s->dev.pid);
+		return session_fail(s, FLASH_NO_CONFIG, "no matching profile");
+	}
+	if (p->name)
+		flash_log(FLASH_LOG_INFO, "Profile %s\n", p->name);
+	f = program_device(&s->dev, p->cfg, fopts ? fopts : &defaults, s->st, s);
+
+	return f ? session_fail(s, f, "flash failed") : FLASH_OK;
+}
+
+/**
+ * @brief Program a raw eeprom image into the open device
+ *
+ * \param s session
+ * \param image eeprom image to write
+ * \param size size of image in bytes
+ * \param fopts flash options, NULL for the defaults
+ *
+ * Returns FLASH_OK, FLASH_NO_DEVICE, FLASH_FAILED or
+ * FLASH_VERIFY_FAILED.
+ **/
+int flash_session_write(struct flash_session *s, const unsigned char *image, int size, const struct flash_options *fopts)
+{
+	static const struct flash_options defaults;
+	int f;
+
+	if ((f = session_begin(s, 1)) != FLASH_OK)
+		return f;
+	f = write_image(&s->dev, image, size, fopts ? fopts : &defaults, s->st, s);
+
+	return f ? session_fail(s, f, "write failed") : FLASH_OK;
+}
+
+/**
+ * @brief Check the open device against the image last written
+ *
+ * \param s session
+ *
+ * Every word of the image is read back, several transfers in flight.
+ * Returns FLASH_OK if they all match, FLASH_VERIFY_FAILED if not,
+ * FLASH_NO_DEVICE or FLASH_FAILED, also when nothing was written yet.
+ **/
+int flash_session_verify(struct flash_session *s)
+{
+	int f;
+
+	if ((f = session_begin(s, 1)) != FLASH_OK)
+		return f;
+	if (s->image_size == 0)
+		return session_fail(s, FLASH_FAILED, "nothing written in this session");
+	f = verify_eeprom(&s->dev, NULL, s->image, s->image_size, VERIFY_WRITTEN, s->st);
+	stats_phase(s->st, PHASE_VERIFY);
+	if (f < 0)
+		return session_fail(s, FLASH_FAILED, "read failed");
+	if (f > 0) {
+		flash_log(FLASH_LOG_ERROR, "EEPROM verification failed (%d words).\n", f);
+		return session_fail(s, FLASH_VERIFY_FAILED, "verification failed");
+	}
+
+	return FLASH_OK;
+}
+
+/**
+ * @brief Check whether the open device already matches the configuration
+ *
+ * \param s session
+ *
+ * The device is compared with the image of its profile, see
+ * flash_check().
+ * Returns FLASH_OK if it matches, FLASH_MISMATCH, FLASH_NO_DEVICE,
+ * FLASH_NO_CONFIG or FLASH_FAILED.
+ **/
+int flash_session_check(struct flash_session *s)
+{
+	const struct profile *p;
+	int f;
+
+	if ((f = session_begin(s, 1)) != FLASH_OK)
+		return f;
+	if (s->cfg == NULL)
+		return session_fail(s, FLASH_NO_CONFIG, "no configuration loaded");
+	if ((p = flash_session_match(s)) == NULL) {
+		flash_log(FLASH_LOG_ERROR, "No single profile for %04x:%04x, choose one.\n", s->dev.vid, s->dev.pid);
+		return session_fail(s, FLASH_NO_CONFIG, "no matching profile");
+	}
+	f = flash_check(&s->dev, p->cfg, s->st);
+
+	return f ? session_fail(s, f, "check failed") : FLASH_OK;
+}
+
+/**
+ * @brief Erase the eeprom of the open device
+ *
+ * Returns FLASH_OK, FLASH_NO_DEVICE or FLASH_FAILED.
+ **/
+int flash_session_erase(struct flash_session *s)
+{
+	int f, chip;
+
+	if ((f = session_begin(s, 1)) != FLASH_OK)
+		return f;
+	f = fdev_erase(&s->dev, &chip);
+	stats_phase(s->st, PHASE_ERASE);
+	if (f) {
+		flash_log(FLASH_LOG_ERROR, "FTDI erase eeprom: %d (%s)\n", f, ftdi_get_error_string(s->ftdi));
+		return session_fail(s, FLASH_FAILED, "erase failed");
+	}
+
+	return FLASH_OK;
+}
+
+/**
+ * @brief Reset the open device so it reloads its eeprom
+ *
+ * The device stays open, although it may enumerate again.
+ * Returns FLASH_OK, FLASH_NO_DEVICE or FLASH_FAILED.
+ **/
+int flash_session_reset(struct flash_session *s)
+{
+	int f;
+
+	if ((f = session_begin(s, 1)) != FLASH_OK)
+		return f;
+	f = fdev_reset(&s->dev);
+	stats_phase(s->st, PHASE_RESET);
+	if (f)
+		return session_fail(s, FLASH_FAILED, ftdi_get_error_string(s->ftdi));
+
+	return FLASH_OK;
+}
@@ -0,0 +1,143 @@
+/***************************************************************************
+                          ftdiflash.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ libftdiflash: the flash, read, erase and decode logic of ftdi-flash-tool
+ as a library.  Nothing in it exits the process; every operation returns
+ a status and errors are also reported through the log callback.
+
+ A flash_session keeps one ftdi_context, and with it the libusb context,
+ a parsed configuration and an opened device across any number of
+ operations, so a test station can program unit after unit in-process:
+
+	struct flash_session *s = flash_session_new();
+	struct flash_options fopts = { 0 };
+
+	flash_session_config(s, "product.conf");
+	while (next_unit()) {
+		if (flash_session_open(s, NULL) == FLASH_OK)
+			result = flash_session_program(s, &fopts);
+		flash_session_close(s);
+	}
+	flash_session_free(s);
+ */
+
+#ifndef FTDIFLASH_H
+#define FTDIFLASH_H
+
+#include <confuse.h>
+
+#include "ftdi_dev.h"
+#include "stats.h"
+#include "bundle.h"
+#include "profile.h"
+#include "dev_lock.h"
+
+/**
+ * @brief flash_build_image() result when libftdi rejects a setting
+ **/
+#define FLASH_BUILD_REJECTED (-10)
+
+/**
+ * @brief Results of the flash and session operations
+ **/
+enum flash_result {
+	FLASH_OK = 0,
+	FLASH_FAILED,           /**< see flash_session_error() */
+	FLASH_VERIFY_FAILED,    /**< written, but the eeprom does not read back as expected */
+	FLASH_NO_DEVICE,        /**< no device is open, or none matched */
+	FLASH_NO_CONFIG,        /**< no configuration loaded, or it could not be */
+	FLASH_BUSY,             /**< the device is locked by another process */
+	FLASH_MISMATCH          /**< the device does not hold the expected image */
+};
+
+/**
+ * @brief Ways of checking the eeprom after writing
+ **/
+enum verify_mode {
+	VERIFY_NONE = 0,
+	VERIFY_WRITTEN,     /**< read back the words that were written */
+	VERIFY_FULL,        /**< read back the whole eeprom in one pass */
+	VERIFY_CHECKSUM     /**< read back only the checksum word */
+};
+
+/**
+ * @brief Options controlling how a device is flashed
+ **/
+struct flash_options {
+	int decode;     /**< decode the eeprom after writing */
+	int debug;      /**< include a hexdump when decoding */
+	int force;      /**< write every word, even unchanged ones */
+	int verify;     /**< enum verify_mode to apply after writing */
+	int stats;      /**< print per-device statistics as JSON */
+	int reenum_ms;  /**< wait that long for the device to return after reset, 0 not to wait */
+	const struct bundle *bundle;    /**< take images from this bundle instead of building them */
+	const char *key;                /**< bundle key, NULL for the unit's serial */
+	int no_reset;                   /**< leave the reset after writing to flash_session_reset() */
+};
+
+/**
+ * @brief Kinds of log messages
+ **/
+enum flash_log_level {
+	FLASH_LOG_INFO = 0,     /**< progress, printed to stdout by default */
+	FLASH_LOG_ERROR         /**< failures, printed to stderr by default */
+};
+
+/**
+ * @brief Receiver of log messages, see flash_set_log()
+ *
+ * msg is one or more complete lines, each ending in a newline.
+ **/
+typedef void (*flash_log_fn)(void *arg, int level, const char *msg);
+
+void flash_set_log(flash_log_fn fn, void *arg);
+void flash_log(int level, const char *fmt, ...);
+
+cfg_t *flash_config_load(const char *filename);
+int flash_load_image(const char *filename, unsigned char *buf, int len);
+int flash_locate(struct fdev *dev, struct ftdi_context *ftdi, const struct fdev_match *m, struct run_stats *st);
+int flash_build_image(struct fdev *dev, cfg_t *cfg, int chip, char *serial, unsigned char *buf, int *size, struct run_stats *st);
+int flash_device(struct fdev *dev, cfg_t *cfg, const struct flash_options *fopts, struct run_stats *st);
+int flash_image(struct fdev *dev, const unsigned char *image, int size, const struct flash_options *fopts, struct run_stats *st);
+int flash_check(struct fdev *dev, cfg_t *cfg, struct run_stats *st);
+int flash_decode(struct ftdi_context *ftdi, int size, int debug);
+
+struct flash_session;
+
+struct flash_session *flash_session_new(void);
+void flash_session_free(struct flash_session *s);
+const char *flash_session_error(const struct flash_session *s);
+void flash_session_set_stats(struct flash_session *s, struct run_stats *st);
+struct ftdi_context *flash_session_ftdi(struct flash_session *s);
+struct fdev *flash_session_device(struct flash_session *s);
+cfg_t *flash_session_cfg(struct flash_session *s);
+const struct profile_index *flash_session_profiles(struct flash_session *s);
+const struct profile *flash_session_match(struct flash_session *s);
+
+int flash_session_config(struct flash_session *s, const char *filename);
+int flash_session_profile(struct flash_session *s, const char *name);
+int flash_session_open(struct flash_session *s, const struct fdev_match *m);
+int flash_session_close(struct flash_session *s);
+int flash_session_read(struct flash_session *s, unsigned char *buf, int *size);
+int flash_session_decode(struct flash_session *s, int size, int debug);
+int flash_session_program(struct flash_session *s, const struct flash_options *fopts);
+int flash_session_write(struct flash_session *s, const unsigned char *image, int size, const struct flash_options *fopts);
+int flash_session_verify(struct flash_session *s);
+int flash_session_check(struct flash_session *s);
+int flash_session_erase(struct flash_session *s);
+int flash_session_reset(struct flash_session *s);
+
+#endif /* FTDIFLASH_H */
@@ -0,0 +1,268 @@
+/***************************************************************************
+                           hotplug.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ A hotplug monitor queues device arrivals for the daemon mode.  Arrivals
+ either come from libusb hotplug callbacks or, as a stand-in for real
+ hardware, from a thread generating a fixed number of simulated events.
+ Both feed the same queue, so the daemon can't tell them apart.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "hotplug.h"
+
+#define MAX_CALLBACKS 4
+
+struct hotplug_item {
+	struct hotplug_event ev;
+	struct hotplug_item *next;
+};
+
+struct hotplug_monitor {
+	struct libusb_context *ctx;             /**< NULL for a simulated monitor */
+	libusb_hotplug_callback_handle handles[MAX_CALLBACKS];
+	int n_handles;
+	int sim_count, sim_interval_ms;
+	int seq;
+	volatile int stop;
+	pthread_t thread;
+	int running;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct hotplug_item *head, *tail;
+};
+
+/**
+ * @brief Append an arrival to the queue of a monitor
+ **/
+static void push_event(struct hotplug_monitor *mon, struct libusb_device *dev)
+{
+	struct hotplug_item *item = calloc(1, sizeof(*item));
+
+	if (item == NULL)
+		return;
+	item->ev.dev = dev ? libusb_ref_device(dev) : NULL;
+	clock_gettime(CLOCK_MONOTONIC, &item->ev.arrived);
+
+	pthread_mutex_lock(&mon->lock);
+	item->ev.seq = ++mon->seq;
+	if (mon->tail)
+		mon->tail->next = item;
+	else
+		mon->head = item;
+	mon->tail = item;
+	pthread_cond_signal(&mon->cond);
+	pthread_mutex_unlock(&mon->lock);
+}
+
+/**
+ * @brief libusb hotplug callback queueing arrivals
+ **/
+static int LIBUSB_CALL arrived_cb(struct libusb_context *ctx, struct libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		push_event(user_data, dev);
+	return 0;
+}
+
+/**
+ * @brief Thread running the libusb event loop of a monitor
+ **/
+static void *usb_thread(void *arg)
+{
+	struct hotplug_monitor *mon = arg;
+	struct timeval tv = { 0, 100000 };
+
+	while (!mon->stop)
+		libusb_handle_events_timeout_completed(mon->ctx, &tv, NULL);
+	return NULL;
+}
+
+/**
+ * @brief Thread generating simulated arrivals
+ **/
+static void *sim_thread(void *arg)
+{
+	struct hotplug_monitor *mon = arg;
+	struct timespec delay;
+	int i;
+
+	delay.tv_sec = mon->sim_interval_ms / 1000;
+	delay.tv_nsec = (mon->sim_interval_ms % 1000) * 1000000L;
+	for (i = 0; i < mon->sim_count && !mon->stop; i++) {
+		nanosleep(&delay, NULL);
+		push_event(mon, NULL);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Allocate and initialise an empty monitor
+ **/
+static struct hotplug_monitor *monitor_new(void)
+{
+	struct hotplug_monitor *mon = calloc(1, sizeof(*mon));
+
+	if (mon == NULL)
+		return NULL;
+	pthread_mutex_init(&mon->lock, NULL);
+	pthread_cond_init(&mon->cond, NULL);
+	return mon;
+}
+
+/**
+ * @brief Start watching for arriving devices
+ *
+ * \param ctx libusb context to register the hotplug callbacks with
+ * \param ids vid/pid pairs to watch for
+ * \param n_ids number of pairs in ids, at most 4 are used
+ *
+ * Devices already attached are not reported.  Function returns the
+ * monitor, or NULL if hotplug is not supported on this platform.
+ **/
+struct hotplug_monitor *hotplug_start(struct libusb_context *ctx, int ids[][2], int n_ids)
+{
+	struct hotplug_monitor *mon;
+	int i;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		fprintf(stderr, "libusb has no hotplug support on this platform\n");
+		return NULL;
+	}
+	if ((mon = monitor_new()) == NULL)
+		return NULL;
+	mon->ctx = ctx;
+
+	for (i = 0; i < n_ids && mon->n_handles < MAX_CALLBACKS; i++) {
+		if (libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+				LIBUSB_HOTPLUG_NO_FLAGS, ids[i][0], ids[i][1], LIBUSB_HOTPLUG_MATCH_ANY,
+				arrived_cb, mon, &mon->handles[mon->n_handles]) == 0)
+			mon->n_handles++;
+	}
+	if (mon->n_handles == 0 || pthread_create(&mon->thread, NULL, usb_thread, mon)) {
+		fprintf(stderr, "Unable to register hotplug callbacks\n");
+		hotplug_stop(mon);
+		return NULL;
+	}
+	mon->running = 1;
+
+	return mon;
+}
+
+/**
+ * @brief Start a simulated monitor
+ *
+ * \param count number of arrivals to generate
+ * \param interval_ms delay before each arrival
+ *
+ * Simulated arrivals carry no device.  Function returns the monitor
+ * or NULL on error.
+ **/
+struct hotplug_monitor *hotplug_start_sim(int count, int interval_ms)
+{
+	struct hotplug_monitor *mon;
+
+	if ((mon = monitor_new()) == NULL)
+		return NULL;
+	mon->sim_count = count;
+	mon->sim_interval_ms = interval_ms;
+	if (pthread_create(&mon->thread, NULL, sim_thread, mon)) {
+		hotplug_stop(mon);
+		return NULL;
+	}
+	mon->running = 1;
+
+	return mon;
+}
+
+/**
+ * @brief Wait for the next arrival
+ *
+ * \param mon monitor to wait on
+ * \param ev receives the arrival; the caller owns the device reference
+ * \param timeout_ms how long to wait
+ *
+ * Function returns 0 if an arrival was dequeued, 1 on timeout and -1
+ * when a simulated monitor has delivered all of its events.
+ **/
+int hotplug_wait(struct hotplug_monitor *mon, struct hotplug_event *ev, int timeout_ms)
+{
+	struct hotplug_item *item;
+	struct timespec until;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += timeout_ms / 1000;
+	until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (until.tv_nsec >= 1000000000L) {
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&mon->lock);
+	while (mon->head == NULL && ret == 0) {
+		if (mon->ctx == NULL && mon->seq >= mon->sim_count)
+			ret = -1;
+		else if (pthread_cond_timedwait(&mon->cond, &mon->lock, &until) == ETIMEDOUT)
+			ret = 1;
+	}
+	if (mon->head) {
+		item = mon->head;
+		mon->head = item->next;
+		if (mon->head == NULL)
+			mon->tail = NULL;
+		*ev = item->ev;
+		free(item);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&mon->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Stop a monitor and release it
+ *
+ * \param mon monitor to stop
+ *
+ * Arrivals still queued are dropped.
+ **/
+void hotplug_stop(struct hotplug_monitor *mon)
+{
+	struct hotplug_item *item;
+	int i;
+
+	mon->stop = 1;
+	for (i = 0; i < mon->n_handles; i++)
+		libusb_hotplug_deregister_callback(mon->ctx, mon->handles[i]);
+	if (mon->running)
+		pthread_join(mon->thread, NULL);
+
+	while ((item = mon->head)) {
+		mon->head = item->next;
+		if (item->ev.dev)
+			libusb_unref_device(item->ev.dev);
+		free(item);
+	}
+	pthread_mutex_destroy(&mon->lock);
+	pthread_cond_destroy(&mon->cond);
+	free(mon);
+}
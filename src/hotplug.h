@@ -0,0 +1,38 @@
+/***************************************************************************
+                           hotplug.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+
+/**
+ * @brief A device arrival reported by a hotplug monitor
+ **/
+struct hotplug_event {
+	struct libusb_device *dev;  /**< referenced device, NULL when simulated */
+	int seq;                    /**< arrival number, starting at 1 */
+	struct timespec arrived;    /**< CLOCK_MONOTONIC time of the arrival */
+};
+
+struct hotplug_monitor;
+
+struct hotplug_monitor *hotplug_start(struct libusb_context *ctx, int ids[][2], int n_ids);
+struct hotplug_monitor *hotplug_start_sim(int count, int interval_ms);
+int hotplug_wait(struct hotplug_monitor *mon, struct hotplug_event *ev, int timeout_ms);
+void hotplug_stop(struct hotplug_monitor *mon);
+
+#endif /* HOTPLUG_H */
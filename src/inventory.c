@@ -0,0 +1,110 @@
+/***************************************************************************
+                          inventory.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Output of the scan command.  Device strings come straight from the
+ eeprom, so they are escaped for the output format.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "inventory.h"
+
+/**
+ * @brief Print a string as a JSON string literal
+ **/
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/**
+ * @brief Print a string as a CSV field, quoted if it needs to be
+ **/
+static void csv_field(FILE *f, const char *s)
+{
+	if (strpbrk(s, ",\"\r\n") == NULL) {
+		fputs(s, f);
+		return;
+	}
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"')
+			fputc('"', f);
+		fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/**
+ * @brief Print scan results as a single line of JSON
+ *
+ * \param f stream to print to
+ * \param e scan results
+ * \param n number of results
+ **/
+void inventory_print_json(FILE *f, const struct inventory_entry *e, int n)
+{
+	int i;
+
+	fprintf(f, "{\"devices\":[");
+	for (i = 0; i < n; i++) {
+		fprintf(f, "%s{\"path\":", i ? "," : "");
+		json_string(f, e[i].path);
+		fprintf(f, ",\"vid\":\"%04x\",\"pid\":\"%04x\",\"manufacturer\":", e[i].vid, e[i].pid);
+		json_string(f, e[i].manufacturer);
+		fprintf(f, ",\"product\":");
+		json_string(f, e[i].product);
+		fprintf(f, ",\"serial\":");
+		json_string(f, e[i].serial);
+		fprintf(f, ",\"chip\":\"%s\",\"eeprom_size\":%d,\"checksum\":\"%s\",\"status\":\"%s\"}",
+			e[i].chip, e[i].eeprom_size, e[i].checksum, e[i].status);
+	}
+	fprintf(f, "]}\n");
+}
+
+/**
+ * @brief Print scan results as CSV with a header line
+ *
+ * \param f stream to print to
+ * \param e scan results
+ * \param n number of results
+ **/
+void inventory_print_csv(FILE *f, const struct inventory_entry *e, int n)
+{
+	int i;
+
+	fprintf(f, "path,vid,pid,manufacturer,product,serial,chip,eeprom_size,checksum,status\n");
+	for (i = 0; i < n; i++) {
+		csv_field(f, e[i].path);
+		fprintf(f, ",%04x,%04x,", e[i].vid, e[i].pid);
+		csv_field(f, e[i].manufacturer);
+		fputc(',', f);
+		csv_field(f, e[i].product);
+		fputc(',', f);
+		csv_field(f, e[i].serial);
+		fprintf(f, ",%s,%d,%s,%s\n", e[i].chip, e[i].eeprom_size, e[i].checksum, e[i].status);
+	}
+}
@@ -0,0 +1,39 @@
+/***************************************************************************
+                          inventory.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+#include <stdio.h>
+
+/**
+ * @brief What a scan found out about one device
+ **/
+struct inventory_entry {
+	int vid, pid;
+	char path[32];                      /**< USB bus/port path */
+	char manufacturer[64];
+	char product[64];
+	char serial[64];
+	const char *chip;                   /**< chip type name */
+	int eeprom_size;                    /**< bytes, -1 if blank or unknown */
+	const char *checksum;               /**< "ok", "bad", "blank" or "unknown" */
+	const char *status;                 /**< "ok" or why the device could not be read */
+};
+
+void inventory_print_json(FILE *f, const struct inventory_entry *e, int n);
+void inventory_print_csv(FILE *f, const struct inventory_entry *e, int n);
+
+#endif /* INVENTORY_H */
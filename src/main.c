@@ -14,14 +14,6 @@
  *                                                                         *
  ***************************************************************************/
 
-/*
- TODO:
-		- Ability to find device by PID/VID, product name or serial
-
- TODO nice-to-have:
-    - Out-of-the-box compatibility with FTDI's eeprom tool configuration files
- */
-
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
@@ -29,347 +21,1390 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 #include <confuse.h>
 #include <libusb-1.0/libusb.h>
 #include <libftdi1/ftdi.h>
 #include <getopt.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "serial_alloc.h"
+#include "hotplug.h"
+#include "stats.h"
+#include "ftdi_dev.h"
+#include "ftdi_emu.h"
+#include "backup.h"
+#include "inventory.h"
+#include "eeprom_image.h"
+#include "bundle.h"
+#include "ftdiflash.h"
+#include "script.h"
+#include "dev_lock.h"
+
+/* Where --stats=json goes, never stdout so it can't mix with the results */
+static FILE *stats_out;
 
 /**
- * @brief Convert driver options strings to a value
+ * @brief Display usage information
  *
- * \param str pointer to driver option string to convert
+ * \param prog_name pointer command line program name
+ *         usually argv[0].
  *
- * Function will return the value of the option string.
- * This is used to determine the correct values to set for
- * drivers.
- * 
+ * Function will provide a short summary of program usage
+ * to the command line.
  **/
-static int str_to_drvr(char *str) {
-	const int max_options = 4;
-	int cmp_len=0,i;
-	const char* options[] = { "D2XX", "VCP", "RS485" };
-	
-	for(i = 0; i < max_options; i++) {
-		cmp_len = (strlen(str) >= strlen(options[i])) ? strlen(options[i]) : strlen(str);
-		if(!strncmp(str,options[i],cmp_len)) break;
+static void usage(char *prog_name)
+{
+	printf("%s <command> [options]\n",prog_name);
+	printf("commands (must choose one):\n");
+	printf("-h\t\t\tthis help.\n");
+	printf("-b <archive>\t\tback up the eeprom of every attached device into <archive>.\n");
+	printf("-c <script>\t\trun the commands of <script> ('-' for stdin) in one session, e.g.\n");
+	printf("\t\t\t'open serial=X; flash cfg=Y; verify; close'.  Commands are open,\n");
+	printf("\t\t\tclose, config, flash, write, read, verify, check, erase, reset and\n");
+	printf("\t\t\tquit; flash and write leave the reset to the reset command;\n");
+	printf("\t\t\teach prints one '<command> <status> ms=<time> ...' line.\n");
+	printf("-e\t\t\terase configuration eeprom.\n");
+	printf("-f <config filename>\tprogram configuration eeprom using <config filename>,\n");
+	printf("\t\t\teither a configuration file or an FT_Prog xml template.  Each\n");
+	printf("\t\t\tdevice gets the profile \"<name>\" { ... } section of the file\n");
+	printf("\t\t\tprogrammed with, or targeting, its vid/pid.\n");
+	printf("-k <config filename>\tcheck, without writing, whether the eeprom already holds the\n");
+	printf("\t\t\timage of <config filename>; a serial number template is\n");
+	printf("\t\t\tfilled in with the device's serial.  Exits with 0 if it does, 1\n");
+	printf("\t\t\tif not, 2 without a matching device and 3 on other errors.\n");
+	printf("-g <config filename>\tgenerate ready-to-flash images without a device, one\n");
+	printf("\t\t\t<serial>.bin per serial in the -o directory (default current).\n");
+	printf("-r <config binary>\tread configuration eeprom and write it to <config binary>.\n");
+	printf("-s\t\t\tlist every FTDI device with its strings, chip and eeprom checksum,\n");
+	printf("\t\t\tto the -o file if given.\n");
+	printf("-w <image>\t\twrite raw eeprom <image> ('-' for stdin) without a configuration.\n");
+	printf("options:\n");
+	printf("-a\t\t\tflash all matching devices in parallel (with -f).\n");
+	printf("-H\t\t\tstay resident and flash devices as they are plugged in (with -f).\n");
+	printf("-T <count>\t\tfeed <count> simulated arrivals to -H instead of USB events.\n");
+	printf("-o <filename>\t\twrite binary configuration to <filename> after read command.\n");
+	printf("-d\t\t\tread and decode eeprom.\n");
+	printf("-D\t\t\tdisplay hexdump of eeprom during decoding.\n");
+	printf("-F\t\t\twrite every eeprom word, even those already matching.\n");
+	printf("-p <pid>\t\tuse pid <pid> for operation.\n");
+	printf("-v <vid>\t\tuse vid <vid> for operation.\n");
+	printf("--verify[=<how>]\tread the eeprom back after writing, <how> is one of\n");
+	printf("\t\t\twritten (default, changed words only), full or checksum.\n");
+	printf("--wait-reenum[=<ms>]\tafter the reset, wait up to <ms> (default 5000) for the device\n");
+	printf("\t\t\tto enumerate again and reopen it by its USB path.\n");
+	printf("--stats=json[:<file>]\tprint per-phase timing and USB transfer counts as JSON\n");
+	printf("\t\t\tto <file>, or to stderr.\n");
+	printf("--serial=<serial>\tonly use the device with this serial string.\n");
+	printf("--product=<product>\tonly use devices with this product string.\n");
+	printf("--path=<bus-port>\tonly use the device at this USB path, e.g. 1-2.3.\n");
+	printf("--index=<n>\t\tuse the n-th matching device, counting from 0.\n");
+	printf("--ids=<vid:pid>[,...]\tlet -s look for these ids besides the default FTDI ones.\n");
+	printf("--format=<json|csv>\toutput format of -s (default json).\n");
+	printf("--chip=<type>[:<eeprom>]\tchip to generate images for with -g, e.g. R or 2232H:56.\n");
+	printf("--serials=<first>-<last>\tgenerate images for this range of the serial template.\n");
+	printf("--manifest=<file>\tgenerate images for the serials listed in <file>, one per line.\n");
+	printf("--bundle=<file>\t\twith -g write every image into one indexed <file>; with -f flash\n");
+	printf("\t\t\tthe image stored in <file> under the unit's serial number.\n");
+	printf("--key=<id>\t\tflash the bundle image stored under <id> instead.\n");
+	printf("--profile=<name>\tprofile for devices no profile or several profiles claim,\n");
+	printf("\t\t\tsuch as blank ones; with -g the profile to generate.\n");
+	printf("-j <workers>\t\tthreads used by -g (default one per processor).\n");
+	printf("--lock-wait=<ms>\twait up to <ms> for a device another process has locked,\n");
+	printf("\t\t\t0 to give up at once (default: wait as long as it takes; -s\n");
+	printf("\t\t\tnever waits).\n");
+	printf("--lock-dir=<dir>\tkeep the per-device lock files in <dir> (default %s),\n", DEV_LOCK_DIR);
+	printf("\t\t\tempty not to lock devices at all.\n");
+	printf("--pipeline=<n>\t\tkeep up to <n> eeprom transfers in flight (default %d, 1 to\n", FDEV_PIPELINE_DEPTH);
+	printf("\t\t\ttransfer one word at a time like libftdi).\n");
+	printf("--emulate=<opts>\tuse in-memory emulated devices instead of USB, <opts> is a\n");
+	printf("\t\t\tcomma separated list such as chip=66,count=4,write_us=300,rtt_us=125.\n");
+	printf("NOTE 1: FTDI default vid is 0x403 and default pid is 0x6001\n");
+	printf("      All other vid and pid values should be specified in the configuration file\n");
+	printf("      or on the command line with -v and -p.\n");
+	printf("NOTE 2: -o option is equivalent to 'filename' configuration file parameter, but for reading.\n");
+	exit(-1);
+}
+
+/**
+ * @brief Per-device state for a parallel flash run
+ **/
+struct flash_job {
+	struct fdev_info info;      /**< device to program, owned by the scan list */
+	cfg_t *cfg;                 /**< shared, read-only profile settings, NULL if none matched */
+	const char *profile;        /**< profile name, NULL for the file level */
+	const struct flash_options *fopts;
+	char path[32];              /**< USB bus/port path */
+	char serial[64];            /**< serial string reported before flashing */
+	int open_retries;           /**< extra open attempts for devices still settling */
+	int reset;                  /**< the device was reset, so it enumerates again */
+	const char *status;         /**< short result text for the report */
+	int result;                 /**< 0 on success */
+	struct run_stats stats;
+	pthread_t thread;
+	int started;
+};
+
+/**
+ * @brief Open a device found by a scan of another ftdi_context
+ *
+ * \param dev device to initialize
+ * \param ftdi context of the calling worker
+ * \param info device from the scan
+ *
+ * The device is looked up again by its ids and path in ftdi, so its
+ * handle belongs to the libusb context the worker's transfers are
+ * completed in.  Returns what fdev_select() returns.
+ **/
+static int job_open(struct fdev *dev, struct ftdi_context *ftdi, const struct fdev_info *info)
+{
+	struct fdev_match m;
+
+	memset(&m, 0, sizeof(m));
+	fdev_match_add(&m, info->vid, info->pid);
+	m.path = info->path;
+
+	return fdev_select(dev, ftdi, &m);
+}
+
+/**
+ * @brief Thread entry flashing a single device of a parallel run
+ *
+ * \param arg pointer to the struct flash_job to process
+ *
+ * Every worker opens the device with its own ftdi_context so a
+ * failing unit never disturbs the others.
+ **/
+static void *flash_worker(void *arg)
+{
+	struct flash_job *job = arg;
+	struct ftdi_context *ftdi;
+	struct fdev dev;
+	const struct timespec settle = { 0, 50000000L };
+	int f, tries = job->open_retries;
+
+	stats_start(&job->stats);
+	job->result = 1;
+
+	if (job->cfg == NULL) {
+		job->status = "no profile";
+		goto done;
 	}
+	if ((ftdi = ftdi_new()) == NULL) {
+		job->status = "no memory";
+		goto done;
+	}
+	for (;;) {
+		if ((f = job_open(&dev, ftdi, &job->info)) >= 0 || f == FDEV_LOCKED || tries-- <= 0)
+			break;
+		nanosleep(&settle, NULL);
+	}
+	stats_phase(&job->stats, PHASE_OPEN);
 
-	return i;
+	if (f < 0) {
+		job->status = f == FDEV_LOCKED ? "busy" : "open failed";
+	} else {
+		strcpy(job->serial, dev.serial);
+		job->result = flash_device(&dev, job->cfg, job->fopts, &job->stats);
+		job->status = job->result == 2 ? "VERIFY FAILED" : job->result ? "FAILED" : "ok";
+		job->reset = dev.resets > 0;
+		fdev_close(&dev);
+		stats_usb(&job->stats, dev.transfers);
+	}
+	ftdi_free(ftdi);
+
+done:
+	strcpy(job->stats.device, job->path);
+	stats_finish(&job->stats, job->result);
+	return NULL;
+}
+
+/**
+ * @brief Give a job the profile matching its device
+ **/
+static void job_profile(struct flash_job *job, const struct profile_index *profiles)
+{
+	const struct profile *p = profile_match(profiles, job->info.vid, job->info.pid);
+
+	job->cfg = p ? p->cfg : NULL;
+	job->profile = p ? p->name : NULL;
 }
 
 /**
- * @brief Convert CBUS options strings to an index
+ * @brief vid/pid pairs of the devices a configuration can program
  *
- * \param str pointer to CBUS option string to index
- * \param max_allowed last CBUS option to allow in returned index
+ * \param profiles profiles of the configuration
+ * \param option_vid vid given on the command line
+ * \param option_pid pid given on the command line
+ * \param ids receives the distinct pairs, room for FDEV_MATCH_IDS
  *
- * Function will return 0 if no options are found.  A message
- * will be sent to the terminal.
+ * Devices already programmed as a profile come first, then the
+ * command line ids, then the target ids of blank devices.
+ * Returns the number of pairs.
  **/
-static int str_to_cbus(char *str, int max_allowed)
+static int profile_scan_ids(const struct profile_index *profiles, int option_vid, int option_pid, int ids[][2])
 {
-    #define MAX_OPTION 14
-    const char* options[MAX_OPTION] = {
-     "TXDEN", "PWREN", "RXLED", "TXLED", "TXRXLED", "SLEEP",
-     "CLK48", "CLK24", "CLK12", "CLK6",
-     "IO_MODE", "BITBANG_WR", "BITBANG_RD", "SPECIAL"};
-    int i;
-    max_allowed += 1;
-    if (max_allowed > MAX_OPTION) max_allowed = MAX_OPTION;
-    for (i=0; i<max_allowed; i++) {
-        if (!(strcmp(options[i], str))) {
-            return i;
-        }
-    }
-    printf("WARNING: Invalid cbus option '%s'\n", str);
-    return 0;
+	struct fdev_match m;
+	int found[FDEV_MATCH_IDS][2];
+	int i, n;
+
+	memset(&m, 0, sizeof(m));
+	n = profile_ids(profiles, 0, found, FDEV_MATCH_IDS);
+	for (i = 0; i < n; i++)
+		fdev_match_add(&m, found[i][0], found[i][1]);
+	fdev_match_add(&m, option_vid, option_pid);
+	n = profile_ids(profiles, 1, found, FDEV_MATCH_IDS);
+	for (i = 0; i < n; i++)
+		fdev_match_add(&m, found[i][0], found[i][1]);
+	memcpy(ids, m.ids, sizeof(m.ids));
+
+	return m.n_ids;
 }
 
 /**
- * @brief Set eeprom value
+ * @brief Flash every attached device matching the configuration in parallel
  *
- * \param ftdi pointer to ftdi_context
- * \param value_name Enum of the value to set
- * \param value Value to set
+ * \param ftdi pointer to ftdi_context used for enumeration
+ * \param profiles profiles of the parsed configuration
+ * \param option_vid vid given on the command line
+ * \param option_pid pid given on the command line
+ * \param fopts flash options applied to every device
  *
- * Function will abort the program on error
+ * Function looks for devices under the vid/pid and target vid/pid of
+ * every profile and the command line vid/pid, flashes all of them at
+ * the same time, each with the profile matching it, and prints a
+ * per-device result table.
+ * Returns the number of devices that failed, or -1 if none was found
+ * or memory ran out.
  **/
-static void eeprom_set_value(struct ftdi_context *ftdi, enum ftdi_eeprom_value value_name, int value)
+static int flash_all_devices(struct ftdi_context *ftdi, const struct profile_index *profiles, int option_vid, int option_pid, const struct flash_options *fopts)
 {
-    if (ftdi_set_eeprom_value(ftdi, value_name, value) < 0)
-    {
-        printf("Unable to set eeprom value %d: %s. Aborting\n", value_name, ftdi_get_error_string(ftdi));
-        exit (-1);
-    }
+	int ids[FDEV_MATCH_IDS][2];
+	struct fdev_info *lists[FDEV_MATCH_IDS] = { NULL }, *cur;
+	int n_lists[FDEV_MATCH_IDS] = { 0 };
+	struct flash_job *jobs = NULL, *more;
+	int count = 0, failed = 0;
+	int i, j, k, n;
+
+	n = profile_scan_ids(profiles, option_vid, option_pid, ids);
+	for (i = 0; i < n; i++) {
+		if ((n_lists[i] = fdev_scan(ftdi, ids[i][0], ids[i][1], &lists[i])) < 0)
+			n_lists[i] = 0;
+		for (k = 0; k < n_lists[i]; k++) {
+			cur = &lists[i][k];
+			for (j = 0; j < count; j++)
+				if (!strcmp(jobs[j].path, cur->path)) break;
+			if (j < count)
+				continue;
+			if ((more = realloc(jobs, (count + 1) * sizeof(*jobs))) == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				failed = -1;
+				goto done;
+			}
+			jobs = more;
+			memset(&jobs[count], 0, sizeof(*jobs));
+			jobs[count].info = *cur;
+			job_profile(&jobs[count], profiles);
+			jobs[count].fopts = fopts;
+			strcpy(jobs[count].path, cur->path);
+			count++;
+		}
+	}
+
+	if (count == 0) {
+		printf("No matching FTDI devices found\n");
+		failed = -1;
+		goto done;
+	}
+
+	printf("Flashing %d devices in parallel...\n", count);
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&jobs[i].thread, NULL, flash_worker, &jobs[i])) {
+			jobs[i].status = "no thread";
+			jobs[i].result = 1;
+		} else {
+			jobs[i].started = 1;
+		}
+	}
+	for (i = 0; i < count; i++)
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+
+	printf("\n%-4s %-16s %-24s %-16s %-12s %10s\n", "#", "Path", "Serial", "Profile", "Result", "Time (ms)");
+	for (i = 0; i < count; i++) {
+		printf("%-4d %-16s %-24s %-16s %-12s %10.1f\n", i, jobs[i].path,
+			jobs[i].serial[0] ? jobs[i].serial : "-", jobs[i].profile ? jobs[i].profile : "-",
+			jobs[i].status, jobs[i].stats.total_ms);
+		if (jobs[i].result)
+			failed++;
+	}
+	printf("%d of %d devices flashed successfully.\n", count - failed, count);
+	for (i = 0; i < count && jobs[i].cfg; i++)
+		;
+	if (i < count)
+		printf("Devices no single profile claims need --profile=<name>.\n");
+
+	if (fopts->stats) {
+		struct run_stats *runs = malloc(count * sizeof(*runs));
+		if (runs) {
+			for (i = 0; i < count; i++)
+				runs[i] = jobs[i].stats;
+			stats_print_json(stats_out, runs, count);
+			free(runs);
+		}
+	}
+
+done:
+	free(jobs);
+	for (i = 0; i < n; i++)
+		fdev_scan_free(lists[i], n_lists[i]);
+	return failed;
 }
 
 /**
- * @brief Get eeprom value
+ * @brief One image of an offline generation run
+ **/
+struct gen_job {
+	char serial[128];           /**< serial string put in the image */
+	int result;                 /**< 0 on success, else what ftdi_eeprom_build() said */
+	unsigned char image[FTDI_MAX_EEPROM_SIZE];  /**< kept for a bundle */
+	int size;
+};
+
+/**
+ * @brief Shared state of an offline generation run
+ **/
+struct gen_run {
+	cfg_t *cfg;                 /**< shared, read-only configuration */
+	int type;                   /**< ftdi_chip_type selecting the eeprom layout */
+	int chip;                   /**< eeprom type, 0 for an internal one */
+	const char *outdir;         /**< directory receiving <serial>.bin */
+	const char *bundle;         /**< bundle receiving every image instead, or NULL */
+	struct gen_job *jobs;
+	int count;
+	int next;                   /**< next job to hand out */
+};
+
+/**
+ * @brief Build one image without a device
  *
- * \param ftdi pointer to ftdi_context
- * \param value_name Enum of the value to get
- * \param value Value to get
+ * \param run generation run the image belongs to
+ * \param ftdi context of the calling thread
+ * \param serial serial string to put in the image
+ * \param buf buffer of FTDI_MAX_EEPROM_SIZE bytes receiving the image
+ * \param size receives the size of the image in bytes
  *
- * Function will abort the program on error
+ * Returns what flash_build_image() returns.
  **/
-static void eeprom_get_value(struct ftdi_context *ftdi, enum ftdi_eeprom_value value_name, int *value)
+static int gen_build(const struct gen_run *run, struct ftdi_context *ftdi, char *serial, unsigned char *buf, int *size)
 {
-    if (ftdi_get_eeprom_value(ftdi, value_name, value) < 0)
-    {
-        printf("Unable to get eeprom value %d: %s. Aborting\n", value_name, ftdi_get_error_string(ftdi));
-        exit (-1);
-    }
+	struct fdev dev;
+
+	memset(&dev, 0, sizeof(dev));
+	dev.ftdi = ftdi;
+	ftdi->type = run->type;
+	return flash_build_image(&dev, run->cfg, run->chip, serial, buf, size, NULL);
 }
 
 /**
- * @brief Detect eeprom type
+ * @brief Thread entry of an offline generation run
  *
- * \param ftdi pointer to ftdi_context
- * \param eeprom_type eeprom type to set if failure occurs
+ * \param arg pointer to the shared struct gen_run
  *
- * Function will return the eeprom type detected or
- * the eeprom_type if detection failed.
+ * Workers take the next image from the run until none is left, each
+ * with its own ftdi_context since building modifies its eeprom state.
  **/
-static int detect_eeprom(struct ftdi_context *ftdi, int eeprom_type) {
-	int i, f;
-	
-    f = ftdi_erase_eeprom(ftdi); /* needed to determine EEPROM chip type */
-    if (ftdi_get_eeprom_value(ftdi, CHIP_TYPE, &i) <0)
-    {
-        fprintf(stderr, "ftdi_get_eeprom_value: %d (%s)\n",
-                f, ftdi_get_error_string(ftdi));
-        fprintf(stderr, "using configuration value = 0x%02x\n",eeprom_type);
-        i = eeprom_type;
-    } else {
-		if (i == -1)
-			fprintf(stderr, "No EEPROM\n");
-		else if (i == 0)
-			fprintf(stderr, "Internal EEPROM\n");
-		else
-			fprintf(stderr, "Found 93x%02x\n", i);
-		if(i != eeprom_type && eeprom_type != 0) {
-			printf("Unmatched EEPROM type 0x%02x. Using configuration value = 0x%02x\n",i, eeprom_type);
-			i = eeprom_type;
+static void *gen_worker(void *arg)
+{
+	struct gen_run *run = arg;
+	struct ftdi_context *ftdi = ftdi_new();
+	unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+	char path[512];
+	struct gen_job *job;
+	FILE *fp;
+	int i, size, ok;
+
+	while ((i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->count) {
+		job = &run->jobs[i];
+		if (ftdi == NULL) {
+			job->result = -100;
+			continue;
+		}
+		job->result = gen_build(run, ftdi, job->serial, buf, &size);
+		if (job->result < 0)
+			continue;
+		if (run->bundle) {
+			memcpy(job->image, buf, size);
+			job->size = size;
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s.bin", run->outdir, job->serial);
+		if ((fp = fopen(path, "wb")) == NULL) {
+			job->result = -101;
+			continue;
+		}
+		ok = fwrite(buf, 1, size, fp) == (size_t)size;
+		if (fclose(fp) != 0 || !ok) {
+			remove(path);
+			job->result = -101;
 		}
 	}
+	if (ftdi)
+		ftdi_free(ftdi);
 
-	return i;
+	return NULL;
 }
 
 /**
- * @brief locate an ftdi device based on vid/pid values
- *
- * \param ftdi pointer to ftdi_context
- * \param primary_vid vid to try first
- * \param primary_pid pid to try first
- * \param fallback_vid vid to try if primary fails
- * \param fallback_pid pid to try if primary fails
- *
- * Function will attempt to locate the device with
- * primary_vid/primary_pid and fallback to fallback_vid/fallback_pid
- * if primary_vid/primary_pid can't be found.  Returns the
- * status of the ftdi_usb_open routine.
+ * @brief Add a serial to the list of images to generate
+ *
+ * Returns 0 on success, -1 if the serial can't be used as a file name
+ * or memory ran out.
  **/
-static int locate_ftdi_device(struct ftdi_context *ftdi, int primary_vid, int primary_pid, int fallback_vid, int fallback_pid)
+static int gen_add(struct gen_run *run, const char *serial)
 {
-	int i;
+	struct gen_job *jobs;
 
-	i = ftdi_usb_open(ftdi, primary_vid, primary_pid);
+	if (*serial == '\0' || strchr(serial, '/') || strlen(serial) >= sizeof(jobs->serial)) {
+		printf("Serial number '%s' can't be used as an image name.\n", serial);
+		return -1;
+	}
+	if ((run->count & (run->count - 1)) == 0) {
+		jobs = realloc(run->jobs, (run->count ? run->count * 2 : 64) * sizeof(*jobs));
+		if (jobs == NULL)
+			return -1;
+		run->jobs = jobs;
+	}
+	memset(&run->jobs[run->count], 0, sizeof(*jobs));
+	strcpy(run->jobs[run->count++].serial, serial);
 
-	if(i!=0) {
-		printf("Unable to find FTDI devices under given vendor/product id: 0x%X/0x%X\n", primary_vid, primary_pid);
-		printf("Error code: %d (%s)\n", i, ftdi_get_error_string(ftdi));
-		if(primary_vid != fallback_vid || primary_pid != fallback_pid) {
-			printf("Retrying with fallback vid=%#04x, pid=%#04x.\n", fallback_vid, fallback_pid);
+	return 0;
+}
 
-			i = ftdi_usb_open(ftdi, fallback_vid, fallback_pid);
-			if (i != 0)
-			{
-				printf("Error: %s\n", ftdi->error_str);
-			} else {
-				printf("Alternate device (%04x,%04x) located.\n",fallback_vid,fallback_pid);
+/**
+ * @brief Read the serials of a generation run from a manifest
+ *
+ * \param run generation run to add to
+ * \param manifest file with one serial per line, '-' for stdin
+ *
+ * Blank lines and lines starting with '#' are skipped.
+ * Returns 0 on success, -1 on error.
+ **/
+static int gen_read_manifest(struct gen_run *run, const char *manifest)
+{
+	FILE *fp = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+	char line[256], *p, *end;
+	int ret = 0;
+
+	if (fp == NULL) {
+		printf("Can't open manifest %s\n", manifest);
+		return -1;
+	}
+	while (ret == 0 && fgets(line, sizeof(line), fp)) {
+		for (p = line; isspace((unsigned char)*p); p++);
+		end = p + strlen(p);
+		while (end > p && isspace((unsigned char)end[-1]))
+			*--end = '\0';
+		if (*p == '\0' || *p == '#')
+			continue;
+		ret = gen_add(run, p);
+	}
+	if (fp != stdin)
+		fclose(fp);
+
+	return ret;
+}
+
+/**
+ * @brief Generate eeprom images for a batch of serials without a device
+ *
+ * \param cfg parsed configuration
+ * \param chip_spec chip type, e.g. "R" or "2232H", optionally followed
+ *         by ":" and the eeprom type, e.g. "2232H:56"
+ * \param range serial counter range "<first>-<last>" expanded with the
+ *         serial template of the configuration, or NULL
+ * \param manifest file listing the serials, or NULL
+ * \param outdir directory receiving one <serial>.bin per image
+ * \param bundle bundle file receiving all images instead, or NULL
+ * \param workers number of threads, 0 for one per processor
+ *
+ * Function first builds the image with the longest serial, so a string
+ * overflow stops the run before any image is written, then builds and
+ * writes all images in parallel.  A bundle is only written if every
+ * image could be built.
+ * Returns 0 if every image was written, 1 otherwise.
+ **/
+static int generate_images(cfg_t *cfg, const char *chip_spec, const char *range, const char *manifest,
+	const char *outdir, const char *bundle, int workers)
+{
+	struct gen_run run;
+	struct ftdi_context *ftdi;
+	struct timespec start, end;
+	unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+	char serial[128], *tmpl = cfg_getstr(cfg, "serial");
+	pthread_t *threads;
+	long first, last, n;
+	int i, size, longest = 0, done = 0, failed = 0;
+	size_t len;
+	char *p;
+
+	memset(&run, 0, sizeof(run));
+	run.cfg = cfg;
+	run.outdir = outdir ? outdir : ".";
+	run.bundle = bundle;
+	run.chip = cfg_getint(cfg, "eeprom_type");
+
+	for (run.type = 0; chip_spec; run.type++) {
+		len = strlen(image_chip_name(run.type));
+		if (!strcmp(image_chip_name(run.type), "unknown")) {
+			chip_spec = NULL;
+			break;
+		}
+		if (!strncasecmp(chip_spec, image_chip_name(run.type), len) &&
+				(chip_spec[len] == '\0' || chip_spec[len] == ':'))
+			break;
+	}
+	if (chip_spec == NULL) {
+		printf("Offline generation needs --chip=<AM|BM|2232C|R|2232H|4232H|232H|230X>[:<eeprom type>].\n");
+		return 1;
+	}
+	if ((p = strchr(chip_spec, ':')) != NULL)
+		run.chip = strtoul(p + 1, NULL, 16);
+	if (run.type == TYPE_R || run.type == TYPE_230X) {
+		run.chip = 0;
+	} else if (run.chip != 0x46 && run.chip != 0x56 && run.chip != 0x66) {
+		printf("The %s has an external eeprom, give its type as eeprom_type or --chip=%s:56.\n",
+			image_chip_name(run.type), image_chip_name(run.type));
+		return 1;
+	}
+
+	if (range != NULL) {
+		if (!serial_is_template(tmpl)) {
+			printf("A serial range needs a serial number template such as \"ACME-%%06d\".\n");
+			return 1;
+		}
+		first = strtol(range, &p, 0);
+		last = (*p == '-') ? strtol(p + 1, &p, 0) : first;
+		if (*p != '\0' || last < first) {
+			printf("Serial range '%s' is not <first>-<last>.\n", range);
+			return 1;
+		}
+		for (n = first; n <= last; n++) {
+			if (serial_format(tmpl, n, serial, sizeof(serial)) < 0) {
+				printf("Serial number template '%s' does not fit.\n", tmpl);
+				failed = 1;
+				break;
 			}
+			if ((failed = gen_add(&run, serial)) != 0)
+				break;
 		}
+	} else if (manifest != NULL) {
+		failed = gen_read_manifest(&run, manifest);
 	} else {
-		printf("Device (%04x,%04x) located.\n",primary_vid,primary_pid);
+		printf("Offline generation needs --serials=<first>-<last> or --manifest=<file>.\n");
+		return 1;
+	}
+	if (failed || run.count == 0) {
+		if (!failed)
+			printf("No serial numbers to generate images for.\n");
+		free(run.jobs);
+		return 1;
 	}
 
-	return i;
+	/* The longest serial decides whether the strings fit */
+	for (i = 1; i < run.count; i++)
+		if (strlen(run.jobs[i].serial) > strlen(run.jobs[longest].serial))
+			longest = i;
+	if (bundle == NULL && access(run.outdir, W_OK) != 0) {
+		printf("Can't write images to %s\n", run.outdir);
+		free(run.jobs);
+		return 1;
+	}
+	if ((ftdi = ftdi_new()) == NULL) {
+		free(run.jobs);
+		return 1;
+	}
+	i = gen_build(&run, ftdi, run.jobs[longest].serial, buf, &size);
+	ftdi_free(ftdi);
+	if (i < 0) {
+		if (i == -1)
+			printf("Sorry, the strings with serial '%s' do not fit into the eeprom of the %s.\n",
+				run.jobs[longest].serial, image_chip_name(run.type));
+		else
+			printf("ftdi_eeprom_build(): error: %d\n", i);
+		printf("No images written.\n");
+		free(run.jobs);
+		return 1;
+	}
+	printf("Generating %d images for the %s, %d bytes each, %d bytes unused with '%s'.\n",
+		run.count, image_chip_name(run.type), size, i, run.jobs[longest].serial);
+
+	if (workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > run.count)
+		workers = run.count;
+	if (workers < 1 || (threads = calloc(workers, sizeof(*threads))) == NULL) {
+		free(run.jobs);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < workers; i++)
+		if (pthread_create(&threads[i], NULL, gen_worker, &run))
+			break;
+	if (i == 0)
+		gen_worker(&run);
+	while (i > 0)
+		pthread_join(threads[--i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < run.count; i++) {
+		if (run.jobs[i].result >= 0) {
+			done++;
+			continue;
+		}
+		if (failed++ == 0)
+			printf("Failed:\n");
+		if (run.jobs[i].result == -1)
+			printf("  %s: strings do not fit\n", run.jobs[i].serial);
+		else if (run.jobs[i].result == -101)
+			printf("  %s: can't write %s/%s.bin\n", run.jobs[i].serial, run.outdir, run.jobs[i].serial);
+		else
+			printf("  %s: error %d\n", run.jobs[i].serial, run.jobs[i].result);
+	}
+	if (bundle && failed == 0) {
+		struct bundle_item *items = malloc(run.count * sizeof(*items));
+
+		for (i = 0; items && i < run.count; i++) {
+			items[i].key = run.jobs[i].serial;
+			items[i].image = run.jobs[i].image;
+			items[i].size = run.jobs[i].size;
+		}
+		if (items == NULL || (i = bundle_write(bundle, items, run.count)) == -1) {
+			printf("Can't write bundle %s\n", bundle);
+			failed = 1;
+		} else if (i == -2) {
+			printf("Bundle keys are serials of up to %d characters, each used once.\n", BUNDLE_KEY_LEN);
+			failed = 1;
+		}
+		free(items);
+		if (failed)
+			done = 0;
+	}
+	printf("Generated %d of %d images in %s in %.3f s using %d workers.\n", done, run.count,
+		bundle ? bundle : run.outdir,
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, workers);
+
+	free(threads);
+	free(run.jobs);
+	return failed ? 1 : 0;
 }
 
 /**
- * @brief Display usage information
+ * @brief Per-device state for a parallel backup run
+ **/
+struct backup_job {
+	struct fdev_info info;      /**< device to read, owned by the scan list */
+	struct backup_device dev;   /**< what goes into the archive */
+	unsigned char image[FTDI_MAX_EEPROM_SIZE];
+	const char *status;         /**< short result text for the report */
+	int result;                 /**< 0 on success */
+	struct run_stats stats;
+	pthread_t thread;
+	int started;
+};
+
+/**
+ * @brief Thread entry reading the eeprom of a single device of a backup run
  *
- * \param prog_name pointer command line program name
- *         usually argv[0].
+ * \param arg pointer to the struct backup_job to process
+ **/
+static void *backup_worker(void *arg)
+{
+	struct backup_job *job = arg;
+	struct ftdi_context *ftdi;
+	struct fdev dev;
+	int f, size;
+
+	stats_start(&job->stats);
+	job->result = 1;
+
+	if ((ftdi = ftdi_new()) == NULL) {
+		job->status = "no memory";
+		goto done;
+	}
+	if ((f = job_open(&dev, ftdi, &job->info)) < 0) {
+		job->status = f == FDEV_LOCKED ? "busy" : "open failed";
+		ftdi_free(ftdi);
+		goto done;
+	}
+	stats_phase(&job->stats, PHASE_OPEN);
+	strcpy(job->dev.serial, dev.serial);
+
+	if (fdev_read_eeprom(&dev, job->image, &size) < 0) {
+		job->status = "read failed";
+	} else {
+		/* A blank eeprom has no size, keep all of it */
+		job->dev.image = job->image;
+		job->dev.size = size > 0 ? size : FTDI_MAX_EEPROM_SIZE;
+		job->status = size > 0 ? "ok" : "ok (blank)";
+		job->result = 0;
+	}
+	stats_phase(&job->stats, PHASE_READ);
+	fdev_close(&dev);
+	stats_usb(&job->stats, dev.transfers);
+	ftdi_free(ftdi);
+
+done:
+	strcpy(job->stats.device, job->dev.path);
+	stats_finish(&job->stats, job->result);
+	return NULL;
+}
+
+/**
+ * @brief Back up the eeprom of every attached device in parallel
  *
- * Function will provide a short summary of program usage
- * to the command line.
+ * \param ftdi pointer to ftdi_context used for enumeration
+ * \param archive backup archive to add to
+ * \param option_vid vid given on the command line
+ * \param option_pid pid given on the command line
+ * \param stats print per-device statistics as JSON
+ *
+ * Function reads every device with a default FTDI vid/pid or the
+ * command line vid/pid at the same time, then records all images
+ * in the archive with a single append.
+ * Returns the number of devices that failed, or -1 if none was found,
+ * the archive could not be written or memory ran out.
  **/
-static void usage(char *prog_name)
+static int backup_all_devices(struct ftdi_context *ftdi, const char *archive, int option_vid, int option_pid, int stats)
 {
-	printf("%s <command> [options]\n",prog_name);
-	printf("commands (must choose one):\n");
-	printf("-h\t\t\tthis help.\n");
-	printf("-e\t\t\terase configuration eeprom.\n");
-	printf("-f <config filename>\tprogram configuration eeprom using <config filename>.\n");
-	printf("-r <config binary>\tread configuration eeprom and write it to <config binary>.\n");
-	printf("-s\t\t\tscan for default FTDI devices.\n");
-	printf("options:\n");
-	printf("-o <filename>\t\twrite binary configuration to <filename> after read command.\n");
-	printf("-d\t\t\tread and decode eeprom.\n");
-	printf("-D\t\t\tdisplay hexdump of eeprom during decoding.\n");
-	printf("-p <pid>\t\tuse pid <pid> for operation.\n");
-	printf("-v <vid>\t\tuse vid <vid> for operation.\n");
-	printf("NOTE 1: FTDI default vid is 0x403 and default pid is 0x6001\n");
-	printf("      All other vid and pid values should be specified in the configuration file\n");
-	printf("      or on the command line with -v and -p.\n");
-	printf("NOTE 2: -o option is equivalent to 'filename' configuration file parameter, but for reading.\n");
-	exit(-1);
+	int ids[2][2] = { { 0, 0 }, { option_vid, option_pid } };
+	struct fdev_info *lists[2] = { NULL, NULL }, *cur;
+	int n_lists[2] = { 0, 0 };
+	struct backup_job *jobs = NULL, *more;
+	struct backup_device *devs = NULL;
+	int count = 0, failed = 0, n_devs = 0, new_images;
+	int i, j, k;
+
+	for (i = 0; i < 2; i++) {
+		if ((n_lists[i] = fdev_scan(ftdi, ids[i][0], ids[i][1], &lists[i])) < 0)
+			n_lists[i] = 0;
+		for (k = 0; k < n_lists[i]; k++) {
+			cur = &lists[i][k];
+			for (j = 0; j < count; j++)
+				if (!strcmp(jobs[j].dev.path, cur->path)) break;
+			if (j < count)
+				continue;
+			if ((more = realloc(jobs, (count + 1) * sizeof(*jobs))) == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				failed = -1;
+				goto done;
+			}
+			jobs = more;
+			memset(&jobs[count], 0, sizeof(*jobs));
+			jobs[count].info = *cur;
+			jobs[count].dev.vid = cur->vid;
+			jobs[count].dev.pid = cur->pid;
+			strcpy(jobs[count].dev.path, cur->path);
+			count++;
+		}
+	}
+
+	if (count == 0) {
+		printf("No FTDI devices found\n");
+		failed = -1;
+		goto done;
+	}
+
+	printf("Backing up %d devices in parallel...\n", count);
+	for (i = 0; i < count; i++) {
+		if (pthread_create(&jobs[i].thread, NULL, backup_worker, &jobs[i])) {
+			jobs[i].status = "no thread";
+			jobs[i].result = 1;
+		} else {
+			jobs[i].started = 1;
+		}
+	}
+	for (i = 0; i < count; i++)
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+
+	devs = malloc(count * sizeof(*devs));
+	for (i = 0; devs && i < count; i++)
+		if (jobs[i].result == 0)
+			devs[n_devs++] = jobs[i].dev;
+	if (devs == NULL || backup_write(archive, devs, n_devs, &new_images) < 0) {
+		printf("Can't write backup archive %s\n", archive);
+		failed = -1;
+		goto done;
+	}
+
+	printf("\n%-4s %-16s %-24s %-16s %-12s\n", "#", "Path", "Serial", "Image", "Result");
+	for (i = 0, k = 0; i < count; i++) {
+		if (jobs[i].result == 0) {
+			printf("%-4d %-16s %-24s %016llx %-12s\n", i, jobs[i].dev.path,
+				jobs[i].dev.serial[0] ? jobs[i].dev.serial : "-", devs[k++].hash, jobs[i].status);
+		} else {
+			printf("%-4d %-16s %-24s %-16s %-12s\n", i, jobs[i].dev.path,
+				jobs[i].dev.serial[0] ? jobs[i].dev.serial : "-", "-", jobs[i].status);
+			failed++;
+		}
+	}
+	printf("%d of %d devices backed up to %s, %d new images.\n", n_devs, count, archive, new_images);
+
+	if (stats) {
+		struct run_stats *runs = malloc(count * sizeof(*runs));
+		if (runs) {
+			for (i = 0; i < count; i++)
+				runs[i] = jobs[i].stats;
+			stats_print_json(stats_out, runs, count);
+			free(runs);
+		}
+	}
+
+done:
+	free(devs);
+	free(jobs);
+	for (i = 0; i < 2; i++)
+		fdev_scan_free(lists[i], n_lists[i]);
+	return failed;
+}
+
+/**
+ * @brief Per-device state for a parallel scan
+ **/
+struct scan_job {
+	struct fdev_info info;      /**< device to query, owned by the scan list */
+	struct inventory_entry entry;
+	struct run_stats stats;
+	pthread_t thread;
+	int started;
+};
+
+/**
+ * @brief Thread entry querying a single device of a scan
+ *
+ * \param arg pointer to the struct scan_job to process
+ **/
+static void *scan_worker(void *arg)
+{
+	struct scan_job *job = arg;
+	struct inventory_entry *e = &job->entry;
+	unsigned char buf[FTDI_MAX_EEPROM_SIZE];
+	struct ftdi_context *ftdi;
+	struct fdev dev;
+	int f, size;
+
+	stats_start(&job->stats);
+	job->stats.result = 1;
+
+	if ((ftdi = ftdi_new()) == NULL) {
+		e->status = "no memory";
+		goto done;
+	}
+	if ((f = job_open(&dev, ftdi, &job->info)) < 0) {
+		e->status = f == FDEV_LOCKED ? "busy" : "open failed";
+		ftdi_free(ftdi);
+		goto done;
+	}
+	stats_phase(&job->stats, PHASE_OPEN);
+	strcpy(e->manufacturer, dev.manufacturer);
+	strcpy(e->product, dev.product);
+	strcpy(e->serial, dev.serial);
+	e->chip = image_chip_name(ftdi->type);
+
+	if (fdev_read_eeprom(&dev, buf, &size) < 0) {
+		e->status = "read failed";
+	} else {
+		e->eeprom_size = size;
+		if (size <= 0)
+			e->checksum = "blank";
+		else if (image_checksum(ftdi->type, buf, size) == (buf[size-2] | (buf[size-1] << 8)))
+			e->checksum = "ok";
+		else
+			e->checksum = "bad";
+		e->status = "ok";
+		job->stats.result = 0;
+	}
+	stats_phase(&job->stats, PHASE_READ);
+	fdev_close(&dev);
+	stats_usb(&job->stats, dev.transfers);
+	ftdi_free(ftdi);
+
+done:
+	strcpy(job->stats.device, e->path);
+	stats_finish(&job->stats, job->stats.result);
+	return NULL;
 }
 
 /**
- * @brief Read and decode EEPROM information
+ * @brief List every attached FTDI device with details gathered in parallel
  *
- * \param ftdi pointer to ftdi_context
- * \param debug value indicating whether more output is wanted.
- *         0 = standard output
- *         1 = debug output
+ * \param ftdi pointer to ftdi_context used for enumeration
+ * \param ids vid/pid pairs to look for besides the default FTDI ones
+ * \param n_ids number of pairs in ids
+ * \param csv print CSV instead of JSON
+ * \param out file to print to, NULL for stdout
+ * \param stats print per-device statistics as JSON
  *
- * Function will provide the decoded EEPROM information
- * to the command line.  The debug output is the byte
- * buffer, displayed as a hex dump.
+ * Every device is opened and read on its own thread, so a scan takes
+ * about as long as reading a single eeprom.
+ * Returns the number of devices that could not be read, or -1 on error.
  **/
-int read_decode_eeprom(struct ftdi_context *ftdi, int debug)
+static int scan_devices(struct ftdi_context *ftdi, int ids[][2], int n_ids, int csv, const char *out, int stats)
 {
-	int i, j, f;
-	int value;
-	int size;
-	unsigned char buf[256];
+	struct fdev_info **lists, *cur;
+	int *n_lists;
+	struct scan_job *jobs = NULL, *more;
+	int count = 0, failed = 0;
+	FILE *f = stdout;
+	int i, j, k;
+
+	lists = calloc(n_ids + 1, sizeof(*lists));
+	n_lists = calloc(n_ids + 1, sizeof(*n_lists));
+	if (lists == NULL || n_lists == NULL) {
+		failed = -1;
+		goto done;
+	}
+	/* The first scan, of vid/pid 0, finds every default FTDI id */
+	for (i = 0; i <= n_ids; i++) {
+		if ((n_lists[i] = fdev_scan(ftdi, i ? ids[i-1][0] : 0, i ? ids[i-1][1] : 0, &lists[i])) < 0)
+			n_lists[i] = 0;
+		for (k = 0; k < n_lists[i]; k++) {
+			cur = &lists[i][k];
+			for (j = 0; j < count; j++)
+				if (!strcmp(jobs[j].entry.path, cur->path)) break;
+			if (j < count)
+				continue;
+			if ((more = realloc(jobs, (count + 1) * sizeof(*jobs))) == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				failed = -1;
+				goto done;
+			}
+			jobs = more;
+			memset(&jobs[count], 0, sizeof(*jobs));
+			jobs[count].info = *cur;
+			jobs[count].entry.vid = cur->vid;
+			jobs[count].entry.pid = cur->pid;
+			strcpy(jobs[count].entry.path, cur->path);
+			jobs[count].entry.chip = "unknown";
+			jobs[count].entry.eeprom_size = -1;
+			jobs[count].entry.checksum = "unknown";
+			count++;
+		}
+	}
 
-	ftdi_get_eeprom_value(ftdi, CHIP_SIZE, &value);
-	if (value <0)
+	for (i = 0; i < count; i++)
+		if (pthread_create(&jobs[i].thread, NULL, scan_worker, &jobs[i]) == 0)
+			jobs[i].started = 1;
+		else
+			jobs[i].entry.status = "no thread";
+	for (i = 0; i < count; i++)
+		if (jobs[i].started)
+			pthread_join(jobs[i].thread, NULL);
+
+	if (out != NULL && (f = fopen(out, "w")) == NULL) {
+		fprintf(stderr, "Can't open %s\n", out);
+		failed = -1;
+		goto done;
+	}
+	/* Results go out as one array */
 	{
-		fprintf(stderr, "No EEPROM found or EEPROM empty\n");
+		struct inventory_entry *entries = malloc((count ? count : 1) * sizeof(*entries));
+		if (entries) {
+			for (i = 0; i < count; i++)
+				entries[i] = jobs[i].entry;
+			if (csv)
+				inventory_print_csv(f, entries, count);
+			else
+				inventory_print_json(f, entries, count);
+			free(entries);
+		}
+	}
+	if (f != stdout) {
+		fclose(f);
+		fprintf(stderr, "Found %d FTDI devices, inventory written to %s\n", count, out);
+	}
+	for (i = 0; i < count; i++)
+		if (strcmp(jobs[i].entry.status, "ok"))
+			failed++;
+
+	if (stats && count > 0) {
+		struct run_stats *runs = malloc(count * sizeof(*runs));
+		if (runs) {
+			for (i = 0; i < count; i++)
+				runs[i] = jobs[i].stats;
+			stats_print_json(stats_out, runs, count);
+			free(runs);
+		}
+	}
+
+done:
+	free(jobs);
+	for (i = 0; lists && n_lists && i <= n_ids; i++)
+		fdev_scan_free(lists[i], n_lists[i]);
+	free(lists);
+	free(n_lists);
+	return failed;
+}
+
+/**
+ * @brief Shared state of the hotplug daemon
+ **/
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	int active;                 /**< workers still running */
+	int flashed, failed;
+	struct {
+		char path[32];
+		struct timespec until;
+		int busy;               /**< still being flashed */
+	} recent[64];               /**< ports expected to re-enumerate after a flash */
+	int n_recent;
+	struct run_stats *runs;     /**< statistics of every flashed unit */
+	int n_runs;
+} daemon_state = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void daemon_signal(int sig)
+{
+	daemon_stop = 1;
+}
+
+/**
+ * @brief Per-arrival state of the hotplug daemon
+ **/
+struct daemon_job {
+	struct flash_job job;
+	struct hotplug_event ev;
+};
+
+/**
+ * @brief Find or add the recent[] entry of a port
+ *
+ * \param path USB bus/port path
+ *
+ * Must be called with daemon_state.lock held.  Function returns the
+ * index of the entry, or -1 if the table is full.
+ **/
+static int daemon_recent(const char *path)
+{
+	int i;
+
+	for (i = 0; i < daemon_state.n_recent; i++)
+		if (!strcmp(daemon_state.recent[i].path, path))
+			return i;
+	if (i == 64)
 		return -1;
+	memset(&daemon_state.recent[i], 0, sizeof(daemon_state.recent[i]));
+	strcpy(daemon_state.recent[i].path, path);
+	daemon_state.n_recent++;
+
+	return i;
+}
+
+/**
+ * @brief Thread entry flashing a device reported by the hotplug monitor
+ *
+ * \param arg pointer to the struct daemon_job to process, freed on return
+ **/
+static void *daemon_worker(void *arg)
+{
+	struct daemon_job *dj = arg;
+	struct timespec done;
+	double latency;
+	int i;
+
+	if (dj->job.info.handle) {
+		flash_worker(&dj->job);
+		if (dj->ev.dev)
+			libusb_unref_device(dj->ev.dev);
+	} else {
+		strcpy(dj->job.path, "sim");
+		dj->job.status = "simulated";
+		dj->job.result = 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &done);
+	latency = (done.tv_sec - dj->ev.arrived.tv_sec) * 1e3 +
+		(done.tv_nsec - dj->ev.arrived.tv_nsec) / 1e6;
+
+	printf("[%d] %-16s %-24s %-16s %-12s %.1f ms after plug-in\n", dj->ev.seq, dj->job.path,
+		dj->job.serial[0] ? dj->job.serial : "-", dj->job.profile ? dj->job.profile : "-",
+		dj->job.status, latency);
+
+	pthread_mutex_lock(&daemon_state.lock);
+	if (dj->ev.dev && (i = daemon_recent(dj->job.path)) >= 0) {
+		if (dj->job.result == 0 && dj->job.reset && dj->job.fopts->reenum_ms == 0) {
+			/* The reset after writing makes the same port arrive again */
+			daemon_state.recent[i].busy = 0;
+			daemon_state.recent[i].until = done;
+			daemon_state.recent[i].until.tv_sec += 5;
+		} else {
+			/* Failed, never reset, or the worker waited for it to come back */
+			daemon_state.recent[i] = daemon_state.recent[--daemon_state.n_recent];
+		}
 	}
-	fprintf(stderr, "Chip type %d ftdi_eeprom_size: %d\n", ftdi->type, value);
-	if (ftdi->type == TYPE_R)
-		size = 0xa0;
+	if (dj->job.info.handle && dj->job.fopts->stats) {
+		struct run_stats *runs = realloc(daemon_state.runs,
+			(daemon_state.n_runs + 1) * sizeof(*runs));
+		if (runs) {
+			runs[daemon_state.n_runs++] = dj->job.stats;
+			daemon_state.runs = runs;
+		}
+	}
+	if (dj->job.result)
+		daemon_state.failed++;
 	else
-		size = value;
+		daemon_state.flashed++;
+	daemon_state.active--;
+	pthread_cond_signal(&daemon_state.idle);
+	pthread_mutex_unlock(&daemon_state.lock);
 
-	if(debug > 0) {
-		ftdi_get_eeprom_buf(ftdi, buf, size);
-		for (i=0; i < size; i += 16)
-		{
-			fprintf(stdout,"0x%03x:", i);
-					
-			for (j = 0; j< 8; j++)
-				fprintf(stdout," %02x", buf[i+j]);
-			fprintf(stdout," ");
-			for (; j< 16; j++)
-				fprintf(stdout," %02x", buf[i+j]);
-			fprintf(stdout," ");
-			for (j = 0; j< 8; j++)
-				fprintf(stdout,"%c", isprint(buf[i+j])?buf[i+j]:'.');
-			fprintf(stdout," ");
-			for (; j< 16; j++)
-				fprintf(stdout,"%c", isprint(buf[i+j])?buf[i+j]:'.');
-			fprintf(stdout,"\n");
-		}
-	}
-
-	f = ftdi_eeprom_decode(ftdi, 1);
-	if (f < 0)
-	{
-		fprintf(stderr, "ftdi_eeprom_decode: %d (%s)\n",
-				f, ftdi_get_error_string(ftdi));
-		return -1;
+	free(dj);
+	return NULL;
+}
+
+/**
+ * @brief Check whether an arrival is the re-enumeration of a device just flashed
+ *
+ * \param path USB bus/port path of the arrival
+ * \param now CLOCK_MONOTONIC time of the arrival
+ *
+ * Function returns 1 if the arrival should be ignored, which includes
+ * arrivals at a port still being flashed.  Otherwise the entry is
+ * consumed, so the next board plugged into that port is flashed.
+ **/
+static int daemon_reenumerated(const char *path, const struct timespec *now)
+{
+	int i, ret = 0;
+
+	pthread_mutex_lock(&daemon_state.lock);
+	for (i = 0; i < daemon_state.n_recent; i++) {
+		if (strcmp(daemon_state.recent[i].path, path))
+			continue;
+		if (daemon_state.recent[i].busy) {
+			ret = 1;
+			break;
+		}
+		ret = now->tv_sec < daemon_state.recent[i].until.tv_sec;
+		daemon_state.recent[i] = daemon_state.recent[--daemon_state.n_recent];
+		break;
 	}
-	return 0;
+	pthread_mutex_unlock(&daemon_state.lock);
+
+	return ret;
+}
+
+/**
+ * @brief Flash devices as they are plugged in
+ *
+ * \param ftdi pointer to ftdi_context whose libusb context is monitored
+ * \param profiles profiles of the parsed configuration, shared by every unit
+ * \param option_vid vid given on the command line
+ * \param option_pid pid given on the command line
+ * \param fopts flash options applied to every device
+ * \param sim_count if nonzero, handle that many simulated arrivals
+ *         instead of listening to USB
+ *
+ * Simulated arrivals flash the emulated units in turn when the
+ * emulator backend is selected, and are only reported otherwise.
+ * The configuration is parsed once by the caller and every arrival
+ * matching the vid/pid or target vid/pid of a profile, or the command
+ * line vid/pid, is flashed with its profile on its own thread.  Runs
+ * until interrupted, or until all simulated arrivals are handled.
+ * Returns 0 if no unit failed.
+ **/
+static int run_daemon(struct ftdi_context *ftdi, const struct profile_index *profiles, int option_vid, int option_pid,
+	const struct flash_options *fopts, int sim_count)
+{
+	int ids[FDEV_MATCH_IDS][2];
+	struct hotplug_monitor *mon;
+	struct hotplug_event ev;
+	struct libusb_device_descriptor desc;
+	struct fdev_info *sim_list = NULL;
+	struct daemon_job *dj;
+	pthread_attr_t attr;
+	pthread_t thread;
+	char path[32];
+	int n, n_sim = 0, i, r;
+
+	n = profile_scan_ids(profiles, option_vid, option_pid, ids);
+
+	if (sim_count > 0 && fdev_backend() == &fdev_emu_ops &&
+		(n_sim = fdev_scan(ftdi, 0, 0, &sim_list)) < 0)
+		n_sim = 0;
+
+	if (sim_count > 0)
+		mon = hotplug_start_sim(sim_count, 100);
+	else
+		mon = hotplug_start(ftdi->usb_ctx, ids, n);
+	if (mon == NULL) {
+		fdev_scan_free(sim_list, n_sim);
+		return 1;
+	}
+
+	signal(SIGINT, daemon_signal);
+	signal(SIGTERM, daemon_signal);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	printf("Waiting for devices, press Ctrl-C to stop...\n");
+	while (!daemon_stop) {
+		if ((r = hotplug_wait(mon, &ev, 200)) < 0)
+			break;
+		if (r > 0)
+			continue;
+
+		if (ev.dev) {
+			fdev_usb_path(ev.dev, path, sizeof(path));
+			if (daemon_reenumerated(path, &ev.arrived)) {
+				libusb_unref_device(ev.dev);
+				continue;
+			}
+			pthread_mutex_lock(&daemon_state.lock);
+			if ((i = daemon_recent(path)) >= 0)
+				daemon_state.recent[i].busy = 1;
+			pthread_mutex_unlock(&daemon_state.lock);
+		}
+		if ((dj = calloc(1, sizeof(*dj))) == NULL) {
+			if (ev.dev)
+				libusb_unref_device(ev.dev);
+			continue;
+		}
+		dj->ev = ev;
+		if (ev.dev) {
+			dj->job.info.handle = ev.dev;
+			if (libusb_get_device_descriptor(ev.dev, &desc) == 0) {
+				dj->job.info.vid = desc.idVendor;
+				dj->job.info.pid = desc.idProduct;
+			}
+			strcpy(dj->job.info.path, path);
+		} else if (n_sim > 0) {
+			dj->job.info = sim_list[(ev.seq - 1) % n_sim];
+		}
+		strcpy(dj->job.path, dj->job.info.path);
+		job_profile(&dj->job, profiles);
+		dj->job.fopts = fopts;
+		dj->job.open_retries = 20;
+
+		pthread_mutex_lock(&daemon_state.lock);
+		daemon_state.active++;
+		pthread_mutex_unlock(&daemon_state.lock);
+		if (pthread_create(&thread, &attr, daemon_worker, dj)) {
+			daemon_worker(dj);
+		}
+	}
+
+	hotplug_stop(mon);
+	pthread_attr_destroy(&attr);
+
+	pthread_mutex_lock(&daemon_state.lock);
+	while (daemon_state.active > 0)
+		pthread_cond_wait(&daemon_state.idle, &daemon_state.lock);
+	printf("%d devices flashed, %d failed.\n", daemon_state.flashed, daemon_state.failed);
+	if (fopts->stats)
+		stats_print_json(stats_out, daemon_state.runs, daemon_state.n_runs);
+	free(daemon_state.runs);
+	daemon_state.runs = NULL;
+	daemon_state.n_runs = 0;
+	r = daemon_state.failed ? 1 : 0;
+	pthread_mutex_unlock(&daemon_state.lock);
+	fdev_scan_free(sim_list, n_sim);
+
+	return r;
+}
+
+/**
+ * @brief Log receiver keeping stdout free for script results
+ **/
+static void log_stderr(void *arg, int level, const char *msg)
+{
+	fputs(msg, stderr);
 }
 
 #define QUIT return_code = 1; goto cleanup;
+/* Forget the command given so far, the last one on the command line wins */
+#define NEW_COMMAND _flash = 0; _read = 0; _erase = 0; _write = 0; _scan = 0; \
+	archive_filename = NULL; script_filename = NULL; check_filename = NULL; gen_filename = NULL;
 
 int main(int argc, char *argv[])
 {
-    /*
-    configuration options
-    */
-    cfg_opt_t opts[] =
-    {
-        CFG_INT("target_vendor_id", 0x403, 0),
-        CFG_INT("target_product_id", 0x6001, 0),
-        CFG_INT("vendor_id", 0, 0),
-        CFG_INT("product_id", 0, 0),
-        CFG_BOOL("self_powered", cfg_true, 0),
-        CFG_BOOL("remote_wakeup", cfg_true, 0),
-        CFG_BOOL("in_is_isochronous", cfg_false, 0),
-        CFG_BOOL("out_is_isochronous", cfg_false, 0),
-        CFG_BOOL("suspend_pull_downs", cfg_false, 0),
-        CFG_BOOL("use_serial", cfg_false, 0),
-        CFG_BOOL("change_usb_version", cfg_false, 0),
-        CFG_INT("usb_version", 0, 0),
-        CFG_INT("default_pid", 0x6001, 0),
-        CFG_INT("max_power", 0, 0),
-        CFG_STR("manufacturer", "Acme Inc.", 0),
-        CFG_STR("product", "USB Serial Converter", 0),
-        CFG_STR("serial", "08-15", 0),
-        CFG_INT("eeprom_type", 0x00, 0),
-        CFG_STR("filename", "", 0),
-        CFG_BOOL("flash_raw", cfg_false, 0),
-        CFG_BOOL("high_current", cfg_false, 0),
-        CFG_STR_LIST("cbus0", "{TXDEN,PWREN,RXLED,TXLED,TXRXLED,SLEEP,CLK48,CLK24,CLK12,CLK6,IO_MODE,BITBANG_WR,BITBANG_RD,SPECIAL}", 0),
-        CFG_STR_LIST("cbus1", "{TXDEN,PWREN,RXLED,TXLED,TXRXLED,SLEEP,CLK48,CLK24,CLK12,CLK6,IO_MODE,BITBANG_WR,BITBANG_RD,SPECIAL}", 0),
-        CFG_STR_LIST("cbus2", "{TXDEN,PWREN,RXLED,TXLED,TXRXLED,SLEEP,CLK48,CLK24,CLK12,CLK6,IO_MODE,BITBANG_WR,BITBANG_RD,SPECIAL}", 0),
-        CFG_STR_LIST("cbus3", "{TXDEN,PWREN,RXLED,TXLED,TXRXLED,SLEEP,CLK48,CLK24,CLK12,CLK6,IO_MODE,BITBANG_WR,BITBANG_RD,SPECIAL}", 0),
-        CFG_STR_LIST("cbus4", "{TXDEN,PWRON,RXLED,TXLED,TX_RX_LED,SLEEP,CLK48,CLK24,CLK12,CLK6}", 0),
-        CFG_BOOL("invert_txd", cfg_false, 0),
-        CFG_BOOL("invert_rxd", cfg_false, 0),
-        CFG_BOOL("invert_rts", cfg_false, 0),
-        CFG_BOOL("invert_cts", cfg_false, 0),
-        CFG_BOOL("invert_dtr", cfg_false, 0),
-        CFG_BOOL("invert_dsr", cfg_false, 0),
-        CFG_BOOL("invert_dcd", cfg_false, 0),
-        CFG_BOOL("invert_ri", cfg_false, 0),
-        CFG_STR("channel_a_driver", "VCP", 0),
-        CFG_STR("channel_b_driver", "VCP", 0),
-        CFG_STR("channel_c_driver", "VCP", 0),
-        CFG_STR("channel_d_driver", "VCP", 0),
-        CFG_BOOL("channel_a_rs485", cfg_false, 0),
-        CFG_BOOL("channel_b_rs485", cfg_false, 0),
-        CFG_BOOL("channel_c_rs485", cfg_false, 0),
-        CFG_BOOL("channel_d_rs485", cfg_false, 0),
-        CFG_END()
-    };
     cfg_t *cfg;
+    const struct profile_index *profiles;
 
     /*
     normal variables
     */
-    int _decode = 0, _scan = 0, _read = 0, _erase = 0, _flash = 0, _debug = 0;
+    int _decode = 0, _scan = 0, _read = 0, _erase = 0, _flash = 0, _write = 0, _debug = 0, _all = 0, _force = 0;
+    int _daemon = 0, _sim_count = 0, _verify = VERIFY_NONE, _stats = 0, _csv = 0, _quiet = 0;
+    int scan_ids[16][2], n_scan_ids = 0, _reenum_ms = 0, _jobs = 0, _lock_wait = DEV_LOCK_FOREVER;
+    char *p, *gen_filename = NULL, *chip_spec = NULL, *serial_range = NULL, *manifest = NULL;
+    char *bundle_filename = NULL, *bundle_key = NULL, *script_filename = NULL, *profile_name = NULL;
+    char *lock_dir = DEV_LOCK_DIR, *check_filename = NULL;
+    struct bundle *bundle = NULL;
+    static const struct option long_options[] = {
+        { "verify", optional_argument, NULL, 'V' },
+        { "stats", required_argument, NULL, 'S' },
+        { "emulate", required_argument, NULL, 'E' },
+        { "ids", required_argument, NULL, 'I' },
+        { "serial", required_argument, NULL, 'N' },
+        { "product", required_argument, NULL, 'P' },
+        { "path", required_argument, NULL, 'U' },
+        { "index", required_argument, NULL, 'X' },
+        { "wait-reenum", optional_argument, NULL, 'R' },
+        { "format", required_argument, NULL, 'O' },
+        { "chip", required_argument, NULL, 'C' },
+        { "serials", required_argument, NULL, 'G' },
+        { "manifest", required_argument, NULL, 'M' },
+        { "bundle", required_argument, NULL, 'B' },
+        { "key", required_argument, NULL, 'K' },
+        { "profile", required_argument, NULL, 'Q' },
+        { "lock-wait", required_argument, NULL, 'W' },
+        { "lock-dir", required_argument, NULL, 'Y' },
+        { "pipeline", required_argument, NULL, 'L' },
+        { NULL, 0, NULL, 0 }
+    };
 
-    const int max_eeprom_size = 256;
     int my_eeprom_size = 0;
-    unsigned char *eeprom_buf = NULL;
-    char *filename=NULL, *cfg_filename=NULL;
-    int size_check;
+    char *filename=NULL, *cfg_filename=NULL, *image_filename=NULL, *archive_filename=NULL;
     int option_vid=0x403, option_pid=0x6001;
     int i, f, return_code=0;
-    FILE *fp;
+    struct run_stats run, *st = NULL;
 
-    struct ftdi_context *ftdi = NULL;
+    struct flash_session *session;
+    struct ftdi_context *ftdi;
+    struct fdev_match match;
 
-		printf ("\nftdi-flash-tool %s\n", EEPROM_VERSION_STRING);
-    printf ("\nAn FTDI eeprom generator\n");
-    printf ("(c) Brandon Warhurst\n");
+    memset(&match, 0, sizeof(match));
 
 	/* Check the options */
-    while ((i = getopt(argc, argv, "dDef:ho:rv:p:s")) != -1) {
+    while ((i = getopt_long(argc, argv, "ab:c:dDeFf:g:hHj:k:o:rv:p:sT:w:", long_options, NULL)) != -1) {
 		switch(i) {
+		case 'a':       /* all devices */
+			_all = 1;
+			break;
+		case 'b':       /* backup command */
+			NEW_COMMAND
+			archive_filename = optarg;
+			break;
+		case 'c':       /* command script */
+			NEW_COMMAND
+			script_filename = optarg;
+			break;
+		case 'H':       /* hotplug daemon */
+			_daemon = 1;
+			break;
+		case 'T':       /* simulated hotplug arrivals */
+			_sim_count = atoi(optarg);
+			break;
 		case 'd':       /* decode */
 			_decode = 1;
 			break;
@@ -386,247 +1421,346 @@ int main(int argc, char *argv[])
 			filename = optarg;
 			break;
 		case 'r':       /* read command */
-			_flash = 0; _read = 1; _erase = 0;
+			NEW_COMMAND
+			_read = 1;
 			break;
 		case 'e':       /* erase command */
-			_flash = 0; _read = 0; _erase = 1;
+			NEW_COMMAND
+			_erase = 1;
 			cfg_filename = NULL;
 			filename = NULL;
 			break;
+		case 'F':       /* force full write */
+			_force = 1;
+			break;
 		case 'f':       /* flash command */
-			_flash = 1; _read = 0; _erase = 0;
+			NEW_COMMAND
+			_flash = 1;
 			filename = NULL;
 			cfg_filename = optarg;
 			break;
-		case 's':       /* scan command (currently not really useful) */
+		case 'w':       /* raw image write command */
+			NEW_COMMAND
+			_write = 1;
+			image_filename = optarg;
+			break;
+		case 'k':       /* check command */
+			NEW_COMMAND
+			check_filename = optarg;
+			break;
+		case 'g':       /* offline image generation */
+			NEW_COMMAND
+			gen_filename = optarg;
+			break;
+		case 'j':       /* generation workers */
+			_jobs = atoi(optarg);
+			break;
+		case 'C':       /* chip type to generate for */
+			chip_spec = optarg;
+			break;
+		case 'G':       /* serial range to generate */
+			serial_range = optarg;
+			break;
+		case 'M':       /* serials to generate */
+			manifest = optarg;
+			break;
+		case 'B':       /* image bundle */
+			bundle_filename = optarg;
+			break;
+		case 'K':       /* bundle key */
+			bundle_key = optarg;
+			break;
+		case 'Q':       /* profile of unclaimed devices */
+			profile_name = optarg;
+			break;
+		case 'W':       /* how long to wait for a locked device */
+			_lock_wait = strtol(optarg, &p, 0);
+			if (*p != '\0' || _lock_wait < 0)
+				usage(argv[0]);
+			break;
+		case 'Y':       /* lock file directory */
+			lock_dir = optarg;
+			break;
+		case 'L':       /* eeprom transfers in flight */
+			if (atoi(optarg) < 1)
+				usage(argv[0]);
+			fdev_set_pipeline(atoi(optarg));
+			break;
+		case 's':       /* scan command */
+			NEW_COMMAND
 			_scan = 1;
 			break;
+		case 'I':       /* extra ids for the scan */
+			for (p = optarg; *p && n_scan_ids < 16; p++) {
+				scan_ids[n_scan_ids][0] = strtoul(p, &p, 16);
+				if (*p != ':')
+					usage(argv[0]);
+				scan_ids[n_scan_ids++][1] = strtoul(p + 1, &p, 16);
+				if (*p != ',' && *p != '\0')
+					usage(argv[0]);
+				if (*p == '\0')
+					break;
+			}
+			break;
+		case 'N':       /* select by serial */
+			match.serial = optarg;
+			break;
+		case 'P':       /* select by product */
+			match.product = optarg;
+			break;
+		case 'U':       /* select by bus/port path */
+			match.path = optarg;
+			break;
+		case 'X':       /* select the n-th match */
+			match.index = atoi(optarg);
+			break;
+		case 'R':       /* wait for re-enumeration after reset */
+			_reenum_ms = optarg ? atoi(optarg) : 5000;
+			if (_reenum_ms <= 0)
+				usage(argv[0]);
+			break;
+		case 'O':       /* scan output format */
+			if (!strcmp(optarg, "csv"))
+				_csv = 1;
+			else if (strcmp(optarg, "json"))
+				usage(argv[0]);
+			break;
+		case 'V':       /* verify after writing */
+			if (optarg == NULL || !strcmp(optarg, "written"))
+				_verify = VERIFY_WRITTEN;
+			else if (!strcmp(optarg, "full"))
+				_verify = VERIFY_FULL;
+			else if (!strcmp(optarg, "checksum"))
+				_verify = VERIFY_CHECKSUM;
+			else
+				usage(argv[0]);
+			break;
+		case 'S':       /* statistics output */
+			if (strncmp(optarg, "json", 4) || (optarg[4] != '\0' && optarg[4] != ':'))
+				usage(argv[0]);
+			if (optarg[4] == '\0')
+				stats_out = stderr;
+			else if ((stats_out = fopen(optarg + 5, "w")) == NULL) {
+				fprintf(stderr, "Can't open %s\n", optarg + 5);
+				return EXIT_FAILURE;
+			}
+			_stats = 1;
+			break;
+		case 'E':       /* emulated devices */
+			if (emu_setup(optarg) < 0)
+				usage(argv[0]);
+			fdev_set_backend(&fdev_emu_ops);
+			break;
 		case 'h':       /* help */
 		default:
 			usage(argv[0]);
 		}
     }
 
-        /* Allocate the ftdi structure */
-    if ((ftdi = ftdi_new()) == 0)
+	/* A script's result lines or a scan's inventory are all that goes to stdout */
+	_quiet = script_filename != NULL || _scan > 0;
+	if (_quiet)
+		flash_set_log(log_stderr, NULL);
+	else {
+		printf ("\nftdi-flash-tool %s\n", EEPROM_VERSION_STRING);
+		printf ("\nAn FTDI eeprom generator\n");
+		printf ("(c) Brandon Warhurst\n");
+	}
+
+        /* Allocate the session, which owns the ftdi structure */
+    if ((session = flash_session_new()) == NULL)
     {
-        fprintf(stderr, "Failed to allocate ftdi structure :%s \n",
-                ftdi_get_error_string(ftdi));
+        fprintf(stderr, "Failed to allocate ftdi structure\n");
         return EXIT_FAILURE;
     }
+    ftdi = flash_session_ftdi(session);
+	dev_lock_setup(*lock_dir ? lock_dir : NULL, _lock_wait);
+
+	if(script_filename != NULL) {
+		struct flash_options fopts = { _decode, _debug, _force, _verify, 0, _reenum_ms, NULL, bundle_key };
+		FILE *fp = strcmp(script_filename, "-") ? fopen(script_filename, "r") : stdin;
+
+		if (fp == NULL) {
+			fprintf(stderr, "Can't open script %s\n", script_filename);
+			QUIT;
+		}
+		if (bundle_filename != NULL && (fopts.bundle = bundle = bundle_open(bundle_filename)) == NULL) {
+			fprintf(stderr, "Can't open bundle %s\n", bundle_filename);
+			if (fp != stdin)
+				fclose(fp);
+			QUIT;
+		}
+		return_code = script_run(fp, stdout, session, &fopts) ? 1 : 0;
+		if (fp != stdin)
+			fclose(fp);
+		goto cleanup;
+	}
 
 	if(_scan > 0) {
-		/* If we are scanning, do this stuff here. */
-		/* Currently doesn't really do anything useful. */
-		struct ftdi_device_list *devlist;
-		int res;
-		if ((res = ftdi_usb_find_all(ftdi, &devlist, 0, 0)) < 0)
-		{
-			fprintf(stderr, "No FTDI with default VID/PID found\n");
-			return_code =  -1;
+		/* A scan reports locked devices as busy rather than queueing behind them */
+		dev_lock_setup(*lock_dir ? lock_dir : NULL, 0);
+		if (scan_devices(ftdi, scan_ids, n_scan_ids, _csv, filename, _stats) != 0)
+			return_code = 1;
+		goto cleanup;
+	}
+
+	if(gen_filename != NULL) {
+		if (flash_session_config(session, gen_filename) != FLASH_OK) { QUIT; }
+		cfg = flash_session_cfg(session);
+		if (profile_name != NULL) {
+			const struct profile *p = profile_find(flash_session_profiles(session), profile_name);
+
+			if (p == NULL) {
+				printf("No profile %s in %s\n", profile_name, gen_filename);
+				QUIT;
+			}
+			cfg = p->cfg;
 		}
-	
-		printf("Found %d default FTDI devices\n",res);
-	
+		return_code = generate_images(cfg, chip_spec, serial_range, manifest, filename, bundle_filename, _jobs);
+		goto cleanup;
+	}
+
+	if(archive_filename != NULL) {
+		if(backup_all_devices(ftdi, archive_filename, option_vid, option_pid, _stats) != 0)
+			return_code = 1;
+		goto cleanup;
+	}
+
+	if(check_filename != NULL) {
+		printf("Checking...\n");
+		return_code = 3;
+		if (flash_session_config(session, check_filename) != FLASH_OK) goto cleanup;
+		if (profile_name != NULL && flash_session_profile(session, profile_name) != FLASH_OK) goto cleanup;
+		if(_stats > 0) { st = &run; stats_start(st); flash_session_set_stats(session, st); }
+		match.n_ids = profile_scan_ids(flash_session_profiles(session), option_vid, option_pid, match.ids);
+		if ((f = flash_session_open(session, &match)) == FLASH_OK)
+			f = flash_session_check(session);
+		return_code = f == FLASH_OK ? 0 : f == FLASH_MISMATCH ? 1 : f == FLASH_NO_DEVICE ? 2 : 3;
 		goto cleanup;
 	}
 
 	/* Check to make sure a command was provided */
-	if(_read == 0 && _flash == 0 && _erase == 0) usage(argv[0]);
+	if(_read == 0 && _flash == 0 && _erase == 0 && _write == 0) usage(argv[0]);
 
     if(_flash > 0) {
 		/* if we are flashing... */
 	
 		printf("Writing...\n");
-		if ((fp = fopen(cfg_filename, "r")) == NULL)
-		{
-			printf ("Can't open configuration file\n");
-			return -1;
+		if (flash_session_config(session, cfg_filename) != FLASH_OK) { QUIT; }
+		if (profile_name != NULL && flash_session_profile(session, profile_name) != FLASH_OK) { QUIT; }
+		profiles = flash_session_profiles(session);
+		if (profiles->count > 1 || profiles->list[0].name)
+			printf("%d profiles in %s\n", profiles->count, cfg_filename);
+		if (bundle_filename != NULL) {
+			if ((bundle = bundle_open(bundle_filename)) == NULL) {
+				printf("Can't open bundle %s\n", bundle_filename);
+				QUIT;
+			}
+			printf("Bundle %s holds %d images.\n", bundle_filename, bundle_count(bundle));
 		}
-		fclose (fp);
-
-		cfg = cfg_init(opts, 0);
-		cfg_parse(cfg, cfg_filename);
-		filename = cfg_getstr(cfg, "filename");
 
-		if (cfg_getbool(cfg, "self_powered") && cfg_getint(cfg, "max_power") > 0)
-			printf("Hint: Self powered devices should have a max_power setting of 0.\n");
+		struct flash_options fopts = { _decode, _debug, _force, _verify, _stats, _reenum_ms, bundle, bundle_key };
 
-		int vendor_id = cfg_getint(cfg, "vendor_id");
-		int product_id = cfg_getint(cfg, "product_id");
-		i = locate_ftdi_device(ftdi,vendor_id,product_id,option_vid,option_pid);
-		int target_vid = cfg_getint(cfg, "target_vendor_id");
-		int target_pid = cfg_getint(cfg, "target_product_id");
-		if(i && (target_vid != option_vid || target_pid != option_pid))
-			locate_ftdi_device(ftdi,target_vid, target_pid, option_vid, option_pid);
-
-		if(i != 0) { QUIT; }
-
-		if((f=ftdi_read_eeprom(ftdi))) {
-			fprintf(stderr, "FTDI read eeprom: %d (%s)\n", f, ftdi_get_error_string(ftdi));
+		for (i = 0; i < profiles->count; i++) {
+			cfg = profiles->list[i].cfg;
+			if (cfg_getbool(cfg, "self_powered") && cfg_getint(cfg, "max_power") > 0)
+				printf("Hint: Self powered devices should have a max_power setting of 0%s%s.\n",
+					profiles->list[i].name ? " in " : "", profiles->list[i].name ? profiles->list[i].name : "");
 		}
 
-		i = detect_eeprom(ftdi,cfg_getint(cfg,"eeprom_type"));
+		if(_daemon > 0) {
+			if(_sim_count == 0 && fdev_backend() == &fdev_emu_ops)
+				_sim_count = emu_units();
+			if(run_daemon(ftdi, profiles, option_vid, option_pid, &fopts, _sim_count) != 0)
+				return_code = 1;
+			goto cleanup;
+		}
 
-		ftdi_eeprom_initdefaults (ftdi, cfg_getstr(cfg, "manufacturer"),
-										cfg_getstr(cfg, "product"),
-										cfg_getstr(cfg, "serial"));
+		if(_all > 0) {
+			if(flash_all_devices(ftdi, profiles, option_vid, option_pid, &fopts) != 0)
+				return_code = 1;
+			goto cleanup;
+		}
 
+		if(_stats > 0) { st = &run; stats_start(st); flash_session_set_stats(session, st); }
 
-		eeprom_set_value(ftdi, CHIP_TYPE, i);
+		/* Already programmed, then the command line ids, then a blank chip */
+		match.n_ids = profile_scan_ids(profiles, option_vid, option_pid, match.ids);
+		if (flash_session_open(session, &match) != FLASH_OK) { QUIT; }
 
-		eeprom_get_value(ftdi, CHIP_SIZE, &my_eeprom_size);
-		if(my_eeprom_size < 0) {
-			if ((i == 0x56) || (i == 0x66))
-				my_eeprom_size = 0x100;
-			else
-				my_eeprom_size = 0x80;
-        }
-
-		printf("EEPROM size: %d\n",my_eeprom_size);
-		eeprom_set_value(ftdi, VENDOR_ID, cfg_getint(cfg, "vendor_id"));
-		eeprom_set_value(ftdi, PRODUCT_ID, cfg_getint(cfg, "product_id"));
-
-		eeprom_set_value(ftdi, SELF_POWERED, cfg_getbool(cfg, "self_powered"));
-		eeprom_set_value(ftdi, REMOTE_WAKEUP, cfg_getbool(cfg, "remote_wakeup"));
-		eeprom_set_value(ftdi, MAX_POWER, cfg_getint(cfg, "max_power"));
-
-		eeprom_set_value(ftdi, IN_IS_ISOCHRONOUS, cfg_getbool(cfg, "in_is_isochronous"));
-		eeprom_set_value(ftdi, OUT_IS_ISOCHRONOUS, cfg_getbool(cfg, "out_is_isochronous"));
-		eeprom_set_value(ftdi, SUSPEND_PULL_DOWNS, cfg_getbool(cfg, "suspend_pull_downs"));
-
-		eeprom_set_value(ftdi, USE_SERIAL, cfg_getbool(cfg, "use_serial"));
-		eeprom_set_value(ftdi, USE_USB_VERSION, cfg_getbool(cfg, "change_usb_version"));
-		eeprom_set_value(ftdi, USB_VERSION, cfg_getint(cfg, "usb_version"));
-
-		eeprom_set_value(ftdi, HIGH_CURRENT, cfg_getbool(cfg, "high_current"));
-		eeprom_set_value(ftdi, CBUS_FUNCTION_0, str_to_cbus(cfg_getstr(cfg, "cbus0"), 13));
-		eeprom_set_value(ftdi, CBUS_FUNCTION_1, str_to_cbus(cfg_getstr(cfg, "cbus1"), 13));
-		eeprom_set_value(ftdi, CBUS_FUNCTION_2, str_to_cbus(cfg_getstr(cfg, "cbus2"), 13));
-		eeprom_set_value(ftdi, CBUS_FUNCTION_3, str_to_cbus(cfg_getstr(cfg, "cbus3"), 13));
-		eeprom_set_value(ftdi, CBUS_FUNCTION_4, str_to_cbus(cfg_getstr(cfg, "cbus4"), 9));
-		int invert = 0;
-		if (cfg_getbool(cfg, "invert_rxd")) invert |= INVERT_RXD;
-		if (cfg_getbool(cfg, "invert_txd")) invert |= INVERT_TXD;
-		if (cfg_getbool(cfg, "invert_rts")) invert |= INVERT_RTS;
-		if (cfg_getbool(cfg, "invert_cts")) invert |= INVERT_CTS;
-		if (cfg_getbool(cfg, "invert_dtr")) invert |= INVERT_DTR;
-		if (cfg_getbool(cfg, "invert_dsr")) invert |= INVERT_DSR;
-		if (cfg_getbool(cfg, "invert_dcd")) invert |= INVERT_DCD;
-		if (cfg_getbool(cfg, "invert_ri")) invert |= INVERT_RI;
-		eeprom_set_value(ftdi, INVERT, invert);
-
-		eeprom_set_value(ftdi, CHANNEL_A_DRIVER, str_to_drvr(cfg_getstr(cfg,"channel_a_driver")) ? DRIVER_VCP : 0);
-		eeprom_set_value(ftdi, CHANNEL_B_DRIVER, str_to_drvr(cfg_getstr(cfg,"channel_b_driver")) ? DRIVER_VCP : 0);
-		eeprom_set_value(ftdi, CHANNEL_C_DRIVER, str_to_drvr(cfg_getstr(cfg,"channel_c_driver")) ? DRIVER_VCP : 0);
-		eeprom_set_value(ftdi, CHANNEL_D_DRIVER, str_to_drvr(cfg_getstr(cfg,"channel_d_driver")) ? DRIVER_VCP : 0);
-		eeprom_set_value(ftdi, CHANNEL_A_RS485, cfg_getbool(cfg,"channel_a_rs485"));
-		eeprom_set_value(ftdi, CHANNEL_B_RS485, cfg_getbool(cfg,"channel_b_rs485"));
-		eeprom_set_value(ftdi, CHANNEL_C_RS485, cfg_getbool(cfg,"channel_c_rs485"));
-		eeprom_set_value(ftdi, CHANNEL_D_RS485, cfg_getbool(cfg,"channel_d_rs485"));
-
-		size_check = ftdi_eeprom_build(ftdi);
-
-		if (size_check == -1)
-		{
-			printf ("Sorry, the eeprom can only contain 128 bytes (100 bytes for your strings).\n");
-			printf ("You need to short your string by: %d bytes\n", size_check);
-			QUIT;
-		} else if (size_check < 0) {
-			printf ("ftdi_eeprom_build(): error: %d\n", size_check);
-		}
-		else
-		{
-			printf ("Used eeprom space: %d bytes\n", my_eeprom_size-size_check);
-		}
+		return_code = flash_session_program(session, &fopts);
 
-		if (cfg_getbool(cfg, "flash_raw"))
+	} else {
+		if(_stats > 0) { st = &run; stats_start(st); flash_session_set_stats(session, st); }
+		fdev_match_add(&match, option_vid, option_pid);
+		fdev_match_add(&match, 0x403, 0x6001);
+		if (flash_session_open(session, &match) != FLASH_OK) { QUIT; }
+		if (_write > 0)
 		{
-			if (filename != NULL && strlen(filename) > 0)
-			{
-				eeprom_buf = malloc(max_eeprom_size);
-				FILE *fp = fopen(filename, "rb");
-				if (fp == NULL)
-				{
-					printf ("Can't open eeprom file %s.\n", filename);
-					QUIT;
-				}
-				my_eeprom_size = fread(eeprom_buf, 1, max_eeprom_size, fp);
-				fclose(fp);
-				if (my_eeprom_size < 128)
-				{
-					printf ("Can't read eeprom file %s.\n", filename);
-					QUIT;
-				}
+			/* if we are writing a raw image... */
+			struct flash_options fopts = { _decode, _debug, _force, _verify, _stats, _reenum_ms, NULL, NULL };
+			unsigned char image[FTDI_MAX_EEPROM_SIZE];
 
-				ftdi_set_eeprom_buf(ftdi, eeprom_buf, my_eeprom_size);
-			}
+			printf("Writing image...\n");
+			if ((f = flash_load_image(image_filename, image, sizeof(image))) < 0) { QUIT; }
+			return_code = flash_session_write(session, image, f, &fopts);
 		}
-		if((f=ftdi_write_eeprom(ftdi)))
-			printf ("FTDI write eeprom: %d (%s)\n", f,ftdi_get_error_string(ftdi));
-		libusb_reset_device(ftdi->usb_dev);
-
-		if(_decode > 0) read_decode_eeprom(ftdi,_debug);
-
-		cfg_free(cfg);
-
-	} else {
-		i = locate_ftdi_device(ftdi,option_vid,option_pid, 0x403, 0x6001);
-		if(i != 0) { QUIT; }
-		if (_read > 0)
+		else if (_read > 0)
 		{
 			/* if we are reading... */
+			unsigned char image[FTDI_MAX_EEPROM_SIZE];
+			FILE *fp;
 
 			printf("Reading...\n");
+			/* ftdi_eeprom_decode() needs the size only libftdi's own reader records */
+			if (_decode > 0)
+				fdev_set_pipeline(1);
 
-			if((f=ftdi_read_eeprom(ftdi))) {
-				fprintf(stderr, "FTDI read eeprom: %d (%s)\n", f, ftdi_get_error_string(ftdi));
-			}
-
-			eeprom_get_value(ftdi, CHIP_SIZE, &my_eeprom_size);
+			if (flash_session_read(session, image, &my_eeprom_size) != FLASH_OK)
+				my_eeprom_size = -1;
 
 			if(my_eeprom_size > 0) printf("EEPROM size: %d\n", my_eeprom_size);
 			else { printf("No EEPROM or EEPROM not programmed.\n"); QUIT; }
 
-			if(_decode > 0) read_decode_eeprom(ftdi,_debug);
+			if(_decode > 0)
+				flash_session_decode(session, my_eeprom_size, _debug);
 
-			eeprom_buf = malloc(my_eeprom_size);
-			ftdi_get_eeprom_buf(ftdi, eeprom_buf, my_eeprom_size);
-			if (eeprom_buf == NULL)
-			{
-				fprintf(stderr, "Malloc failed, aborting\n");
-				goto cleanup;
-			}
 			if (filename != NULL && strlen(filename) > 0)
 			{
-
-				FILE *fp = fopen (filename, "wb");
 				printf("Writing eeprom data to %s\n",filename);
-				fwrite (eeprom_buf, 1, my_eeprom_size, fp);
+				if ((fp = fopen (filename, "wb")) == NULL) {
+					printf("Can't open %s\n", filename);
+					QUIT;
+				}
+				fwrite (image, 1, my_eeprom_size, fp);
 				fclose (fp);
 			}
 		} else {
 			/* if we are erasing... */
-			printf("Erasing...");
-			if((f = ftdi_erase_eeprom(ftdi))) {
-				printf("\n");
-				fprintf(stderr,"FTDI erase eeprom: %d (%s)\n",f, ftdi_get_error_string(ftdi));
-				QUIT;
-			}
+			printf("Erasing...\n");
+			if (flash_session_erase(session) != FLASH_OK) { QUIT; }
 		}
     }
 
 /* Finish up here */
 cleanup:
-	printf("command complete.\n");
-	if (eeprom_buf)
-		free(eeprom_buf);
-		if((f=ftdi_usb_close(ftdi)))
-			printf("FTDI close: %d (%s)\n", f, ftdi_get_error_string(ftdi));
+	if (!_quiet)
+		printf("command complete.\n");
+	bundle_close(bundle);
+	/* Closing adds the transfers of the device to st */
+	if (flash_session_close(session) != FLASH_OK)
+		fprintf(stderr, "FTDI close: %s\n", flash_session_error(session));
+	if (st) {
+		stats_finish(st, return_code);
+		stats_print_json(stats_out, st, 1);
+	}
+	if (stats_out && stats_out != stderr)
+		fclose(stats_out);
 
-	ftdi_deinit (ftdi);
-	ftdi_free (ftdi);
+	flash_session_free(session);
+	emu_cleanup();
 
-	printf("\n");
+	if (!_quiet)
+		printf("\n");
 	return return_code;
 }
@@ -0,0 +1,228 @@
+/***************************************************************************
+                            profile.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Product profiles.  A configuration file may describe several products
+ in named sections, each taking every setting of the file level:
+
+	profile "widget" {
+		vendor_id = 0x1234
+		product_id = 0x0001
+		product = "Widget"
+	}
+
+ Settings given at the file level apply to every profile that does not
+ set them itself, so a file may share its manufacturer, serial counter
+ or chip cache among its products.  The sections are indexed once after
+ parsing.  A device is given the profile it is already programmed as,
+ or failing that the profile whose target ids it carries, as long as
+ only one profile claims it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+/**
+ * @brief Give a profile the file level settings it does not set itself
+ *
+ * \param sec profile section
+ * \param cfg file level of the configuration
+ *
+ * libconfuse sections start from the defaults of their options, not
+ * from the values around them, so this is done by hand.
+ **/
+static void profile_inherit(cfg_t *sec, cfg_t *cfg)
+{
+	cfg_opt_t *opt, *own;
+	unsigned int i, k;
+
+	for (i = 0; cfg->opts[i].name; i++) {
+		opt = &cfg->opts[i];
+		if (opt->type == CFGT_SEC || !(opt->flags & CFGF_MODIFIED))
+			continue;
+		if ((own = cfg_getopt(sec, opt->name)) == NULL || (own->flags & CFGF_MODIFIED))
+			continue;
+		cfg_free_value(own);
+		for (k = 0; k < cfg_opt_size(opt); k++) {
+			switch (opt->type) {
+			case CFGT_INT:
+				cfg_opt_setnint(own, cfg_opt_getnint(opt, k), k);
+				break;
+			case CFGT_BOOL:
+				cfg_opt_setnbool(own, cfg_opt_getnbool(opt, k), k);
+				break;
+			case CFGT_STR:
+				cfg_opt_setnstr(own, cfg_opt_getnstr(opt, k), k);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * @brief Index the profiles of a parsed configuration
+ *
+ * \param idx index to fill
+ * \param cfg parsed configuration, which must outlive the index
+ *
+ * Every profile section first takes the file level settings it does
+ * not set itself, see profile_inherit().
+ * Returns the number of profiles, or -1 if out of memory.
+ **/
+int profile_index_build(struct profile_index *idx, cfg_t *cfg)
+{
+	int i, n = cfg_size(cfg, "profile");
+	cfg_t *sec;
+
+	memset(idx, 0, sizeof(*idx));
+	if ((idx->list = calloc(n ? n : 1, sizeof(*idx->list))) == NULL)
+		return -1;
+
+	if (n == 0) {
+		idx->list[0].cfg = cfg;
+		n = 1;
+	}
+	for (i = 0; i < n; i++) {
+		if (idx->list[i].cfg == NULL) {
+			sec = cfg_getnsec(cfg, "profile", i);
+			profile_inherit(sec, cfg);
+			idx->list[i].name = cfg_title(sec);
+			idx->list[i].cfg = sec;
+		}
+		sec = idx->list[i].cfg;
+		idx->list[i].vid = cfg_getint(sec, "vendor_id");
+		idx->list[i].pid = cfg_getint(sec, "product_id");
+		idx->list[i].target_vid = cfg_getint(sec, "target_vendor_id");
+		idx->list[i].target_pid = cfg_getint(sec, "target_product_id");
+	}
+	idx->count = n;
+
+	return n;
+}
+
+/**
+ * @brief Release an index, but not the configuration it refers to
+ **/
+void profile_index_free(struct profile_index *idx)
+{
+	free(idx->list);
+	memset(idx, 0, sizeof(*idx));
+}
+
+/**
+ * @brief Profile of a given name, NULL if there is none
+ **/
+const struct profile *profile_find(const struct profile_index *idx, const char *name)
+{
+	int i;
+
+	for (i = 0; i < idx->count; i++)
+		if (idx->list[i].name && !strcmp(idx->list[i].name, name))
+			return &idx->list[i];
+
+	return NULL;
+}
+
+/**
+ * @brief Choose the profile of devices no profile claims
+ *
+ * \param idx index
+ * \param name profile name, NULL for none
+ *
+ * Blank devices all carry the same target ids, so a file of several
+ * products can only tell them apart by such a choice.
+ * Returns 0, or -1 if there is no profile of that name.
+ **/
+int profile_set_fallback(struct profile_index *idx, const char *name)
+{
+	const struct profile *p = NULL;
+
+	if (name && (p = profile_find(idx, name)) == NULL)
+		return -1;
+	idx->fallback = p;
+
+	return 0;
+}
+
+/**
+ * @brief Profile for a device
+ *
+ * \param idx index
+ * \param vid vendor id of the device
+ * \param pid product id of the device
+ *
+ * The profile programmed with these ids wins over the profile
+ * targeting them.  Returns the profile, the fallback if no profile or
+ * more than one claims the device, or NULL without a fallback.
+ **/
+const struct profile *profile_match(const struct profile_index *idx, int vid, int pid)
+{
+	const struct profile *found;
+	int i, n, target;
+
+	if (idx->count == 1 && idx->list[0].name == NULL)
+		return &idx->list[0];
+
+	for (target = 0; target < 2; target++) {
+		for (i = n = 0, found = NULL; i < idx->count; i++) {
+			if (target ? idx->list[i].target_vid != vid || idx->list[i].target_pid != pid
+				: idx->list[i].vid != vid || idx->list[i].pid != pid)
+				continue;
+			found = &idx->list[i];
+			n++;
+		}
+		if (n == 1)
+			return found;
+		if (n > 1)
+			break;
+	}
+
+	return idx->fallback;
+}
+
+/**
+ * @brief Distinct ids of the profiles
+ *
+ * \param idx index
+ * \param target nonzero for the target ids, zero for the programmed ids
+ * \param ids receives vid/pid pairs, zero ids left out
+ * \param max room in ids
+ *
+ * Returns the number of pairs stored.
+ **/
+int profile_ids(const struct profile_index *idx, int target, int ids[][2], int max)
+{
+	int i, j, n = 0, vid, pid;
+
+	for (i = 0; i < idx->count && n < max; i++) {
+		vid = target ? idx->list[i].target_vid : idx->list[i].vid;
+		pid = target ? idx->list[i].target_pid : idx->list[i].pid;
+		if (vid == 0 || pid == 0)
+			continue;
+		for (j = 0; j < n; j++)
+			if (ids[j][0] == vid && ids[j][1] == pid) break;
+		if (j < n)
+			continue;
+		ids[n][0] = vid;
+		ids[n][1] = pid;
+		n++;
+	}
+
+	return n;
+}
@@ -0,0 +1,50 @@
+/***************************************************************************
+                            profile.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <confuse.h>
+
+/**
+ * @brief One product of a configuration file
+ **/
+struct profile {
+	const char *name;           /**< section title, NULL for the file level */
+	int vid, pid;               /**< ids the product is programmed with */
+	int target_vid, target_pid; /**< ids of a blank or foreign device */
+	cfg_t *cfg;                 /**< settings of the product */
+};
+
+/**
+ * @brief Products of a configuration, looked up by the ids of a device
+ *
+ * A file without profile sections has a single unnamed entry holding
+ * the file level settings.
+ **/
+struct profile_index {
+	struct profile *list;
+	int count;
+	const struct profile *fallback; /**< for devices no profile claims, or NULL */
+};
+
+int profile_index_build(struct profile_index *idx, cfg_t *cfg);
+void profile_index_free(struct profile_index *idx);
+const struct profile *profile_find(const struct profile_index *idx, const char *name);
+int profile_set_fallback(struct profile_index *idx, const char *name);
+const struct profile *profile_match(const struct profile_index *idx, int vid, int pid);
+int profile_ids(const struct profile_index *idx, int target, int ids[][2], int max);
+
+#endif /* PROFILE_H */
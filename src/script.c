@@ -0,0 +1,349 @@
+/***************************************************************************
+                            script.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Command scripts for ftdi-flash-tool -c.  Commands are separated by
+ newlines or ';', '#' starts a comment, and arguments are key=value
+ pairs whose value may be double quoted:
+
+	open serial=FT1234; flash cfg=product.conf verify=written; close
+
+ Every command runs against one flash_session, so the libusb context,
+ the opened device and the parsed configuration carry over from one
+ command to the next.  flash and write leave the device unreset, so
+ verify still talks to the device that was written; a reset command,
+ or reset=1 on flash or write, makes it reload its eeprom.  Each
+ command prints exactly one result line,
+
+	<command> <status> ms=<elapsed> [key=value ...] [error="..."]
+
+ where status is ok, failed, verify_failed, no_device, no_config, busy,
+ mismatch or bad_command.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "script.h"
+
+#define SCRIPT_MAX_ARGS 8
+
+/**
+ * @brief One parsed command
+ **/
+struct script_cmd {
+	char *name;
+	char *keys[SCRIPT_MAX_ARGS];
+	char *values[SCRIPT_MAX_ARGS];
+	int n_args;
+};
+
+/**
+ * @brief State kept between the commands of a script
+ **/
+struct script {
+	struct flash_session *s;
+	const struct flash_options *defaults;
+	char cfg_name[512];         /**< file the session's configuration came from */
+	char details[512];          /**< key=value pairs for the result line */
+	int failed;                 /**< commands that did not succeed */
+};
+
+static const char *status_name[] = { "ok", "failed", "verify_failed", "no_device", "no_config", "busy", "mismatch" };
+
+/**
+ * @brief Value of a command argument
+ *
+ * Returns the value, or NULL if the argument was not given.
+ **/
+static const char *arg(const struct script_cmd *c, const char *key)
+{
+	int i;
+
+	for (i = 0; i < c->n_args; i++)
+		if (!strcmp(c->keys[i], key))
+			return c->values[i];
+
+	return NULL;
+}
+
+/**
+ * @brief Append key=value to the details of the result line
+ *
+ * Values with blanks or quotes are quoted, quotes inside them become
+ * single quotes and line breaks spaces, so the line stays one line.
+ **/
+static void detail(struct script *sc, const char *key, const char *value)
+{
+	int n = strlen(sc->details), quote = *value == '\0' || strpbrk(value, " \t\n\"") != NULL;
+
+	n += snprintf(sc->details + n, sizeof(sc->details) - n, " %s=%s", key, quote ? "\"" : "");
+	for (; *value && n < (int)sizeof(sc->details) - 2; value++)
+		sc->details[n++] = *value == '"' ? '\'' : (*value == '\n' || *value == '\t') ? ' ' : *value;
+	if (quote && n < (int)sizeof(sc->details) - 1)
+		sc->details[n++] = '"';
+	sc->details[n] = '\0';
+}
+
+/**
+ * @brief Load a configuration unless it is the one already loaded
+ **/
+static int use_config(struct script *sc, const char *filename)
+{
+	int f;
+
+	if (!strcmp(sc->cfg_name, filename))
+		return FLASH_OK;
+	sc->cfg_name[0] = '\0';
+	if ((f = flash_session_config(sc->s, filename)) == FLASH_OK)
+		snprintf(sc->cfg_name, sizeof(sc->cfg_name), "%s", filename);
+
+	return f;
+}
+
+/**
+ * @brief Carry out one command
+ *
+ * Returns an enum flash_result, or -1 for a command that is not
+ * understood.
+ **/
+static int run_command(struct script *sc, const struct script_cmd *c)
+{
+	struct flash_options fopts = *sc->defaults;
+	struct fdev_match m;
+	struct fdev *dev = flash_session_device(sc->s);
+	const struct profile *p;
+	unsigned char image[FTDI_MAX_EEPROM_SIZE];
+	const char *v;
+	char buf[32];
+	FILE *fp;
+	int f, size;
+
+	fopts.no_reset = 1;         /* unless asked to, the reset command does it */
+	if (!strcmp(c->name, "open")) {
+		memset(&m, 0, sizeof(m));
+		m.serial = arg(c, "serial");
+		m.product = arg(c, "product");
+		m.path = arg(c, "path");
+		if ((v = arg(c, "index")) != NULL)
+			m.index = atoi(v);
+		if (arg(c, "vid") && arg(c, "pid"))
+			fdev_match_add(&m, strtoul(arg(c, "vid"), NULL, 16), strtoul(arg(c, "pid"), NULL, 16));
+		if ((f = flash_session_open(sc->s, &m)) == FLASH_OK) {
+			detail(sc, "path", dev->path);
+			snprintf(buf, sizeof(buf), "%04x", dev->vid);
+			detail(sc, "vid", buf);
+			snprintf(buf, sizeof(buf), "%04x", dev->pid);
+			detail(sc, "pid", buf);
+			detail(sc, "serial", dev->serial);
+			if ((p = flash_session_match(sc->s)) != NULL && p->name)
+				detail(sc, "profile", p->name);
+		}
+		return f;
+	}
+	if (!strcmp(c->name, "close"))
+		return flash_session_close(sc->s);
+	if (!strcmp(c->name, "config")) {
+		if ((v = arg(c, "file")) == NULL)
+			return -1;
+		return use_config(sc, v);
+	}
+	if (!strcmp(c->name, "flash")) {
+		if ((v = arg(c, "cfg")) != NULL && (f = use_config(sc, v)) != FLASH_OK)
+			return f;
+		if ((v = arg(c, "profile")) != NULL && (f = flash_session_profile(sc->s, v)) != FLASH_OK)
+			return f;
+		if ((v = arg(c, "verify")) != NULL) {
+			if (!strcmp(v, "none"))
+				fopts.verify = VERIFY_NONE;
+			else if (!strcmp(v, "written"))
+				fopts.verify = VERIFY_WRITTEN;
+			else if (!strcmp(v, "full"))
+				fopts.verify = VERIFY_FULL;
+			else if (!strcmp(v, "checksum"))
+				fopts.verify = VERIFY_CHECKSUM;
+			else
+				return -1;
+		}
+		if ((v = arg(c, "force")) != NULL)
+			fopts.force = atoi(v);
+		if ((v = arg(c, "key")) != NULL)
+			fopts.key = v;
+		if ((v = arg(c, "reset")) != NULL)
+			fopts.no_reset = !atoi(v);
+		if ((f = flash_session_program(sc->s, &fopts)) == FLASH_OK &&
+				(p = flash_session_match(sc->s)) != NULL && p->name)
+			detail(sc, "profile", p->name);
+		return f;
+	}
+	if (!strcmp(c->name, "write")) {
+		if ((v = arg(c, "file")) == NULL)
+			return -1;
+		if ((size = flash_load_image(v, image, sizeof(image))) < 0)
+			return FLASH_FAILED;
+		if ((v = arg(c, "reset")) != NULL)
+			fopts.no_reset = !atoi(v);
+		return flash_session_write(sc->s, image, size, &fopts);
+	}
+	if (!strcmp(c->name, "read")) {
+		if ((f = flash_session_read(sc->s, image, &size)) != FLASH_OK)
+			return f;
+		snprintf(buf, sizeof(buf), "%d", size);
+		detail(sc, "size", buf);
+		if ((v = arg(c, "file")) != NULL && size > 0) {
+			if ((fp = fopen(v, "wb")) == NULL || fwrite(image, 1, size, fp) != (size_t)size) {
+				if (fp)
+					fclose(fp);
+				flash_log(FLASH_LOG_ERROR, "Can't write %s\n", v);
+				return FLASH_FAILED;
+			}
+			fclose(fp);
+		}
+		return FLASH_OK;
+	}
+	if (!strcmp(c->name, "verify"))
+		return flash_session_verify(sc->s);
+	if (!strcmp(c->name, "check")) {
+		if ((v = arg(c, "cfg")) != NULL && (f = use_config(sc, v)) != FLASH_OK)
+			return f;
+		if ((v = arg(c, "profile")) != NULL && (f = flash_session_profile(sc->s, v)) != FLASH_OK)
+			return f;
+		return flash_session_check(sc->s);
+	}
+	if (!strcmp(c->name, "erase"))
+		return flash_session_erase(sc->s);
+	if (!strcmp(c->name, "reset"))
+		return flash_session_reset(sc->s);
+
+	return -1;
+}
+
+/**
+ * @brief Split one command into its name and arguments
+ *
+ * \param p command text, modified in place
+ * \param c receives the command
+ *
+ * Returns 0 on success, -1 if an argument is not key=value or there
+ * are too many.
+ **/
+static int parse_command(char *p, struct script_cmd *c)
+{
+	char *eq;
+
+	memset(c, 0, sizeof(*c));
+	while (*p == ' ' || *p == '\t')
+		p++;
+	c->name = p;
+	while (*p && *p != ' ' && *p != '\t')
+		p++;
+	while (*p) {
+		*p++ = '\0';
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\0')
+			break;
+		eq = p + strcspn(p, "= \t");
+		if (c->n_args == SCRIPT_MAX_ARGS || *eq != '=')
+			return -1;
+		c->keys[c->n_args] = p;
+		*eq = '\0';
+		p = eq + 1;
+		if (*p == '"') {
+			c->values[c->n_args++] = ++p;
+			while (*p && *p != '"')
+				p++;
+			if (*p == '\0')
+				return -1;
+			*p++ = '\0';
+			if (*p && *p != ' ' && *p != '\t')
+				return -1;
+		} else {
+			c->values[c->n_args++] = p;
+			while (*p && *p != ' ' && *p != '\t')
+				p++;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Run a command script against a session
+ *
+ * \param in script to read
+ * \param out receives one result line per command
+ * \param s session carrying the device and configuration between
+ *         commands
+ * \param defaults flash options for flash and write commands, which
+ *         their arguments may override; they never reset the device
+ *         unless given reset=1
+ *
+ * The script ends at the end of in or at a quit command.  Failed
+ * commands do not stop it; the caller sees them in the result lines.
+ * Returns the number of commands that did not succeed.
+ **/
+int script_run(FILE *in, FILE *out, struct flash_session *s, const struct flash_options *defaults)
+{
+	struct script sc;
+	struct script_cmd c;
+	struct timespec start, end;
+	char line[4096], *p, *cmd;
+	int f, quoted, sep;
+
+	memset(&sc, 0, sizeof(sc));
+	sc.s = s;
+	sc.defaults = defaults;
+
+	while (fgets(line, sizeof(line), in)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		for (cmd = p = line, quoted = 0; ; p++) {
+			if (*p == '"')
+				quoted = !quoted;
+			if (*p != '\0' && (quoted || (*p != ';' && *p != '#')))
+				continue;
+
+			sep = *p;
+			*p = '\0';
+			sc.details[0] = '\0';
+			if (parse_command(cmd, &c) < 0) {
+				fprintf(out, "%s bad_command ms=0.000 error=\"can't parse arguments\"\n", c.name);
+				sc.failed++;
+			} else if (!strcmp(c.name, "quit") || !strcmp(c.name, "exit")) {
+				fprintf(out, "%s ok ms=0.000\n", c.name);
+				fflush(out);
+				return sc.failed;
+			} else if (*c.name) {
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				f = run_command(&sc, &c);
+				clock_gettime(CLOCK_MONOTONIC, &end);
+				if (f != FLASH_OK) {
+					sc.failed++;
+					detail(&sc, "error", f < 0 ? "unknown command or bad arguments" : flash_session_error(s));
+				}
+				fprintf(out, "%s %s ms=%.3f%s\n", c.name, f < 0 ? "bad_command" : status_name[f],
+					(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, sc.details);
+			}
+			fflush(out);
+			if (sep != ';')
+				break;
+			cmd = p + 1;
+		}
+	}
+
+	return sc.failed;
+}
@@ -0,0 +1,25 @@
+/***************************************************************************
+                            script.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdio.h>
+
+#include "ftdiflash.h"
+
+int script_run(FILE *in, FILE *out, struct flash_session *s, const struct flash_options *defaults);
+
+#endif /* SCRIPT_H */
@@ -0,0 +1,177 @@
+/***************************************************************************
+                         serial_alloc.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Serial numbers are handed out from a counter file shared by every
+ ftdi-flash-tool process on the host.  The file holds a single 64 bit
+ counter which is mapped shared and incremented with an atomic add, so
+ concurrent processes never see the same value and never wait on a lock.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "serial_alloc.h"
+
+/**
+ * @brief Split a serial template around its counter conversion
+ *
+ * \param tmpl template such as "ACME-%06d"
+ * \param zero set to 1 if the conversion is zero padded
+ * \param width receives the field width
+ * \param conv receives the conversion character (d, u, x or X)
+ *
+ * Function returns the offset of the conversion in tmpl, or -1 if
+ * tmpl does not hold exactly one counter conversion.  "%%" is
+ * accepted as a literal percent sign.
+ **/
+static int parse_template(const char *tmpl, int *zero, int *width, char *conv)
+{
+	const char *p;
+	int pos = -1;
+
+	for (p = tmpl; *p; p++) {
+		if (*p != '%')
+			continue;
+		if (p[1] == '%') {
+			p++;
+			continue;
+		}
+		if (pos >= 0)
+			return -1;
+		pos = p - tmpl;
+		p++;
+		*zero = (*p == '0');
+		if (*zero)
+			p++;
+		*width = 0;
+		while (*p >= '0' && *p <= '9')
+			*width = *width * 10 + (*p++ - '0');
+		if (*width > 20 || !strchr("duxX", *p) || *p == '\0')
+			return -1;
+		*conv = *p;
+	}
+
+	return pos;
+}
+
+/**
+ * @brief Check whether a serial string is a counter template
+ *
+ * \param tmpl serial string from the configuration
+ *
+ * Function returns 1 if tmpl holds a valid counter conversion.
+ **/
+int serial_is_template(const char *tmpl)
+{
+	int zero, width;
+	char conv;
+
+	return tmpl != NULL && parse_template(tmpl, &zero, &width, &conv) >= 0;
+}
+
+/**
+ * @brief Expand a serial template
+ *
+ * \param tmpl template such as "ACME-%06d"
+ * \param value counter value to insert
+ * \param buf buffer receiving the serial
+ * \param len size of buf
+ *
+ * Function returns 0 on success, -1 if tmpl is invalid or the
+ * result does not fit in buf.
+ **/
+int serial_format(const char *tmpl, long value, char *buf, int len)
+{
+	char fmt[8], num[32];
+	const char *p;
+	int zero, width, n = 0;
+	char conv;
+
+	if (parse_template(tmpl, &zero, &width, &conv) < 0)
+		return -1;
+
+	snprintf(fmt, sizeof(fmt), "%%%s*l%c", zero ? "0" : "", conv);
+	snprintf(num, sizeof(num), fmt, width, value);
+
+	for (p = tmpl; *p && n < len; p++) {
+		if (*p != '%') {
+			buf[n++] = *p;
+		} else if (p[1] == '%') {
+			buf[n++] = '%';
+			p++;
+		} else {
+			if (n + (int)strlen(num) >= len)
+				return -1;
+			strcpy(buf + n, num);
+			n += strlen(num);
+			p += strspn(p + 1, "0123456789") + 1;
+		}
+	}
+	if (n >= len)
+		return -1;
+	buf[n] = '\0';
+
+	return 0;
+}
+
+/**
+ * @brief Allocate the next counter value
+ *
+ * \param counter_file counter file shared by all processes, created
+ *         on first use
+ * \param sync nonzero to flush the counter to disk before returning,
+ *         so that a power loss never hands out a value twice
+ * \param offset receives the allocated value, starting at 0
+ *
+ * Function returns 0 on success, -1 on error.
+ **/
+int serial_alloc_next(const char *counter_file, int sync, long *offset)
+{
+	struct stat st;
+	uint64_t *counter;
+	int fd;
+
+	if ((fd = open(counter_file, O_RDWR | O_CREAT, 0644)) < 0) {
+		perror(counter_file);
+		return -1;
+	}
+	/* Growing to the same size is harmless if another process races us */
+	if (fstat(fd, &st) < 0 ||
+		(st.st_size < (off_t)sizeof(*counter) && ftruncate(fd, sizeof(*counter)) < 0)) {
+		perror(counter_file);
+		close(fd);
+		return -1;
+	}
+	counter = mmap(NULL, sizeof(*counter), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (counter == MAP_FAILED) {
+		perror(counter_file);
+		return -1;
+	}
+
+	*offset = (long)__atomic_fetch_add(counter, 1, __ATOMIC_SEQ_CST);
+	if (sync)
+		msync(counter, sizeof(*counter), MS_SYNC);
+	munmap(counter, sizeof(*counter));
+
+	return 0;
+}
@@ -0,0 +1,23 @@
+/***************************************************************************
+                         serial_alloc.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef SERIAL_ALLOC_H
+#define SERIAL_ALLOC_H
+
+int serial_is_template(const char *tmpl);
+int serial_format(const char *tmpl, long value, char *buf, int len);
+int serial_alloc_next(const char *counter_file, int sync, long *offset);
+
+#endif /* SERIAL_ALLOC_H */
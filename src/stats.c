@@ -0,0 +1,166 @@
+/***************************************************************************
+                            stats.c  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+/*
+ Per-phase timing of flash cycles.  Every phase is measured from the end
+ of the previous one on CLOCK_MONOTONIC, so the phases of a run add up to
+ its total.  All functions accept a NULL run and then do nothing.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+static const char *phase_names[PHASE_COUNT] = {
+	"open", "read", "detect", "config", "build",
+	"write", "verify", "reset", "decode", "erase", "reenum"
+};
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/**
+ * @brief Start timing a run
+ *
+ * \param st run to reset and start
+ **/
+void stats_start(struct run_stats *st)
+{
+	if (st == NULL)
+		return;
+	memset(st, 0, sizeof(*st));
+	clock_gettime(CLOCK_MONOTONIC, &st->start);
+	st->mark = st->start;
+}
+
+/**
+ * @brief Account the time since the last mark to a phase
+ *
+ * \param st run being timed
+ * \param phase enum stats_phase that just ended
+ **/
+void stats_phase(struct run_stats *st, int phase)
+{
+	struct timespec now;
+
+	if (st == NULL)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	st->phase_ms[phase] += elapsed_ms(&st->mark, &now);
+	st->mark = now;
+}
+
+/**
+ * @brief Count USB control transfers
+ *
+ * \param st run being timed
+ * \param ops number of transfers issued, as counted by the device
+ *         layer in struct fdev
+ **/
+void stats_usb(struct run_stats *st, int ops)
+{
+	if (st)
+		st->usb_ops += ops;
+}
+
+/**
+ * @brief Stop timing a run
+ *
+ * \param st run being timed
+ * \param result exit status of the run
+ **/
+void stats_finish(struct run_stats *st, int result)
+{
+	struct timespec now;
+
+	if (st == NULL)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	st->total_ms = elapsed_ms(&st->start, &now);
+	st->result = result;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print min/median/p99 of a set of samples as a JSON object
+ **/
+static void print_summary(FILE *f, const char *name, double *v, int n)
+{
+	double median;
+	int p99;
+
+	qsort(v, n, sizeof(*v), cmp_double);
+	median = (n % 2) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+	p99 = (n * 99 + 99) / 100 - 1;
+	fprintf(f, "\"%s\":{\"min\":%.3f,\"median\":%.3f,\"p99\":%.3f}", name, v[0], median, v[p99]);
+}
+
+/**
+ * @brief Print runs as a single line of JSON
+ *
+ * \param f stream to print to
+ * \param runs finished runs
+ * \param n number of runs
+ *
+ * An "aggregate" object with min/median/p99 of every phase, of the
+ * total and of the USB operations is added when more than one run
+ * was made.
+ **/
+void stats_print_json(FILE *f, struct run_stats *runs, int n)
+{
+	double *v;
+	int i, p;
+
+	fprintf(f, "{\"runs\":[");
+	for (i = 0; i < n; i++) {
+		fprintf(f, "%s{\"device\":\"%s\",\"result\":%d,\"usb_ops\":%d,\"total_ms\":%.3f,\"phases_ms\":{",
+			i ? "," : "", runs[i].device, runs[i].result, runs[i].usb_ops, runs[i].total_ms);
+		for (p = 0; p < PHASE_COUNT; p++)
+			fprintf(f, "%s\"%s\":%.3f", p ? "," : "", phase_names[p], runs[i].phase_ms[p]);
+		fprintf(f, "}}");
+	}
+	fprintf(f, "]");
+
+	if (n > 1 && (v = malloc(n * sizeof(*v))) != NULL) {
+		fprintf(f, ",\"aggregate\":{\"count\":%d,", n);
+		for (i = 0; i < n; i++)
+			v[i] = runs[i].total_ms;
+		print_summary(f, "total_ms", v, n);
+		for (i = 0; i < n; i++)
+			v[i] = runs[i].usb_ops;
+		fprintf(f, ",");
+		print_summary(f, "usb_ops", v, n);
+		fprintf(f, ",\"phases_ms\":{");
+		for (p = 0; p < PHASE_COUNT; p++) {
+			for (i = 0; i < n; i++)
+				v[i] = runs[i].phase_ms[p];
+			if (p)
+				fprintf(f, ",");
+			print_summary(f, phase_names[p], v, n);
+		}
+		fprintf(f, "}}");
+		free(v);
+	}
+	fprintf(f, "}\n");
+}
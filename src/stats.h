@@ -0,0 +1,58 @@
+/***************************************************************************
+                            stats.h  -  description
+                           -------------------
+    copyright            : (C) 2013 by Brandon Warhurst
+    email                : roboknight AT gmail dot com
+ ***************************************************************************/
+
+/***************************************************************************
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License version 2 as     *
+ *   published by the Free Software Foundation.                            *
+ *                                                                         *
+ ***************************************************************************/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * @brief Phases of a flash cycle that are timed
+ **/
+enum stats_phase {
+	PHASE_OPEN = 0,
+	PHASE_READ,
+	PHASE_DETECT,
+	PHASE_CONFIG,
+	PHASE_BUILD,
+	PHASE_WRITE,
+	PHASE_VERIFY,
+	PHASE_RESET,
+	PHASE_DECODE,
+	PHASE_ERASE,
+	PHASE_REENUM,       /**< waiting for the device to come back after reset */
+	PHASE_COUNT
+};
+
+/**
+ * @brief Timing and USB traffic of one device run
+ **/
+struct run_stats {
+	char device[32];                /**< USB bus/port path */
+	int result;                     /**< exit status of the run */
+	int usb_ops;                    /**< eeprom control transfers issued */
+	double phase_ms[PHASE_COUNT];
+	double total_ms;
+	struct timespec start, mark;
+};
+
+void stats_start(struct run_stats *st);
+void stats_phase(struct run_stats *st, int phase);
+void stats_usb(struct run_stats *st, int ops);
+void stats_finish(struct run_stats *st, int result);
+void stats_print_json(FILE *f, struct run_stats *runs, int n);
+
+#endif /* STATS_H */